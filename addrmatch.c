@@ -203,15 +203,32 @@ addr_cmp(const struct xaddr *a, const struct xaddr *b)
  * Parse string address 'p' into 'n'
  * Returns 0 on success, -1 on failure.
  */
-static int
+int
 addr_pton(const char *p, struct xaddr *n)
 {
 	struct addrinfo hints, *ai;
 
+	if (p == NULL)
+		return -1;
+
+	/* Plain addresses need no resolver; leave the rest to getaddrinfo */
+	if (n != NULL) {
+		memset(n, '\0', sizeof(*n));
+		if (inet_pton(AF_INET, p, &n->v4) == 1) {
+			n->af = AF_INET;
+			return 0;
+		}
+		if (strchr(p, '%') == NULL &&
+		    inet_pton(AF_INET6, p, &n->v6) == 1) {
+			n->af = AF_INET6;
+			return 0;
+		}
+	}
+
 	memset(&hints, '\0', sizeof(hints));
 	hints.ai_flags = AI_NUMERICHOST;
 
-	if (p == NULL || getaddrinfo(p, NULL, &hints, &ai) != 0)
+	if (getaddrinfo(p, NULL, &hints, &ai) != 0)
 		return -1;
 
 	if (ai == NULL || ai->ai_addr == NULL)
@@ -347,113 +364,373 @@ addr_pton_cidr(const char *p, struct xaddr *n, u_int *l)
 	return 0;
 }
 
+/*
+ * Compiled address lists. Networks go in a path-compressed binary trie
+ * per address family, each node holding a prefix and whether a plain or
+ * a negated list entry names it, so that looking up an address visits
+ * only the prefixes on its path. Since a negated match anywhere in a
+ * list wins and otherwise any match counts, this gives the same result
+ * as testing the entries in order. IPv6 networks with a scope id, which
+ * only match addresses with the same one, and wildcard patterns are
+ * still tested one by one.
+ */
+#define ADDR_TRIE_POS	0x01
+#define ADDR_TRIE_NEG	0x02
+
+struct addr_trie {
+	struct xaddr	 net;		/* host bits are zero */
+	u_int		 masklen;
+	int		 flags;
+	u_int		 last;		/* last list position naming it */
+	struct addr_trie *child[2];
+};
+
+struct addr_list_ent {
+	int		 neg;
+	u_int		 pos;		/* position in the list */
+	char		*pattern;	/* wildcard, or NULL for a network */
+	struct xaddr	 net, mask;
+};
+
+struct addr_list {
+	struct addr_trie	*trie4, *trie6;
+	u_int			 num;	/* entries not in a trie */
+	struct addr_list_ent	*ent;
+};
+
+static inline int
+addr_bit(const struct xaddr *a, u_int n)
+{
+	return (a->addr8[n / 8] >> (7 - n % 8)) & 1;
+}
+
+/* Number of leading bits, up to max, that a and b have in common */
+static u_int
+addr_common_bits(const struct xaddr *a, const struct xaddr *b, u_int max)
+{
+	u_int n = 0;
+	u_int8_t x;
+
+	while (n < max && a->addr8[n / 8] == b->addr8[n / 8])
+		n += 8;
+	if (n < max)
+		for (x = a->addr8[n / 8] ^ b->addr8[n / 8]; !(x & 0x80);
+		    x <<= 1)
+			n++;
+	return MIN(n, max);
+}
+
+static struct addr_trie *
+addr_trie_node(const struct xaddr *a, u_int masklen, int flags, u_int pos)
+{
+	struct addr_trie *t = xcalloc(1, sizeof(*t));
+	struct xaddr mask;
+
+	addr_netmask(a->af, masklen, &mask);
+	addr_and(&t->net, a, &mask);
+	t->masklen = masklen;
+	t->flags = flags;
+	t->last = pos;
+	return t;
+}
+
+static void
+addr_trie_insert(struct addr_trie **tp, const struct xaddr *net,
+    u_int masklen, int flags, u_int pos)
+{
+	struct addr_trie *t, *n;
+	u_int common;
+
+	while ((t = *tp) != NULL) {
+		common = addr_common_bits(&t->net, net,
+		    MIN(t->masklen, masklen));
+		if (common == t->masklen && common == masklen) {
+			t->flags |= flags;
+			t->last = MAX(t->last, pos);
+			return;
+		}
+		if (common == t->masklen) {
+			tp = &t->child[addr_bit(net, common)];
+			continue;
+		}
+		/* t is not a prefix of net: put a node above it */
+		if (common == masklen)
+			n = addr_trie_node(net, masklen, flags, pos);
+		else {
+			n = addr_trie_node(net, common, 0, 0);
+			n->child[addr_bit(net, common)] =
+			    addr_trie_node(net, masklen, flags, pos);
+		}
+		n->child[addr_bit(&t->net, common)] = t;
+		*tp = n;
+		return;
+	}
+	*tp = addr_trie_node(net, masklen, flags, pos);
+}
+
+/*
+ * Returns the flags of all the prefixes containing a, and raises *last
+ * to the last list position naming one of them.
+ */
 static int
-addr_netmatch(const struct xaddr *host, const struct xaddr *net, u_int masklen)
+addr_trie_lookup(const struct addr_trie *t, const struct xaddr *a,
+    u_int *last)
+{
+	u_int max = addr_unicast_masklen(a->af);
+	int flags = 0;
+
+	while (t != NULL && addr_common_bits(&t->net, a, t->masklen) ==
+	    t->masklen) {
+		if (t->flags != 0)
+			*last = MAX(*last, t->last);
+		flags |= t->flags;
+		if (t->masklen == max)
+			break;
+		t = t->child[addr_bit(a, t->masklen)];
+	}
+	return flags;
+}
+
+static void
+addr_trie_free(struct addr_trie *t)
 {
-	struct xaddr tmp_mask, tmp_result;
+	if (t == NULL)
+		return;
+	addr_trie_free(t->child[0]);
+	addr_trie_free(t->child[1]);
+	xfree(t);
+}
 
-	if (host->af != net->af)
-		return -1;
+/* Parse an address for addr_list_match(). Returns NULL on failure. */
+struct xaddr *
+addr_parse(const char *addr)
+{
+	struct xaddr *n = xmalloc(sizeof(*n));
 
-	if (addr_netmask(host->af, masklen, &tmp_mask) == -1)
-		return -1;
-	if (addr_and(&tmp_result, host, &tmp_mask) == -1)
-		return -1;
-	return addr_cmp(&tmp_result, net);
+	if (addr_pton(addr, n) != 0) {
+		xfree(n);
+		return NULL;
+	}
+	return n;
+}
+
+static void
+addr_list_add(struct addr_list *l, u_int pos, int neg,
+    const struct xaddr *net, u_int masklen, const char *pattern)
+{
+	struct addr_list_ent *e;
+
+	if (pattern == NULL && (net->af == AF_INET ||
+	    net->scope_id == 0)) {
+		addr_trie_insert(net->af == AF_INET ? &l->trie4 : &l->trie6,
+		    net, masklen, neg ? ADDR_TRIE_NEG : ADDR_TRIE_POS, pos);
+		return;
+	}
+	l->ent = xrealloc(l->ent, l->num + 1, sizeof(*l->ent));
+	e = &l->ent[l->num++];
+	memset(e, 0, sizeof(*e));
+	e->neg = neg;
+	e->pos = pos;
+	if (pattern != NULL)
+		e->pattern = xstrdup(pattern);
+	else {
+		e->net = *net;
+		addr_netmask(net->af, masklen, &e->mask);
+	}
 }
 
 /*
- * Match "addr" against list pattern list "_list", which may contain a
- * mix of CIDR addresses and old-school wildcards.
- *
- * If addr is NULL, then no matching is performed, but _list is parsed
- * and checked for well-formedness.
+ * Compile pattern list "_list", which may contain a mix of CIDR addresses
+ * and old-school wildcards, for repeated matching with addr_list_match().
  *
- * Returns 1 on match found (never returned when addr == NULL).
- * Returns 0 on if no match found, or no errors found when addr == NULL.
- * Returns -1 on negated match found (never returned when addr == NULL).
- * Returns -2 on invalid list entry.
+ * On an invalid list entry, sets *bad and returns the entries before it,
+ * as a negated match among those still decides the list when it is
+ * matched in order. Otherwise *bad is set to 0.
  */
-int
-addr_match_list(const char *addr, const char *_list)
+struct addr_list *
+addr_list_compile_partial(const char *_list, int *bad)
 {
+	struct addr_list *l;
+	struct xaddr net;
 	char *list, *cp, *o;
-	struct xaddr try_addr, match_addr;
-	u_int masklen, neg;
-	int ret = 0, r;
+	u_int masklen, pos;
+	int r, neg;
 
-	if (addr != NULL && addr_pton(addr, &try_addr) != 0) {
-		debug2("%s: couldn't parse address %.100s", __func__, addr);
-		return 0;
-	}
-	if ((o = list = strdup(_list)) == NULL)
-		return -1;
-	while ((cp = strsep(&list, ",")) != NULL) {
+	*bad = 0;
+	l = xcalloc(1, sizeof(*l));
+	o = list = xstrdup(_list);
+	for (pos = 1; (cp = strsep(&list, ",")) != NULL; pos++) {
 		neg = *cp == '!';
 		if (neg)
 			cp++;
 		if (*cp == '\0') {
-			ret = -2;
+			*bad = 1;
 			break;
 		}
 		/* Prefer CIDR address matching */
-		r = addr_pton_cidr(cp, &match_addr, &masklen);
+		r = addr_pton_cidr(cp, &net, &masklen);
 		if (r == -2) {
 			error("Inconsistent mask length for "
 			    "network \"%.100s\"", cp);
-			ret = -2;
+			*bad = 1;
 			break;
-		} else if (r == 0) {
-			if (addr != NULL && addr_netmatch(&try_addr,
-                           &match_addr, masklen) == 0) {
- foundit:
-				if (neg) {
-					ret = -1;
-					break;
-				}
-				ret = 1;
-			}
-			continue;
-		} else {
+		} else if (r == 0)
+			addr_list_add(l, pos, neg, &net, masklen, NULL);
+		else {
 			/* If CIDR parse failed, try wildcard string match */
-			if (addr != NULL && match_pattern(addr, cp) == 1)
-				goto foundit;
+			addr_list_add(l, pos, neg, NULL, 0, cp);
 		}
 	}
 	xfree(o);
+	return l;
+}
 
-	return ret;
+/*
+ * As addr_list_compile_partial(), but returns NULL on invalid list entry.
+ */
+struct addr_list *
+addr_list_compile(const char *_list)
+{
+	struct addr_list *l;
+	int bad;
+
+	l = addr_list_compile_partial(_list, &bad);
+	if (bad) {
+		addr_list_free(l);
+		return NULL;
+	}
+	return l;
+}
+
+void
+addr_list_free(struct addr_list *l)
+{
+	u_int i;
+
+	addr_trie_free(l->trie4);
+	addr_trie_free(l->trie6);
+	for (i = 0; i < l->num; i++)
+		if (l->ent[i].pattern != NULL)
+			xfree(l->ent[i].pattern);
+	if (l->ent != NULL)
+		xfree(l->ent);
+	xfree(l);
 }
 
 /*
- * Match "addr" against list CIDR list "_list". Lexical wildcards and
- * negation are not supported. If "addr" == NULL, will verify structure
- * of "_list".
+ * Returns the flags of all the entries of l that match, and the last
+ * list position of one that does in *last.
+ */
+static int
+addr_list_lookup(const struct addr_list *l, const char *addr,
+    const struct xaddr *xa, u_int *last)
+{
+	const struct addr_list_ent *e;
+	struct xaddr tmp;
+	u_int i;
+	int flags = 0;
+
+	*last = 0;
+	if (xa->af == AF_INET)
+		flags = addr_trie_lookup(l->trie4, xa, last);
+	else if (xa->af == AF_INET6 && xa->scope_id == 0)
+		flags = addr_trie_lookup(l->trie6, xa, last);
+	for (i = 0; i < l->num; i++) {
+		e = &l->ent[i];
+		if (e->pattern != NULL) {
+			if (match_pattern(addr, e->pattern) != 1)
+				continue;
+		} else if (xa->af != e->net.af ||
+		    addr_and(&tmp, xa, &e->mask) == -1 ||
+		    addr_cmp(&tmp, &e->net) != 0)
+			continue;
+		flags |= e->neg ? ADDR_TRIE_NEG : ADDR_TRIE_POS;
+		*last = MAX(*last, e->pos);
+	}
+	return flags;
+}
+
+/*
+ * Match address "addr", already parsed into "xa", against compiled list
+ * "l". If xa is NULL, because addr could not be parsed, nothing matches.
+ *
+ * Returns 1 on match found, 0 if no match found and -1 on negated match
+ * found.
+ */
+int
+addr_list_match(const struct addr_list *l, const char *addr,
+    const struct xaddr *xa)
+{
+	u_int last;
+	int flags;
+
+	if (xa == NULL)
+		return 0;
+	flags = addr_list_lookup(l, addr, xa, &last);
+	if (flags & ADDR_TRIE_NEG)
+		return -1;
+	return (flags & ADDR_TRIE_POS) ? 1 : 0;
+}
+
+/*
+ * Match "addr" against list pattern list "_list", which may contain a
+ * mix of CIDR addresses and old-school wildcards.
+ *
+ * If addr is NULL, then no matching is performed, but _list is parsed
+ * and checked for well-formedness.
  *
  * Returns 1 on match found (never returned when addr == NULL).
  * Returns 0 on if no match found, or no errors found when addr == NULL.
- * Returns -1 on error
+ * Returns -1 on negated match found (never returned when addr == NULL).
+ * Returns -2 on invalid list entry.
  */
 int
-addr_match_cidr_list(const char *addr, const char *_list)
+addr_match_list(const char *addr, const char *_list)
 {
-	char *list, *cp, *o;
-	struct xaddr try_addr, match_addr;
-	u_int masklen;
-	int ret = 0, r;
+	struct addr_list *l;
+	struct xaddr try_addr;
+	int ret = 0, bad;
 
 	if (addr != NULL && addr_pton(addr, &try_addr) != 0) {
 		debug2("%s: couldn't parse address %.100s", __func__, addr);
 		return 0;
 	}
+	l = addr_list_compile_partial(_list, &bad);
+	if (addr != NULL)
+		ret = addr_list_match(l, addr, &try_addr);
+	addr_list_free(l);
+
+	/* A negated match ahead of the invalid entry still counts */
+	if (bad && ret != -1)
+		return -2;
+	return ret;
+}
+
+/*
+ * Compile CIDR list "_list" for addr_match_cidr_list(). Lexical wildcards
+ * and negation are not supported. Sets *bad to the position of the last
+ * entry with invalid characters, or 0 if there is none.
+ *
+ * Returns NULL on error.
+ */
+static struct addr_list *
+addr_cidr_list_compile(const char *_list, u_int *bad)
+{
+	char *list, *cp, *o;
+	struct addr_list *l;
+	struct xaddr match_addr;
+	u_int masklen, pos;
+	int r;
+
+	*bad = 0;
 	if ((o = list = strdup(_list)) == NULL)
-		return -1;
-	while ((cp = strsep(&list, ",")) != NULL) {
+		return NULL;
+	l = xcalloc(1, sizeof(*l));
+	for (pos = 1; (cp = strsep(&list, ",")) != NULL; pos++) {
 		if (*cp == '\0') {
 			error("%s: empty entry in list \"%.100s\"",
 			    __func__, o);
-			ret = -1;
-			break;
+			goto fail;
 		}
 
 		/*
@@ -466,35 +743,86 @@ addr_match_cidr_list(const char *addr, const char *_list)
 		if (strlen(cp) > INET6_ADDRSTRLEN + 3) {
 			error("%s: list entry \"%.100s\" too long",
 			    __func__, cp);
-			ret = -1;
-			break;
+			goto fail;
 		}
 #define VALID_CIDR_CHARS "0123456789abcdefABCDEF.:/"
 		if (strspn(cp, VALID_CIDR_CHARS) != strlen(cp)) {
 			error("%s: list entry \"%.100s\" contains invalid "
 			    "characters", __func__, cp);
-			ret = -1;
+			*bad = pos;
 		}
 
 		/* Prefer CIDR address matching */
 		r = addr_pton_cidr(cp, &match_addr, &masklen);
 		if (r == -1) {
 			error("Invalid network entry \"%.100s\"", cp);
-			ret = -1;
-			break;
+			goto fail;
 		} else if (r == -2) {
 			error("Inconsistent mask length for "
 			    "network \"%.100s\"", cp);
-			ret = -1;
-			break;
-		} else if (r == 0 && addr != NULL) {
-			if (addr_netmatch(&try_addr, &match_addr,
-			    masklen) == 0)
-				ret = 1;
-			continue;
-		}
+			goto fail;
+		} else if (r == 0)
+			addr_list_add(l, pos, 0, &match_addr, masklen, NULL);
 	}
 	xfree(o);
+	return l;
+ fail:
+	xfree(o);
+	addr_list_free(l);
+	return NULL;
+}
 
-	return ret;
+/*
+ * Match "addr" against list CIDR list "_list". Lexical wildcards and
+ * negation are not supported. If "addr" == NULL, will verify structure
+ * of "_list".
+ *
+ * The last list compiled for matching is kept, keyed on its string, as
+ * the same certificate source-address list is checked for every
+ * authentication attempt made with the certificate.
+ *
+ * Returns 1 on match found (never returned when addr == NULL).
+ * Returns 0 on if no match found, or no errors found when addr == NULL.
+ * Returns -1 on error
+ */
+int
+addr_match_cidr_list(const char *addr, const char *_list)
+{
+	static char *cache_list = NULL;
+	static struct addr_list *cache_l = NULL;
+	static u_int cache_bad = 0;
+	struct addr_list *l;
+	struct xaddr try_addr;
+	u_int bad, last;
+
+	if (addr == NULL) {
+		if ((l = addr_cidr_list_compile(_list, &bad)) == NULL)
+			return -1;
+		addr_list_free(l);
+		return bad != 0 ? -1 : 0;
+	}
+	if (addr_pton(addr, &try_addr) != 0) {
+		debug2("%s: couldn't parse address %.100s", __func__, addr);
+		return 0;
+	}
+	if (cache_list == NULL || strcmp(cache_list, _list) != 0) {
+		if ((l = addr_cidr_list_compile(_list, &bad)) == NULL)
+			return -1;
+		if (cache_list != NULL) {
+			xfree(cache_list);
+			addr_list_free(cache_l);
+		}
+		cache_list = xstrdup(_list);
+		cache_l = l;
+		cache_bad = bad;
+	}
+
+	/*
+	 * An entry with invalid characters is an error unless a later
+	 * entry, or the entry itself, matches.
+	 */
+	if (addr_list_lookup(cache_l, addr, &try_addr, &last) != 0 &&
+	    last >= cache_bad)
+		return 1;
+	return cache_bad != 0 ? -1 : 0;
 }
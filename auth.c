@@ -71,6 +71,7 @@
 #endif
 #include "authfile.h"
 #include "monitor_wrap.h"
+#include "nsscache.h"
 
 /* import */
 extern ServerOptions options;
@@ -82,6 +83,33 @@ extern struct passwd *privsep_pw;
 Buffer auth_debug;
 int auth_debug_init;
 
+/*
+ * Returns 1 if the user matches an entry of an AllowUsers-style list,
+ * compiled when the configuration was loaded, -1 if none does but an
+ * entry could not be evaluated, and 0 otherwise.
+ */
+static int
+match_user_list(struct user_pattern **pats, u_int num, const char *user,
+    const char *hostname, const char *ipaddr)
+{
+	struct xaddr *xa;
+	u_int i;
+	int r, ret = 0;
+
+	xa = addr_parse(ipaddr);
+	for (i = 0; i < num; i++) {
+		if ((r = match_user_compiled(pats[i], user, hostname, ipaddr,
+		    xa)) == 1) {
+			ret = 1;
+			break;
+		} else if (r == -1)
+			ret = -1;
+	}
+	if (xa != NULL)
+		xfree(xa);
+	return ret;
+}
+
 /*
  * Check if the user is allowed to log in via ssh. If user is listed
  * in DenyUsers or one of user's groups is listed in DenyGroups, false
@@ -96,7 +124,6 @@ allowed_user(struct passwd * pw)
 {
 	struct stat st;
 	const char *hostname = NULL, *ipaddr = NULL, *passwd = NULL;
-	u_int i;
 #ifdef USE_SHADOW
 	struct spwd *spw = NULL;
 #endif
@@ -184,28 +211,21 @@ allowed_user(struct passwd * pw)
 	}
 
 	/* Return false if user is listed in DenyUsers */
-	if (options.num_deny_users > 0) {
-		for (i = 0; i < options.num_deny_users; i++)
-			if (match_user(pw->pw_name, hostname, ipaddr,
-			    options.deny_users[i])) {
-				logit("User %.100s from %.100s not allowed "
-				    "because listed in DenyUsers",
-				    pw->pw_name, hostname);
-				return 0;
-			}
+	if (options.num_deny_users > 0 && match_user_list(
+	    options.deny_user_pats, options.num_deny_users, pw->pw_name,
+	    hostname, ipaddr) != 0) {
+		logit("User %.100s from %.100s not allowed "
+		    "because listed in DenyUsers",
+		    pw->pw_name, hostname);
+		return 0;
 	}
 	/* Return false if AllowUsers isn't empty and user isn't listed there */
-	if (options.num_allow_users > 0) {
-		for (i = 0; i < options.num_allow_users; i++)
-			if (match_user(pw->pw_name, hostname, ipaddr,
-			    options.allow_users[i]))
-				break;
-		/* i < options.num_allow_users iff we break for loop */
-		if (i >= options.num_allow_users) {
-			logit("User %.100s from %.100s not allowed because "
-			    "not listed in AllowUsers", pw->pw_name, hostname);
-			return 0;
-		}
+	if (options.num_allow_users > 0 && match_user_list(
+	    options.allow_user_pats, options.num_allow_users, pw->pw_name,
+	    hostname, ipaddr) != 1) {
+		logit("User %.100s from %.100s not allowed because "
+		    "not listed in AllowUsers", pw->pw_name, hostname);
+		return 0;
 	}
 	if (options.num_deny_groups > 0 || options.num_allow_groups > 0) {
 		/* Get the user's group access list (primary and supplementary) */
@@ -567,7 +587,7 @@ getpwnamallow(const char *user)
 	aix_setauthdb(user);
 #endif
 
-	pw = getpwnam(user);
+	pw = nsscache_getpwnam(user);
 
 #if defined(_AIX) && defined(HAVE_SETAUTHDB)
 	aix_restoreauthdb();
@@ -28,10 +28,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
@@ -58,6 +60,7 @@
 #include "misc.h"
 #include "authfile.h"
 #include "match.h"
+#include "atomicio.h"
 
 /* import */
 extern ServerOptions options;
@@ -254,17 +257,397 @@ match_principals_file(char *file, struct passwd *pw, struct KeyCert *cert)
 	return 0;
 }	
 
+/*
+ * Reads the key on an authorized_keys line into found. Returns 0 and sets
+ * *key_options to any options preceding it, or -1 if there is no key.
+ */
+static int
+user_key_parse_line(Key *found, char *line, char **key_options)
+{
+	char *cp;
+	int quoted = 0;
+
+	*key_options = NULL;
+
+	/* Skip leading whitespace, empty and comment lines. */
+	for (cp = line; *cp == ' ' || *cp == '\t'; cp++)
+		;
+	if (!*cp || *cp == '\n' || *cp == '#')
+		return -1;
+
+	if (key_read(found, &cp) == 1)
+		return 0;
+
+	/* no key?  check if there are options for this key */
+	debug2("user_key_allowed: check options: '%s'", cp);
+	*key_options = cp;
+	for (; *cp && (quoted || (*cp != ' ' && *cp != '\t')); cp++) {
+		if (*cp == '\\' && cp[1] == '"')
+			cp++;	/* Skip both */
+		else if (*cp == '"')
+			quoted = !quoted;
+	}
+	/* Skip remaining whitespace. */
+	for (; *cp == ' ' || *cp == '\t'; cp++)
+		;
+	if (key_read(found, &cp) != 1) {
+		debug2("user_key_allowed: advance: '%s'", cp);
+		/* still no key?  advance to next line*/
+		return -1;
+	}
+	return 0;
+}
+
+/* return 1 if the key found on a line of file allows key */
+static int
+user_key_match(struct passwd *pw, Key *key, Key *found, char *key_options,
+    char *file, u_long linenum)
+{
+	const char *reason;
+	char *fp;
+
+	if (key_is_cert(key)) {
+		if (!key_equal(found, key->cert->signature_key))
+			return 0;
+		if (auth_parse_options(pw, key_options, file,
+		    linenum) != 1)
+			return 0;
+		if (!key_is_cert_authority)
+			return 0;
+		fp = key_fingerprint(found, SSH_FP_MD5,
+		    SSH_FP_HEX);
+		debug("matching CA found: file %s, line %lu, %s %s",
+		    file, linenum, key_type(found), fp);
+		/*
+		 * If the user has specified a list of principals as
+		 * a key option, then prefer that list to matching
+		 * their username in the certificate principals list.
+		 */
+		if (authorized_principals != NULL &&
+		    !match_principals_option(authorized_principals,
+		    key->cert)) {
+			reason = "Certificate does not contain an "
+			    "authorized principal";
+ fail_reason:
+			xfree(fp);
+			error("%s", reason);
+			auth_debug_add("%s", reason);
+			return 0;
+		}
+		if (key_cert_check_authority(key, 0, 0,
+		    authorized_principals == NULL ? pw->pw_name : NULL,
+		    &reason) != 0)
+			goto fail_reason;
+		if (auth_cert_options(key, pw) != 0) {
+			xfree(fp);
+			return 0;
+		}
+		verbose("Accepted certificate ID \"%s\" "
+		    "signed by %s CA %s via %s", key->cert->key_id,
+		    key_type(found), fp, file);
+		xfree(fp);
+		return 1;
+	} else if (key_equal(found, key)) {
+		if (auth_parse_options(pw, key_options, file,
+		    linenum) != 1)
+			return 0;
+		if (key_is_cert_authority)
+			return 0;
+		debug("matching key found: file %s, line %lu",
+		    file, linenum);
+		fp = key_fingerprint(found, SSH_FP_MD5, SSH_FP_HEX);
+		verbose("Found matching %s key: %s",
+		    key_type(found), fp);
+		xfree(fp);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Sidecar index of an authorized_keys file, kept in file.idx when
+ * AuthorizedKeysIndex is set. It maps a hash of each key to the offset of
+ * its line, so that a key can be checked without parsing the whole file.
+ * The header records the identity, size and modification time of the file
+ * it was built from and the index is ignored if any of them differs.
+ *
+ * The index is written by sshd as the user and is not trusted: every line
+ * it points at is parsed and matched exactly as in a scan of the file, and
+ * a line that does not hold the expected key makes sshd fall back to the
+ * scan. At worst a bad index hides keys from the user that wrote it.
+ *
+ * Records are sorted by hash and then by offset, so that keys sharing a
+ * hash are tried in file order as a scan would. A file with more than
+ * AKIDX_MAXKEYS keys gets an index with a count of AKIDX_TOOMANY and no
+ * records, which sends later lookups straight to the scan.
+ */
+#define AKIDX_MAGIC	"AKIDX01"
+#define AKIDX_HDRLEN	(8 + 4 * 8 + 4)		/* magic, stat, count */
+#define AKIDX_HASHLEN	8
+#define AKIDX_RECLEN	(AKIDX_HASHLEN + 8 + 4)	/* hash, offset, linenum */
+#define AKIDX_MAXKEYS	(1024 * 1024)
+#define AKIDX_TOOMANY	0xffffffff
+
+/*
+ * An index is not saved for a file modified this recently before it was
+ * read, as it may have changed again since without its mtime moving.
+ */
+#define AKIDX_SETTLE_TIME	2
+
+struct akidx {
+	u_int	 nkeys;
+	u_char	*recs;		/* sorted by hash */
+};
+
+/* Last index that could not be created, not to be tried again */
+static char *akidx_unwritable = NULL;
+
+static int
+akidx_hash(Key *k, u_char *hash)
+{
+	u_char *raw;
+	u_int len;
+
+	if ((raw = key_fingerprint_raw(k, SSH_FP_MD5, &len)) == NULL)
+		return -1;
+	if (len < AKIDX_HASHLEN)
+		fatal("%s: short digest", __func__);
+	memcpy(hash, raw, AKIDX_HASHLEN);
+	xfree(raw);
+	return 0;
+}
+
+/* Orders records by hash, then by their big-endian offset */
+static int
+akidx_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, AKIDX_HASHLEN + 8);
+}
+
+static void
+akidx_header(u_char *hdr, struct stat *st, u_int nkeys)
+{
+	memcpy(hdr, AKIDX_MAGIC, 8);
+	put_u64(hdr + 8, st->st_dev);
+	put_u64(hdr + 16, st->st_ino);
+	put_u64(hdr + 24, st->st_size);
+	put_u64(hdr + 32, st->st_mtime);
+	put_u32(hdr + 40, nkeys);
+}
+
+/* Loads the index for the file described by st, if it is current */
+static int
+akidx_load(const char *idxfile, struct stat *st, struct akidx *idx)
+{
+	u_char hdr[AKIDX_HDRLEN], want[AKIDX_HDRLEN];
+	struct stat ist;
+	size_t len;
+	int fd;
+
+	if ((fd = open(idxfile, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fd, &ist) == -1 || !S_ISREG(ist.st_mode) ||
+	    atomicio(read, fd, hdr, sizeof(hdr)) != sizeof(hdr))
+		goto fail;
+	idx->nkeys = get_u32(hdr + 40);
+	akidx_header(want, st, idx->nkeys);
+	if (memcmp(hdr, want, sizeof(hdr)) != 0) {
+		debug("%s: %s is stale", __func__, idxfile);
+		goto fail;
+	}
+	len = idx->nkeys == AKIDX_TOOMANY ? 0 :
+	    (size_t)idx->nkeys * AKIDX_RECLEN;
+	if ((idx->nkeys > AKIDX_MAXKEYS && idx->nkeys != AKIDX_TOOMANY) ||
+	    (off_t)(AKIDX_HDRLEN + len) != ist.st_size)
+		goto fail;
+	idx->recs = xmalloc(len + 1);
+	if (atomicio(read, fd, idx->recs, len) != len) {
+		xfree(idx->recs);
+		goto fail;
+	}
+	close(fd);
+	return 0;
+ fail:
+	close(fd);
+	return -1;
+}
+
+/*
+ * Indexes every key in f and saves the result next to the file. Returns
+ * 0 on success, or -1 if the file should be scanned instead: when it has
+ * changed too recently or the index could not be written, in which case
+ * building it would cost more than the scan on every attempt.
+ */
+static int
+akidx_build(FILE *f, char *file, const char *idxfile, struct stat *st,
+    struct akidx *idx)
+{
+	char line[SSH_MAX_PUBKEY_BYTES], *key_options, *tmp;
+	u_char hdr[AKIDX_HDRLEN], *rec;
+	struct stat nst;
+	u_long linenum = 0;
+	u_int nalloc = 0;
+	size_t len;
+	off_t off;
+	Key *found;
+	int fd;
+
+	idx->nkeys = 0;
+	idx->recs = NULL;
+	if (st->st_mtime > time(NULL) - AKIDX_SETTLE_TIME ||
+	    (akidx_unwritable != NULL &&
+	    strcmp(akidx_unwritable, idxfile) == 0))
+		return -1;
+	xasprintf(&tmp, "%s.XXXXXXXXXX", idxfile);
+	if ((fd = mkstemp(tmp)) == -1) {
+		debug("%s: mkstemp %s: %s", __func__, tmp, strerror(errno));
+		xfree(tmp);
+		if (akidx_unwritable != NULL)
+			xfree(akidx_unwritable);
+		akidx_unwritable = xstrdup(idxfile);
+		return -1;
+	}
+	rewind(f);
+	for (;;) {
+		off = ftello(f);
+		if (read_keyfile_line(f, file, line, sizeof(line),
+		    &linenum) == -1)
+			break;
+		found = key_new(KEY_UNSPEC);
+		if (user_key_parse_line(found, line, &key_options) == 0) {
+			if (idx->nkeys == AKIDX_MAXKEYS) {
+				key_free(found);
+				idx->nkeys = AKIDX_TOOMANY;
+				break;
+			}
+			if (idx->nkeys == nalloc) {
+				nalloc = nalloc == 0 ? 256 : nalloc * 2;
+				idx->recs = xrealloc(idx->recs, nalloc,
+				    AKIDX_RECLEN);
+			}
+			rec = idx->recs + idx->nkeys * AKIDX_RECLEN;
+			if (akidx_hash(found, rec) == 0) {
+				put_u64(rec + AKIDX_HASHLEN, off);
+				put_u32(rec + AKIDX_HASHLEN + 8, linenum);
+				idx->nkeys++;
+			}
+		}
+		key_free(found);
+	}
+	if (idx->nkeys == AKIDX_TOOMANY) {
+		debug("%s: more than %u keys in %s", __func__, AKIDX_MAXKEYS,
+		    file);
+		len = 0;
+	} else {
+		if (idx->nkeys > 0)
+			qsort(idx->recs, idx->nkeys, AKIDX_RECLEN, akidx_cmp);
+		debug("%s: indexed %u keys in %lu lines of %s", __func__,
+		    idx->nkeys, linenum, file);
+		len = (size_t)idx->nkeys * AKIDX_RECLEN;
+	}
+
+	/* Don't save an index of a file that changed while it was read */
+	if (fstat(fileno(f), &nst) == -1 || nst.st_size != st->st_size ||
+	    nst.st_mtime != st->st_mtime) {
+		close(fd);
+		unlink(tmp);
+		xfree(tmp);
+		return 0;
+	}
+	akidx_header(hdr, st, idx->nkeys);
+	if (atomicio(vwrite, fd, hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    atomicio(vwrite, fd, idx->recs, len) != len) {
+		close(fd);
+		goto fail;
+	}
+	if (close(fd) == -1 || rename(tmp, idxfile) == -1)
+		goto fail;
+	xfree(tmp);
+	return 0;
+ fail:
+	debug("%s: cannot write %s: %s", __func__, idxfile, strerror(errno));
+	unlink(tmp);
+	xfree(tmp);
+	return 0;
+}
+
+/*
+ * Checks key against the lines of f listed for it in the index. Returns
+ * 1 or 0 as user_key_allowed2(), or -1 if the file must be scanned.
+ */
+static int
+user_key_indexed(struct passwd *pw, Key *key, char *file, FILE *f)
+{
+	char line[SSH_MAX_PUBKEY_BYTES], *key_options, *idxfile;
+	u_char hash[AKIDX_HASHLEN], h2[AKIDX_HASHLEN], *rec;
+	struct akidx idx;
+	struct stat st;
+	u_long linenum, dummy;
+	u_int lo, hi, mid;
+	int ret = 0;
+	Key *found;
+
+	if (fstat(fileno(f), &st) == -1 || akidx_hash(key_is_cert(key) ?
+	    key->cert->signature_key : key, hash) == -1)
+		return -1;
+	xasprintf(&idxfile, "%s.idx", file);
+	if (akidx_load(idxfile, &st, &idx) == -1 &&
+	    akidx_build(f, file, idxfile, &st, &idx) == -1)
+		ret = -1;
+	xfree(idxfile);
+	if (ret == 0 && idx.nkeys == AKIDX_TOOMANY)
+		ret = -1;
+	if (ret == -1) {
+		if (idx.recs != NULL)
+			xfree(idx.recs);
+		return -1;
+	}
+
+	/* Find the first record for the hash, the earliest in the file */
+	for (lo = 0, hi = idx.nkeys; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(idx.recs + mid * AKIDX_RECLEN, hash,
+		    AKIDX_HASHLEN) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < idx.nkeys && ret == 0; lo++) {
+		rec = idx.recs + lo * AKIDX_RECLEN;
+		if (memcmp(rec, hash, AKIDX_HASHLEN) != 0)
+			break;
+		linenum = get_u32(rec + AKIDX_HASHLEN + 8);
+		auth_clear_options();
+		dummy = 0;
+		found = key_new(KEY_UNSPEC);
+		if (fseeko(f, get_u64(rec + AKIDX_HASHLEN), SEEK_SET) == -1 ||
+		    read_keyfile_line(f, file, line, sizeof(line),
+		    &dummy) == -1 ||
+		    user_key_parse_line(found, line, &key_options) == -1 ||
+		    akidx_hash(found, h2) == -1 ||
+		    memcmp(hash, h2, sizeof(hash)) != 0) {
+			debug("%s: index for %s does not match line %lu",
+			    __func__, file, linenum);
+			ret = -1;
+		} else
+			ret = user_key_match(pw, key, found, key_options,
+			    file, linenum);
+		key_free(found);
+	}
+	if (idx.recs != NULL)
+		xfree(idx.recs);
+	return ret;
+}
+
 /* return 1 if user allows given key */
 static int
 user_key_allowed2(struct passwd *pw, Key *key, char *file)
 {
-	char line[SSH_MAX_PUBKEY_BYTES];
-	const char *reason;
+	char line[SSH_MAX_PUBKEY_BYTES], *key_options;
 	int found_key = 0;
 	FILE *f;
 	u_long linenum = 0;
 	Key *found;
-	char *fp;
 
 	/* Temporarily use the user's uid. */
 	temporarily_use_uid(pw);
@@ -277,101 +660,28 @@ user_key_allowed2(struct passwd *pw, Key *key, char *file)
 		return 0;
 	}
 
+	if (options.authorized_keys_index &&
+	    (found_key = user_key_indexed(pw, key, file, f)) != -1)
+		goto out;
+
+	rewind(f);
 	found_key = 0;
 	found = key_new(key_is_cert(key) ? KEY_UNSPEC : key->type);
 
 	while (read_keyfile_line(f, file, line, sizeof(line), &linenum) != -1) {
-		char *cp, *key_options = NULL;
-
 		auth_clear_options();
-
-		/* Skip leading whitespace, empty and comment lines. */
-		for (cp = line; *cp == ' ' || *cp == '\t'; cp++)
-			;
-		if (!*cp || *cp == '\n' || *cp == '#')
+		if (user_key_parse_line(found, line, &key_options) == -1)
 			continue;
-
-		if (key_read(found, &cp) != 1) {
-			/* no key?  check if there are options for this key */
-			int quoted = 0;
-			debug2("user_key_allowed: check options: '%s'", cp);
-			key_options = cp;
-			for (; *cp && (quoted || (*cp != ' ' && *cp != '\t')); cp++) {
-				if (*cp == '\\' && cp[1] == '"')
-					cp++;	/* Skip both */
-				else if (*cp == '"')
-					quoted = !quoted;
-			}
-			/* Skip remaining whitespace. */
-			for (; *cp == ' ' || *cp == '\t'; cp++)
-				;
-			if (key_read(found, &cp) != 1) {
-				debug2("user_key_allowed: advance: '%s'", cp);
-				/* still no key?  advance to next line*/
-				continue;
-			}
-		}
-		if (key_is_cert(key)) {
-			if (!key_equal(found, key->cert->signature_key))
-				continue;
-			if (auth_parse_options(pw, key_options, file,
-			    linenum) != 1)
-				continue;
-			if (!key_is_cert_authority)
-				continue;
-			fp = key_fingerprint(found, SSH_FP_MD5,
-			    SSH_FP_HEX);
-			debug("matching CA found: file %s, line %lu, %s %s",
-			    file, linenum, key_type(found), fp);
-			/*
-			 * If the user has specified a list of principals as
-			 * a key option, then prefer that list to matching
-			 * their username in the certificate principals list.
-			 */
-			if (authorized_principals != NULL &&
-			    !match_principals_option(authorized_principals,
-			    key->cert)) {
-				reason = "Certificate does not contain an "
-				    "authorized principal";
- fail_reason:
-				xfree(fp);
-				error("%s", reason);
-				auth_debug_add("%s", reason);
-				continue;
-			}
-			if (key_cert_check_authority(key, 0, 0,
-			    authorized_principals == NULL ? pw->pw_name : NULL,
-			    &reason) != 0)
-				goto fail_reason;
-			if (auth_cert_options(key, pw) != 0) {
-				xfree(fp);
-				continue;
-			}
-			verbose("Accepted certificate ID \"%s\" "
-			    "signed by %s CA %s via %s", key->cert->key_id,
-			    key_type(found), fp, file);
-			xfree(fp);
-			found_key = 1;
-			break;
-		} else if (key_equal(found, key)) {
-			if (auth_parse_options(pw, key_options, file,
-			    linenum) != 1)
-				continue;
-			if (key_is_cert_authority)
-				continue;
+		if (user_key_match(pw, key, found, key_options, file,
+		    linenum)) {
 			found_key = 1;
-			debug("matching key found: file %s, line %lu",
-			    file, linenum);
-			fp = key_fingerprint(found, SSH_FP_MD5, SSH_FP_HEX);
-			verbose("Found matching %s key: %s",
-			    key_type(found), fp);
-			xfree(fp);
 			break;
 		}
 	}
+	key_free(found);
+ out:
 	restore_uid();
 	fclose(f);
-	key_free(found);
 	if (!found_key)
 		debug2("key not found");
 	return found_key;
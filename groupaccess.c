@@ -37,10 +37,59 @@
 #include "groupaccess.h"
 #include "match.h"
 #include "log.h"
+#include "nsscache.h"
+
+/* match_pattern_list() gives up on list entries longer than this */
+#define GA_PATTERN_MAX	1022
 
 static int ngroups;
 static char **groups_byname;
 
+/*
+ * The user's group names are also kept in an open addressed hash table
+ * at most half full, so that literal AllowGroups, DenyGroups and Match
+ * Group entries are looked up directly; only entries with wildcards are
+ * matched against every group.
+ */
+static char **groups_hash;
+static u_int groups_hashsize;
+
+static u_int
+ga_hash(const char *name)
+{
+	u_int h = 2166136261U;		/* FNV-1a */
+
+	for (; *name != '\0'; name++)
+		h = (h ^ (u_char)*name) * 16777619U;
+	return h;
+}
+
+static int
+ga_lookup(const char *name)
+{
+	u_int i;
+
+	for (i = ga_hash(name) & (groups_hashsize - 1); groups_hash[i] != NULL;
+	    i = (i + 1) & (groups_hashsize - 1))
+		if (strcmp(groups_hash[i], name) == 0)
+			return 1;
+	return 0;
+}
+
+/* Return 1 if one of user's groups matches the wildcard pattern */
+static int
+ga_match_one(const char *pattern)
+{
+	int i;
+
+	if (strcspn(pattern, "*?") == strlen(pattern))
+		return ga_lookup(pattern);
+	for (i = 0; i < ngroups; i++)
+		if (match_pattern(groups_byname[i], pattern))
+			return 1;
+	return 0;
+}
+
 /*
  * Initialize group access list for user with primary (base) and
  * supplementary groups.  Return the number of groups in the list.
@@ -48,28 +97,27 @@ static char **groups_byname;
 int
 ga_init(const char *user, gid_t base)
 {
-	gid_t *groups_bygid;
-	int i, j;
-	struct group *gr;
+	char **names;
+	int i, n;
+	u_int h;
 
 	if (ngroups > 0)
 		ga_free();
 
-	ngroups = NGROUPS_MAX;
-#if defined(HAVE_SYSCONF) && defined(_SC_NGROUPS_MAX)
-	ngroups = MAX(NGROUPS_MAX, sysconf(_SC_NGROUPS_MAX));
-#endif
-
-	groups_bygid = xcalloc(ngroups, sizeof(*groups_bygid));
-	groups_byname = xcalloc(ngroups, sizeof(*groups_byname));
-
-	if (getgrouplist(user, base, groups_bygid, &ngroups) == -1)
-		logit("getgrouplist: groups list too small");
-	for (i = 0, j = 0; i < ngroups; i++)
-		if ((gr = getgrgid(groups_bygid[i])) != NULL)
-			groups_byname[j++] = xstrdup(gr->gr_name);
-	xfree(groups_bygid);
-	return (ngroups = j);
+	if ((n = nsscache_groupnames(user, base, &names)) == 0)
+		return (ngroups = 0);
+	groups_byname = xcalloc(n, sizeof(*groups_byname));
+	for (groups_hashsize = 16; groups_hashsize < 2 * (u_int)n; )
+		groups_hashsize <<= 1;
+	groups_hash = xcalloc(groups_hashsize, sizeof(*groups_hash));
+	for (i = 0; i < n; i++) {
+		groups_byname[i] = xstrdup(names[i]);
+		for (h = ga_hash(names[i]) & (groups_hashsize - 1);
+		    groups_hash[h] != NULL; h = (h + 1) & (groups_hashsize - 1))
+			;
+		groups_hash[h] = groups_byname[i];
+	}
+	return (ngroups = n);
 }
 
 /*
@@ -79,12 +127,13 @@ ga_init(const char *user, gid_t base)
 int
 ga_match(char * const *groups, int n)
 {
-	int i, j;
+	int j;
 
-	for (i = 0; i < ngroups; i++)
-		for (j = 0; j < n; j++)
-			if (match_pattern(groups_byname[i], groups[j]))
-				return 1;
+	if (ngroups == 0)
+		return 0;
+	for (j = 0; j < n; j++)
+		if (ga_match_one(groups[j]))
+			return 1;
 	return 0;
 }
 
@@ -95,20 +144,31 @@ ga_match(char * const *groups, int n)
 int
 ga_match_pattern_list(const char *group_pattern)
 {
-	int i, found = 0;
-	size_t len = strlen(group_pattern);
-
-	for (i = 0; i < ngroups; i++) {
-		switch (match_pattern_list(groups_byname[i],
-		    group_pattern, len, 0)) {
-		case -1:
-			return 0;	/* Negated match wins */
-		case 0:
+	char *list, *cp, *o;
+	int negated, found = 0;
+
+	if (ngroups == 0)
+		return 0;
+	o = list = xstrdup(group_pattern);
+	while ((cp = strsep(&list, ",")) != NULL) {
+		/* As match_pattern_list(), which ignores a trailing comma */
+		if (list == NULL && *cp == '\0')
+			break;
+		if ((negated = *cp == '!'))
+			cp++;
+		if (strlen(cp) > GA_PATTERN_MAX) {
+			found = 0;
+			break;
+		}
+		if (!ga_match_one(cp))
 			continue;
-		case 1:
-			found = 1;
+		if (negated) {
+			found = 0;	/* Negated match wins */
+			break;
 		}
+		found = 1;
 	}
+	xfree(o);
 	return found;
 }
 
@@ -125,5 +185,6 @@ ga_free(void)
 			xfree(groups_byname[i]);
 		ngroups = 0;
 		xfree(groups_byname);
+		xfree(groups_hash);
 	}
 }
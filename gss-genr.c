@@ -31,8 +31,12 @@
 #include <sys/types.h>
 #include <sys/param.h>
 
+#include <errno.h>
 #include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "xmalloc.h"
@@ -43,6 +47,7 @@
 #include "key.h"
 #include "kex.h"
 #include <openssl/evp.h>
+#include <openssl/sha.h>
 
 #include "ssh-gss.h"
 
@@ -75,16 +80,286 @@ ssh_gssapi_oid_table_ok() {
  * a key exchange with a bad mechanism
  */
 
+/*
+ * Probing a mechanism means a trial gss_init_sec_context(), usually a
+ * round trip to the KDC, so the client remembers which mechanisms passed
+ * for a host. Entries are keyed on a hash of the target host, the client
+ * principal and identity and the credential cache, and expire with the
+ * credentials they were probed with or after an hour, whichever is first.
+ * An entry is dropped when key exchange with one of its mechanisms fails.
+ */
+#define GSS_KEX_CACHE_MAXTTL	(60 * 60)
+#define GSS_KEX_CACHE_ENTRIES	64
+#define GSS_KEX_CACHE_KEYLEN	(SHA_DIGEST_LENGTH * 2 + 1)
+
+/* ",oid,oid," as hex, from the cache or built while probing */
+static char *gss_kex_cache_hit = NULL;
+static Buffer gss_kex_cache_probed;
+
+/* The entry the proposal came from, for ssh_gssapi_kex_cache_drop() */
+static char *gss_kex_cache_path = NULL;
+static char gss_kex_cache_key[GSS_KEX_CACHE_KEYLEN];
+
+static void
+ssh_gssapi_oid_hex(gss_OID oid, char *buf, size_t len)
+{
+	size_t i;
+
+	buf[0] = '\0';
+	for (i = 0; i < oid->length && i * 2 + 2 < len; i++)
+		snprintf(buf + i * 2, len - i * 2, "%02x",
+		    ((u_char *)oid->elements)[i]);
+}
+
+/*
+ * Work out the cache key for host and the credentials we would use, and
+ * when the credentials expire. Returns 0 on success, or -1 if there are
+ * no usable credentials, in which case nothing should be cached.
+ */
+static int
+ssh_gssapi_kex_cache_key(const char *host, const char *client, char *key,
+    size_t keylen, time_t *expires)
+{
+	gss_buffer_desc gssbuf;
+	gss_cred_id_t creds = GSS_C_NO_CREDENTIAL;
+	gss_name_t name = GSS_C_NO_NAME;
+	OM_uint32 major, minor, lifetime;
+	const EVP_MD *evp_md = EVP_sha1();
+	EVP_MD_CTX md;
+	u_char digest[EVP_MAX_MD_SIZE];
+	const char *ccache;
+	u_int i;
+
+	if (client != NULL) {
+		gssbuf.value = (void *)client;
+		gssbuf.length = strlen(client);
+		major = gss_import_name(&minor, &gssbuf, GSS_C_NT_USER_NAME,
+		    &name);
+		if (!GSS_ERROR(major))
+			major = gss_acquire_cred(&minor, name, 0,
+			    GSS_C_NO_OID_SET, GSS_C_INITIATE, &creds, NULL, NULL);
+		if (name != GSS_C_NO_NAME)
+			gss_release_name(&minor, &name);
+		if (GSS_ERROR(major))
+			return -1;
+	}
+	major = gss_inquire_cred(&minor, creds, &name, &lifetime, NULL, NULL);
+	if (creds != GSS_C_NO_CREDENTIAL)
+		gss_release_cred(&minor, &creds);
+	if (GSS_ERROR(major))
+		return -1;
+	major = gss_display_name(&minor, name, &gssbuf, NULL);
+	gss_release_name(&minor, &name);
+	if (GSS_ERROR(major) || lifetime == 0) {
+		if (!GSS_ERROR(major))
+			gss_release_buffer(&minor, &gssbuf);
+		return -1;
+	}
+
+	if ((ccache = getenv("KRB5CCNAME")) == NULL)
+		ccache = "";
+	EVP_DigestInit(&md, evp_md);
+	EVP_DigestUpdate(&md, host, strlen(host) + 1);
+	EVP_DigestUpdate(&md, gssbuf.value, gssbuf.length);
+	EVP_DigestUpdate(&md, "", 1);
+	if (client != NULL)
+		EVP_DigestUpdate(&md, client, strlen(client));
+	EVP_DigestUpdate(&md, "", 1);
+	EVP_DigestUpdate(&md, ccache, strlen(ccache) + 1);
+	EVP_DigestFinal(&md, digest, NULL);
+	gss_release_buffer(&minor, &gssbuf);
+
+	for (i = 0; i < SHA_DIGEST_LENGTH && i * 2 + 2 < keylen; i++)
+		snprintf(key + i * 2, keylen - i * 2, "%02x", digest[i]);
+	*expires = time(NULL) + MIN(lifetime, GSS_KEX_CACHE_MAXTTL);
+	return 0;
+}
+
+/*
+ * Read the live entries of the cache file, except the one for key, into
+ * lines. Returns the number read. If key is found, its mechanisms are
+ * returned through *mechs.
+ */
+static u_int
+ssh_gssapi_kex_cache_read(const char *path, const char *key, char ***lines,
+    char **mechs)
+{
+	FILE *f;
+	char line[4096], *cp, *ep;
+	time_t now = time(NULL);
+	long long expires;
+	u_int n = 0;
+
+	*lines = NULL;
+	if (mechs != NULL)
+		*mechs = NULL;
+	if ((f = fopen(path, "r")) == NULL) {
+		if (errno != ENOENT)
+			debug("%s: %s: %s", __func__, path, strerror(errno));
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		/* <key> <expiry> <oid>[,<oid>...] */
+		if ((cp = strchr(line, '\n')) == NULL)
+			continue;
+		*cp = '\0';
+		if (strlen(line) < GSS_KEX_CACHE_KEYLEN ||
+		    line[GSS_KEX_CACHE_KEYLEN - 1] != ' ')
+			continue;
+		expires = strtoll(line + GSS_KEX_CACHE_KEYLEN, &ep, 10);
+		if (*ep != ' ' || ep[1] == '\0' || expires <= now)
+			continue;
+		if (strncmp(line, key, GSS_KEX_CACHE_KEYLEN - 1) == 0) {
+			if (mechs != NULL)
+				xasprintf(mechs, ",%s,", ep + 1);
+			continue;
+		}
+		if (n >= GSS_KEX_CACHE_ENTRIES - 1) {
+			xfree((*lines)[0]);
+			memmove(*lines, *lines + 1, --n * sizeof(**lines));
+		}
+		*lines = xrealloc(*lines, n + 1, sizeof(**lines));
+		(*lines)[n++] = xstrdup(line);
+	}
+	fclose(f);
+	return n;
+}
+
+/* Replace the entry for key with mechs, or remove it if mechs is NULL */
+static void
+ssh_gssapi_kex_cache_store(const char *path, const char *key, time_t expires,
+    const char *mechs)
+{
+	FILE *f;
+	char **lines, *tmp;
+	u_int i, n;
+	int fd;
+
+	n = ssh_gssapi_kex_cache_read(path, key, &lines, NULL);
+	xasprintf(&tmp, "%s.XXXXXXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1 || (f = fdopen(fd, "w")) == NULL) {
+		debug("%s: %s: %s", __func__, tmp, strerror(errno));
+		if (fd != -1) {
+			close(fd);
+			unlink(tmp);
+		}
+		goto out;
+	}
+	for (i = 0; i < n; i++)
+		fprintf(f, "%s\n", lines[i]);
+	if (mechs != NULL)
+		fprintf(f, "%s %lld %s\n", key, (long long)expires, mechs);
+	if (fclose(f) != 0 || rename(tmp, path) == -1) {
+		debug("%s: %s: %s", __func__, path, strerror(errno));
+		unlink(tmp);
+	}
+ out:
+	for (i = 0; i < n; i++)
+		xfree(lines[i]);
+	if (lines != NULL)
+		xfree(lines);
+	xfree(tmp);
+}
+
+/*
+ * Called when GSSAPI key exchange fails, so that the next connection
+ * probes the mechanisms again rather than offering ones that no longer
+ * work.
+ */
+void
+ssh_gssapi_kex_cache_drop(void)
+{
+	if (gss_kex_cache_path == NULL)
+		return;
+	debug("Dropping cached GSSAPI key exchange mechanisms");
+	ssh_gssapi_kex_cache_store(gss_kex_cache_path, gss_kex_cache_key, 0,
+	    NULL);
+	xfree(gss_kex_cache_path);
+	gss_kex_cache_path = NULL;
+}
+
+/* Check functions for ssh_gssapi_kex_mechs() */
+static int
+ssh_gssapi_check_cached(Gssctxt **ctx, gss_OID oid, const char *host,
+    const char *client)
+{
+	char hex[260];
+
+	ssh_gssapi_oid_hex(oid, hex + 1, sizeof(hex) - 2);
+	hex[0] = ',';
+	strlcat(hex, ",", sizeof(hex));
+	return strstr(gss_kex_cache_hit, hex) != NULL;
+}
+
+static int
+ssh_gssapi_check_probe(Gssctxt **ctx, gss_OID oid, const char *host,
+    const char *client)
+{
+	char hex[258];
+
+	if (!ssh_gssapi_check_mechanism(ctx, oid, host, client))
+		return 0;
+	ssh_gssapi_oid_hex(oid, hex, sizeof(hex));
+	if (buffer_len(&gss_kex_cache_probed) > 0)
+		buffer_put_char(&gss_kex_cache_probed, ',');
+	buffer_append(&gss_kex_cache_probed, hex, strlen(hex));
+	return 1;
+}
+
+/*
+ * As ssh_gssapi_kex_mechs() with the mechanisms usable to reach host.
+ * If cachefile is not NULL, the probing results are kept there.
+ */
 char *
-ssh_gssapi_client_mechanisms(const char *host, const char *client) {
+ssh_gssapi_client_mechanisms(const char *host, const char *client,
+    const char *cachefile) {
 	gss_OID_set gss_supported;
 	OM_uint32 min_status;
+	char key[GSS_KEX_CACHE_KEYLEN], **lines, *mechs;
+	time_t expires;
+	u_int i, n;
 
 	if (GSS_ERROR(gss_indicate_mechs(&min_status, &gss_supported)))
 		return NULL;
 
-	return(ssh_gssapi_kex_mechs(gss_supported, ssh_gssapi_check_mechanism,
-	    host, client));
+	if (cachefile == NULL || ssh_gssapi_kex_cache_key(host, client, key,
+	    sizeof(key), &expires) == -1)
+		return(ssh_gssapi_kex_mechs(gss_supported,
+		    ssh_gssapi_check_mechanism, host, client));
+
+	n = ssh_gssapi_kex_cache_read(cachefile, key, &lines,
+	    &gss_kex_cache_hit);
+	for (i = 0; i < n; i++)
+		xfree(lines[i]);
+	if (lines != NULL)
+		xfree(lines);
+	if (gss_kex_cache_hit != NULL) {
+		debug("Using cached GSSAPI key exchange mechanisms for %s",
+		    host);
+		mechs = ssh_gssapi_kex_mechs(gss_supported,
+		    ssh_gssapi_check_cached, host, client);
+		xfree(gss_kex_cache_hit);
+		gss_kex_cache_hit = NULL;
+	} else {
+		buffer_init(&gss_kex_cache_probed);
+		mechs = ssh_gssapi_kex_mechs(gss_supported,
+		    ssh_gssapi_check_probe, host, client);
+		if (buffer_len(&gss_kex_cache_probed) > 0) {
+			buffer_put_char(&gss_kex_cache_probed, '\0');
+			ssh_gssapi_kex_cache_store(cachefile, key, expires,
+			    buffer_ptr(&gss_kex_cache_probed));
+		}
+		buffer_free(&gss_kex_cache_probed);
+	}
+	if (mechs == NULL)
+		return NULL;
+
+	/* Remember the entry in case key exchange fails */
+	if (gss_kex_cache_path != NULL)
+		xfree(gss_kex_cache_path);
+	gss_kex_cache_path = xstrdup(cachefile);
+	strlcpy(gss_kex_cache_key, key, sizeof(gss_kex_cache_key));
+	return mechs;
 }
 
 char *
@@ -323,7 +598,7 @@ ssh_gssapi_delete_ctx(Gssctxt **ctx)
 		xfree((*ctx)->oid);
 		(*ctx)->oid = GSS_C_NO_OID;
 	}
-	if ((*ctx)->creds != GSS_C_NO_CREDENTIAL)
+	if ((*ctx)->creds != GSS_C_NO_CREDENTIAL && !(*ctx)->creds_cached)
 		gss_release_cred(&ms, &(*ctx)->creds);
 	if ((*ctx)->client != GSS_C_NO_NAME)
 		gss_release_name(&ms, &(*ctx)->client);
@@ -30,9 +30,12 @@
 
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "openbsd-compat/sys-queue.h"
@@ -71,6 +74,107 @@ ssh_gssapi_mech* supported_mechs[]= {
 	&gssapi_null_mech,
 };
 
+/*
+ * Acceptor credentials are kept for reuse by later contexts, rather than
+ * read from the keytab for every one, along with the mechanisms the
+ * library supports. A connection keeps them for its lifetime, as its
+ * contexts may still refer to them. The listener, which holds no
+ * contexts between connections, drops them when the keytab changes or
+ * every SSH_GSSAPI_CRED_TTL seconds, in case it is not a file we can
+ * watch.
+ */
+#define SSH_GSSAPI_CRED_TTL	300
+#define SSH_GSSAPI_KEYTAB	"/etc/krb5.keytab"
+
+struct ssh_gssapi_cred_cache {
+	gss_OID_desc	oid;
+	gss_cred_id_t	creds;
+};
+
+static struct ssh_gssapi_cred_cache *cred_cache = NULL;
+static u_int cred_cache_len = 0;
+static time_t cred_cache_time = 0;
+static struct stat cred_cache_keytab;
+static gss_OID_set supported_oids = GSS_C_NO_OID_SET;
+
+/* Mechanisms usable for key exchange, as worked out by the listener */
+static gss_OID_set kex_oids = GSS_C_NO_OID_SET;
+
+static void
+ssh_gssapi_flush_creds(void)
+{
+	OM_uint32 ms;
+	u_int i;
+
+	for (i = 0; i < cred_cache_len; i++) {
+		gss_release_cred(&ms, &cred_cache[i].creds);
+		xfree(cred_cache[i].oid.elements);
+	}
+	if (cred_cache != NULL)
+		xfree(cred_cache);
+	cred_cache = NULL;
+	cred_cache_len = 0;
+	if (supported_oids != GSS_C_NO_OID_SET)
+		gss_release_oid_set(&ms, &supported_oids);
+	supported_oids = GSS_C_NO_OID_SET;
+}
+
+/* Returns 1, after emptying the caches, if they are out of date */
+static int
+ssh_gssapi_check_creds(void)
+{
+	struct stat st;
+	const char *keytab;
+	time_t now = time(NULL);
+
+	if ((keytab = getenv("KRB5_KTNAME")) == NULL)
+		keytab = SSH_GSSAPI_KEYTAB;
+	else if (strncmp(keytab, "FILE:", 5) == 0)
+		keytab += 5;
+	if (stat(keytab, &st) == -1)
+		memset(&st, 0, sizeof(st));
+	if (cred_cache_time != 0 && now >= cred_cache_time &&
+	    now - cred_cache_time < SSH_GSSAPI_CRED_TTL &&
+	    st.st_dev == cred_cache_keytab.st_dev &&
+	    st.st_ino == cred_cache_keytab.st_ino &&
+	    st.st_size == cred_cache_keytab.st_size &&
+	    st.st_mtime == cred_cache_keytab.st_mtime)
+		return 0;
+	if (cred_cache_time != 0)
+		debug("%s: dropping cached GSSAPI credentials", __func__);
+	ssh_gssapi_flush_creds();
+	cred_cache_keytab = st;
+	cred_cache_time = now;
+	return 1;
+}
+
+static gss_cred_id_t
+ssh_gssapi_cached_creds(gss_OID oid)
+{
+	u_int i;
+
+	for (i = 0; i < cred_cache_len; i++)
+		if (cred_cache[i].oid.length == oid->length &&
+		    memcmp(cred_cache[i].oid.elements, oid->elements,
+		    oid->length) == 0)
+			return cred_cache[i].creds;
+	return GSS_C_NO_CREDENTIAL;
+}
+
+static void
+ssh_gssapi_cache_creds(gss_OID oid, gss_cred_id_t creds)
+{
+	struct ssh_gssapi_cred_cache *c;
+
+	cred_cache = xrealloc(cred_cache, cred_cache_len + 1,
+	    sizeof(*cred_cache));
+	c = &cred_cache[cred_cache_len++];
+	c->oid.length = oid->length;
+	c->oid.elements = xmalloc(oid->length);
+	memcpy(c->oid.elements, oid->elements, oid->length);
+	c->creds = creds;
+}
+
 
 /*
  * Acquire credentials for a server running on the current host.
@@ -87,6 +191,12 @@ ssh_gssapi_acquire_cred(Gssctxt *ctx)
 	gss_OID_set oidset;
 
 	if (options.gss_strict_acceptor) {
+		ctx->creds = ssh_gssapi_cached_creds(ctx->oid);
+		if (ctx->creds != GSS_C_NO_CREDENTIAL) {
+			ctx->creds_cached = 1;
+			return (ctx->major = GSS_S_COMPLETE);
+		}
+
 		gss_create_empty_oid_set(&status, &oidset);
 		gss_add_oid_set_member(&status, ctx->oid, &oidset);
 
@@ -104,6 +214,10 @@ ssh_gssapi_acquire_cred(Gssctxt *ctx)
 		    ctx->name, 0, oidset, GSS_C_ACCEPT, &ctx->creds, 
 		    NULL, NULL)))
 			ssh_gssapi_error(ctx);
+		else {
+			ssh_gssapi_cache_creds(ctx->oid, ctx->creds);
+			ctx->creds_cached = 1;
+		}
 
 		gss_release_oid_set(&status, &oidset);
 		return (ctx->major);
@@ -125,16 +239,102 @@ ssh_gssapi_server_ctx(Gssctxt **ctx, gss_OID oid)
 	return (ssh_gssapi_acquire_cred(*ctx));
 }
 
+/* Unprivileged */
+static int
+ssh_gssapi_server_known_mech(Gssctxt **dum, gss_OID oid, const char *data,
+    const char *dummy) {
+	/* Already checked by the listener */
+	return (1);
+}
+
 /* Unprivileged */
 char *
 ssh_gssapi_server_mechanisms() {
 	gss_OID_set	supported;
 
+	if (kex_oids != GSS_C_NO_OID_SET)
+		return (ssh_gssapi_kex_mechs(kex_oids,
+		    &ssh_gssapi_server_known_mech, NULL, NULL));
+
 	ssh_gssapi_supported_oids(&supported);
 	return (ssh_gssapi_kex_mechs(supported, &ssh_gssapi_server_check_mech,
 	    NULL, NULL));
 }
 
+/*
+ * Privileged (listener). Work out which mechanisms key exchange can use,
+ * as ssh_gssapi_server_check_mech() does for each connection, so that
+ * connections can be given the answer instead. This also leaves the
+ * acceptor credentials cached for children that are not re-executed.
+ */
+void
+ssh_gssapi_server_prepare(void)
+{
+	gss_OID_set supported;
+	Gssctxt *ctx = NULL;
+	OM_uint32 ms;
+	size_t i;
+
+	if (!ssh_gssapi_check_creds() && kex_oids != GSS_C_NO_OID_SET)
+		return;
+	if (kex_oids != GSS_C_NO_OID_SET)
+		gss_release_oid_set(&ms, &kex_oids);
+
+	ssh_gssapi_supported_oids(&supported);
+	gss_create_empty_oid_set(&ms, &kex_oids);
+	for (i = 0; i < supported->count; i++) {
+		if (supported->elements[i].length < 128 &&
+		    !GSS_ERROR(ssh_gssapi_server_ctx(&ctx,
+		    &supported->elements[i])))
+			gss_add_oid_set_member(&ms, &supported->elements[i],
+			    &kex_oids);
+		ssh_gssapi_delete_ctx(&ctx);
+	}
+	gss_release_oid_set(&ms, &supported);
+	debug("%s: %lu mechanisms usable for key exchange", __func__,
+	    (u_long)kex_oids->count);
+}
+
+/* Pass the mechanisms found by ssh_gssapi_server_prepare() to a child */
+void
+ssh_gssapi_server_put_kex_oids(Buffer *m)
+{
+	Buffer b;
+	size_t i;
+
+	buffer_init(&b);
+	for (i = 0; kex_oids != GSS_C_NO_OID_SET && i < kex_oids->count; i++)
+		buffer_put_string(&b, kex_oids->elements[i].elements,
+		    kex_oids->elements[i].length);
+	buffer_put_string(m, buffer_ptr(&b), buffer_len(&b));
+	buffer_free(&b);
+}
+
+void
+ssh_gssapi_server_get_kex_oids(Buffer *m)
+{
+	Buffer b;
+	gss_OID_desc oid;
+	OM_uint32 ms;
+	u_int len;
+	u_char *p;
+
+	p = buffer_get_string(m, &len);
+	if (len > 0) {
+		buffer_init(&b);
+		buffer_append(&b, p, len);
+		gss_create_empty_oid_set(&ms, &kex_oids);
+		while (buffer_len(&b) > 0) {
+			oid.elements = buffer_get_string(&b, &len);
+			oid.length = len;
+			gss_add_oid_set_member(&ms, &oid, &kex_oids);
+			xfree(oid.elements);
+		}
+		buffer_free(&b);
+	}
+	xfree(p);
+}
+
 /* Unprivileged */
 int
 ssh_gssapi_server_check_mech(Gssctxt **dum, gss_OID oid, const char *data,
@@ -153,26 +353,34 @@ void
 ssh_gssapi_supported_oids(gss_OID_set *oidset)
 {
 	int i = 0;
+	size_t j;
 	OM_uint32 min_status;
 	int present;
 	gss_OID_set supported;
 
 	gss_create_empty_oid_set(&min_status, oidset);
 
-	if (GSS_ERROR(gss_indicate_mechs(&min_status, &supported)))
-		return;
+	if (supported_oids == GSS_C_NO_OID_SET) {
+		if (GSS_ERROR(gss_indicate_mechs(&min_status, &supported)))
+			return;
+
+		gss_create_empty_oid_set(&min_status, &supported_oids);
+		while (supported_mechs[i]->name != NULL) {
+			if (GSS_ERROR(gss_test_oid_set_member(&min_status,
+			    &supported_mechs[i]->oid, supported, &present)))
+				present = 0;
+			if (present)
+				gss_add_oid_set_member(&min_status,
+				    &supported_mechs[i]->oid, &supported_oids);
+			i++;
+		}
 
-	while (supported_mechs[i]->name != NULL) {
-		if (GSS_ERROR(gss_test_oid_set_member(&min_status,
-		    &supported_mechs[i]->oid, supported, &present)))
-			present = 0;
-		if (present)
-			gss_add_oid_set_member(&min_status,
-			    &supported_mechs[i]->oid, oidset);
-		i++;
+		gss_release_oid_set(&min_status, &supported);
 	}
 
-	gss_release_oid_set(&min_status, &supported);
+	for (j = 0; j < supported_oids->count; j++)
+		gss_add_oid_set_member(&min_status,
+		    &supported_oids->elements[j], oidset);
 }
 
 
@@ -76,8 +76,10 @@ kexgss_client(Kex *kex) {
 		fatal("Couldn't import hostname");
 
 	if (kex->gss_client && 
-	    ssh_gssapi_client_identity(ctxt, kex->gss_client))
+	    ssh_gssapi_client_identity(ctxt, kex->gss_client)) {
+		ssh_gssapi_kex_cache_drop();
 		fatal("Couldn't acquire client credentials");
+	}
 
 	switch (kex->kex_type) {
 	case KEX_GSS_GRP1_SHA1:
@@ -139,6 +141,7 @@ kexgss_client(Kex *kex) {
 				packet_put_string(send_tok.value,
 				    send_tok.length);
 			}
+			ssh_gssapi_kex_cache_drop();
 			fatal("gss_init_context failed");
 		}
 
@@ -148,12 +151,16 @@ kexgss_client(Kex *kex) {
 
 		if (maj_status == GSS_S_COMPLETE) {
 			/* If mutual state flag is not true, kex fails */
-			if (!(ret_flags & GSS_C_MUTUAL_FLAG))
+			if (!(ret_flags & GSS_C_MUTUAL_FLAG)) {
+				ssh_gssapi_kex_cache_drop();
 				fatal("Mutual authentication failed");
+			}
 
 			/* If integ avail flag is not true kex fails */
-			if (!(ret_flags & GSS_C_INTEG_FLAG))
+			if (!(ret_flags & GSS_C_INTEG_FLAG)) {
+				ssh_gssapi_kex_cache_drop();
 				fatal("Integrity check failed");
+			}
 		}
 
 		/* 
@@ -221,6 +228,7 @@ kexgss_client(Kex *kex) {
 				min_status = packet_get_int();
 				msg = packet_get_string(NULL);
 				lang = packet_get_string(NULL);
+				ssh_gssapi_kex_cache_drop();
 				fatal("GSSAPI Error: \n%.400s",msg);
 			default:
 				packet_disconnect("Protocol error: didn't expect packet type %d",
@@ -229,8 +237,10 @@ kexgss_client(Kex *kex) {
 			token_ptr = &recv_tok;
 		} else {
 			/* No data, and not complete */
-			if (maj_status != GSS_S_COMPLETE)
+			if (maj_status != GSS_S_COMPLETE) {
+				ssh_gssapi_kex_cache_drop();
 				fatal("Not complete, and no token output");
+			}
 		}
 	} while (maj_status & GSS_S_CONTINUE_NEEDED);
 
@@ -301,8 +311,10 @@ kexgss_client(Kex *kex) {
 	gssbuf.length = hashlen;
 
 	/* Verify that the hash matches the MIC we just got. */
-	if (GSS_ERROR(ssh_gssapi_checkmic(ctxt, &gssbuf, &msg_tok)))
+	if (GSS_ERROR(ssh_gssapi_checkmic(ctxt, &gssbuf, &msg_tok))) {
+		ssh_gssapi_kex_cache_drop();
 		packet_disconnect("Hash's MIC didn't verify");
+	}
 
 	xfree(msg_tok.value);
 
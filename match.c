@@ -46,66 +46,125 @@
 #include "match.h"
 
 /*
- * Returns true if the given string matches the pattern (which may contain ?
- * and * as wildcards), and zero if it does not match.
+ * Wildcard patterns are matched without backtracking. A pattern is split
+ * at each '*' into segments: the first must match at the start of the
+ * string, the last at its end, and each one in between is taken at the
+ * leftmost place after the previous one. The leftmost place is always
+ * safe, since any later one leaves less of the string for the rest, so
+ * matching takes at most the length of the string times that of the
+ * pattern, however many stars there are.
+ *
+ * As in the recursive matcher this replaced, two or more stars ending the
+ * pattern only match if some of the string is left for them to match.
  */
+struct glob {
+	const char	*pat;		/* not NUL terminated */
+	size_t		 len;
+	size_t		 head;		/* length before the first '*' */
+	size_t		 tail;		/* length after the last '*' */
+	int		 star;		/* pattern contains '*' */
+	int		 qmark;		/* pattern contains '?' */
+	int		 starrun;	/* pattern ends in two or more stars */
+};
+
+static void
+glob_init(struct glob *g, const char *pat, size_t len)
+{
+	const char *p;
+
+	memset(g, 0, sizeof(*g));
+	g->pat = pat;
+	g->len = len;
+	g->qmark = memchr(pat, '?', len) != NULL;
+	if ((p = memchr(pat, '*', len)) == NULL) {
+		g->head = len;
+		return;
+	}
+	g->star = 1;
+	g->head = p - pat;
+	for (p = pat + len; p[-1] != '*'; p--)
+		;
+	g->tail = pat + len - p;
+	g->starrun = len >= 2 && pat[len - 1] == '*' && pat[len - 2] == '*';
+}
 
-int
-match_pattern(const char *s, const char *pattern)
+/* Compare n characters of s against pattern p, in which '?' matches any */
+static int
+glob_eq(const char *s, const char *p, size_t n, int qmark)
 {
-	for (;;) {
-		/* If at end of pattern, accept if also at end of string. */
-		if (!*pattern)
-			return !*s;
-
-		if (*pattern == '*') {
-			/* Skip the asterisk. */
-			pattern++;
-
-			/* If at end of pattern, accept immediately. */
-			if (!*pattern)
-				return 1;
-
-			/* If next character in pattern is known, optimize. */
-			if (*pattern != '?' && *pattern != '*') {
-				/*
-				 * Look instances of the next character in
-				 * pattern, and try to match starting from
-				 * those.
-				 */
-				for (; *s; s++)
-					if (*s == *pattern &&
-					    match_pattern(s + 1, pattern + 1))
-						return 1;
-				/* Failed. */
-				return 0;
-			}
-			/*
-			 * Move ahead one character at a time and try to
-			 * match at each position.
-			 */
-			for (; *s; s++)
-				if (match_pattern(s, pattern))
-					return 1;
-			/* Failed. */
+	if (!qmark)
+		return memcmp(s, p, n) == 0;
+	for (; n > 0; n--, s++, p++)
+		if (*p != '?' && *p != *s)
 			return 0;
+	return 1;
+}
+
+/* Returns the leftmost place in s where the n characters of p match */
+static const char *
+glob_find(const char *s, size_t slen, const char *p, size_t n, int qmark)
+{
+	const char *last;
+
+	if (n > slen)
+		return NULL;
+	for (last = s + slen - n; s <= last; s++) {
+		if (*p != '?' &&
+		    (s = memchr(s, *p, last - s + 1)) == NULL)
+			return NULL;
+		if (glob_eq(s, p, n, qmark))
+			return s;
+	}
+	return NULL;
+}
+
+static int
+glob_match(const struct glob *g, const char *s, size_t slen)
+{
+	const char *p, *pend, *found;
+	size_t n;
+
+	if (!g->star)
+		return slen == g->len && glob_eq(s, g->pat, slen, g->qmark);
+	if (slen < g->head + g->tail ||
+	    !glob_eq(s, g->pat, g->head, g->qmark) ||
+	    !glob_eq(s + slen - g->tail, g->pat + g->len - g->tail, g->tail,
+	    g->qmark))
+		return 0;
+
+	/* Place the segments between the first and last stars */
+	s += g->head;
+	slen -= g->head + g->tail;
+	p = g->pat + g->head;
+	pend = g->pat + g->len - g->tail;
+	while (p < pend) {
+		if (*p == '*') {
+			p++;
+			continue;
 		}
-		/*
-		 * There must be at least one more character in the string.
-		 * If we are at the end, fail.
-		 */
-		if (!*s)
+		for (n = 1; p + n < pend && p[n] != '*'; n++)
+			;
+		if ((found = glob_find(s, slen, p, n, g->qmark)) == NULL)
 			return 0;
+		slen -= found + n - s;
+		s = found + n;
+		p += n;
+	}
+	return !g->starrun || slen > 0;
+}
 
-		/* Check if the next character of the string is acceptable. */
-		if (*pattern != '?' && *pattern != *s)
-			return 0;
+/*
+ * Returns true if the given string matches the pattern (which may contain ?
+ * and * as wildcards), and zero if it does not match.
+ */
 
-		/* Move to the next character, both in string and in pattern. */
-		s++;
-		pattern++;
-	}
-	/* NOTREACHED */
+int
+match_pattern(const char *s, const char *pattern)
+{
+	struct glob g;
+
+	glob_init(&g, pattern, strlen(pattern));
+	return glob_match(&g, s, strlen(s));
 }
 
 /*
@@ -181,6 +240,107 @@ match_hostname(const char *host, const char *pattern, u_int len)
 	return match_pattern_list(host, pattern, len, 1);
 }
 
+/* Longest subpattern accepted by match_pattern_list() */
+#define MATCH_SUBPATTERN_MAX	1022
+
+struct pattern_ent {
+	int		 negated;
+	char		*pat;
+	struct glob	 g;
+};
+
+/* A comma-separated pattern list compiled for repeated matching */
+struct pattern_list {
+	u_int		 num;
+	struct pattern_ent *ent;
+	int		 toolong;	/* list stopped at an overlong entry */
+};
+
+static void
+pattern_list_add(struct pattern_list *pl, int negated, const char *pat,
+    size_t len, int dolower)
+{
+	struct pattern_ent *e;
+	size_t i;
+
+	pl->ent = xrealloc(pl->ent, pl->num + 1, sizeof(*pl->ent));
+	e = &pl->ent[pl->num++];
+	e->negated = negated;
+	e->pat = xmalloc(len + 1);
+	for (i = 0; i < len; i++)
+		e->pat[i] = dolower && isupper((u_char)pat[i]) ?
+		    (char)tolower((u_char)pat[i]) : pat[i];
+	e->pat[len] = '\0';
+	glob_init(&e->g, e->pat, len);
+}
+
+/*
+ * Compile the first len characters of a pattern list for
+ * match_pattern_list_compiled(), which then returns the same as
+ * match_pattern_list() would for it.
+ */
+struct pattern_list *
+match_pattern_list_compile(const char *pattern, u_int len, int dolower)
+{
+	struct pattern_list *pl;
+	u_int i, start;
+	int negated;
+
+	pl = xcalloc(1, sizeof(*pl));
+	for (i = 0; i < len;) {
+		if ((negated = pattern[i] == '!'))
+			i++;
+		for (start = i; i < len && pattern[i] != ','; i++)
+			;
+		/* match_pattern_list() fails the list from here on */
+		if (i - start > MATCH_SUBPATTERN_MAX) {
+			pl->toolong = 1;
+			break;
+		}
+		pattern_list_add(pl, negated, pattern + start, i - start,
+		    dolower);
+		if (i < len)
+			i++;
+	}
+	return pl;
+}
+
+/* Add a single pattern, without treating '!' or ',' specially */
+void
+match_pattern_list_append(struct pattern_list *pl, const char *pattern)
+{
+	pattern_list_add(pl, 0, pattern, strlen(pattern), 0);
+}
+
+int
+match_pattern_list_compiled(const struct pattern_list *pl, const char *string)
+{
+	size_t slen = strlen(string);
+	int got_positive = 0;
+	u_int i;
+
+	for (i = 0; i < pl->num; i++) {
+		if (!glob_match(&pl->ent[i].g, string, slen))
+			continue;
+		if (pl->ent[i].negated)
+			return -1;
+		got_positive = 1;
+	}
+	return pl->toolong ? 0 : got_positive;
+}
+
+void
+match_pattern_list_free(struct pattern_list *pl)
+{
+	u_int i;
+
+	for (i = 0; i < pl->num; i++)
+		xfree(pl->ent[i].pat);
+	if (pl->ent != NULL)
+		xfree(pl->ent);
+	xfree(pl);
+}
+
 /*
  * returns 0 if we get a negative match for the hostname or the ip
  * or if we get no match at all.  returns -1 on error, or 1 on
@@ -231,6 +391,72 @@ match_user(const char *user, const char *host, const char *ipaddr,
 	return ret;
 }
 
+/* A user[@host] pattern split and compiled for repeated use */
+struct user_pattern {
+	char	*user;
+	struct glob user_glob;
+	char	*host;			/* NULL if there is no host part */
+	struct pattern_list *hosts;
+	struct addr_list *addrs;	/* entries before any invalid one */
+	int	 addrs_bad;		/* host is not a valid list */
+};
+
+struct user_pattern *
+match_user_compile(const char *pattern)
+{
+	struct user_pattern *up;
+	char *p;
+
+	up = xcalloc(1, sizeof(*up));
+	up->user = xstrdup(pattern);
+	if ((p = strchr(up->user, '@')) != NULL) {
+		*p++ = '\0';
+		up->host = p;
+		up->hosts = match_pattern_list_compile(p, strlen(p), 1);
+		up->addrs = addr_list_compile_partial(p, &up->addrs_bad);
+	}
+	glob_init(&up->user_glob, up->user, strlen(up->user));
+	return up;
+}
+
+void
+match_user_free(struct user_pattern *up)
+{
+	if (up->hosts != NULL)
+		match_pattern_list_free(up->hosts);
+	if (up->addrs != NULL)
+		addr_list_free(up->addrs);
+	xfree(up->user);
+	xfree(up);
+}
+
+/*
+ * As match_user(), with the remote address also given already parsed
+ * by addr_parse(), or NULL if it could not be.
+ */
+int
+match_user_compiled(const struct user_pattern *up, const char *user,
+    const char *host, const char *ipaddr, const struct xaddr *xa)
+{
+	int mhost, mip;
+
+	if (!glob_match(&up->user_glob, user, strlen(user)))
+		return 0;
+	if (up->host == NULL)
+		return 1;
+
+	/* As match_host_and_ip() */
+	if ((mip = addr_list_match(up->addrs, ipaddr, xa)) == -1)
+		return 0;
+	if (up->addrs_bad && xa != NULL)
+		return -1;
+	if ((mhost = match_pattern_list_compiled(up->hosts, host)) == -1)
+		return 0;
+	if (mhost == 0 && mip == 0)
+		return 0;
+	return 1;
+}
+
 /*
  * Returns first item from client-list that is also supported by server-list,
  * caller must xfree() returned string.
@@ -17,11 +17,30 @@
 int	 match_pattern(const char *, const char *);
 int	 match_pattern_list(const char *, const char *, u_int, int);
 int	 match_hostname(const char *, const char *, u_int);
+struct pattern_list;
+struct pattern_list *match_pattern_list_compile(const char *, u_int, int);
+void	 match_pattern_list_append(struct pattern_list *, const char *);
+int	 match_pattern_list_compiled(const struct pattern_list *, const char *);
+void	 match_pattern_list_free(struct pattern_list *);
 int	 match_host_and_ip(const char *, const char *, const char *);
 int	 match_user(const char *, const char *, const char *, const char *);
+struct user_pattern;
+struct xaddr;
+struct user_pattern *match_user_compile(const char *);
+int	 match_user_compiled(const struct user_pattern *, const char *,
+	    const char *, const char *, const struct xaddr *);
+void	 match_user_free(struct user_pattern *);
 char	*match_list(const char *, const char *, u_int *);
 
 /* addrmatch.c */
+struct addr_list;
+int	 addr_pton(const char *, struct xaddr *);
+struct xaddr *addr_parse(const char *);
+struct addr_list *addr_list_compile(const char *);
+struct addr_list *addr_list_compile_partial(const char *, int *);
+int	 addr_list_match(const struct addr_list *, const char *,
+	    const struct xaddr *);
+void	 addr_list_free(struct addr_list *);
 int	 addr_match_list(const char *, const char *);
 int	 addr_match_cidr_list(const char *, const char *);
 #endif
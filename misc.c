@@ -996,3 +996,161 @@ sock_set_v6only(int s)
 		error("setsockopt IPV6_V6ONLY: %s", strerror(errno));
 #endif
 }
+
+static const struct {
+	const char *name;
+	int value;
+} write_modes[] = {
+	{ "normal",	WRITE_MODE_NORMAL },
+	{ "prealloc",	WRITE_MODE_PREALLOC },
+	{ "direct",	WRITE_MODE_DIRECT },
+	{ "sparse",	WRITE_MODE_SPARSE },
+	{ NULL, -1 }
+};
+
+int
+parse_write_mode(const char *cp)
+{
+	u_int i;
+
+	for (i = 0; write_modes[i].name != NULL; i++) {
+		if (strcasecmp(cp, write_modes[i].name) == 0)
+			return write_modes[i].value;
+	}
+	return -1;
+}
+
+const char *
+write_mode_name(int mode)
+{
+	u_int i;
+
+	for (i = 0; write_modes[i].name != NULL; i++) {
+		if (write_modes[i].value == mode)
+			return write_modes[i].name;
+	}
+	return "unknown";
+}
+
+/*
+ * Reserve disk space for 'len' bytes of 'fd' from 'off' so that a large
+ * file is not fragmented by growing it piecemeal. If 'keep_size' is set
+ * the file's length is left unchanged, which only some systems support.
+ */
+int
+preallocate(int fd, off_t off, off_t len, int keep_size)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+	return fallocate(fd, keep_size ? FALLOC_FL_KEEP_SIZE : 0, off, len);
+#elif defined(HAVE_POSIX_FALLOCATE)
+	int r;
+
+	if (keep_size) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if ((r = posix_fallocate(fd, off, len)) != 0) {
+		errno = r;
+		return -1;
+	}
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* Allocate a buffer suitably aligned for direct I/O */
+void *
+direct_io_alloc(size_t size)
+{
+#ifdef HAVE_POSIX_MEMALIGN
+	void *ptr;
+
+	if (size == 0)
+		fatal("direct_io_alloc: zero size");
+	if (posix_memalign(&ptr, DIRECT_IO_ALIGN, size) != 0)
+		fatal("direct_io_alloc: out of memory (allocating %lu bytes)",
+		    (u_long)size);
+	return ptr;
+#else
+	/* direct_io_aligned() will reject any misaligned buffer */
+	return xmalloc(size);
+#endif
+}
+
+/* Returns nonzero if a transfer of 'len' bytes at 'off' can bypass caches */
+int
+direct_io_aligned(off_t off, const void *buf, size_t len)
+{
+	return off % DIRECT_IO_ALIGN == 0 && len % DIRECT_IO_ALIGN == 0 &&
+	    (u_long)buf % DIRECT_IO_ALIGN == 0;
+}
+
+/*
+ * Turn O_DIRECT on or off for 'fd' according to 'want'. '*directp' holds
+ * the current state, and stays off if the file system refuses.
+ */
+void
+set_direct_io(int fd, int *directp, int want)
+{
+#ifdef O_DIRECT
+	int flags;
+
+	want = want != 0;
+	if (want == *directp)
+		return;
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+	    fcntl(fd, F_SETFL, want ? flags | O_DIRECT :
+	    flags & ~O_DIRECT) == -1) {
+		debug("%s: fcntl O_DIRECT %s: %s", __func__,
+		    want ? "on" : "off", strerror(errno));
+		return;
+	}
+	*directp = want;
+#endif
+}
+
+/*
+ * Find the first range of data in 'fd' at or after 'off', in a file of
+ * 'size' bytes, storing its bounds in '*startp' and '*endp'. Holes are
+ * found with SEEK_DATA and SEEK_HOLE; where those are unavailable the
+ * rest of the file is reported as data. If only a hole follows 'off',
+ * both are set to 'size'. The file offset is preserved.
+ */
+void
+file_data_extent(int fd, off_t off, off_t size, off_t *startp, off_t *endp)
+{
+	*startp = off;
+	*endp = size;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	{
+		off_t cur, start, end;
+
+		if (off >= size || (cur = lseek(fd, 0, SEEK_CUR)) == -1)
+			return;
+		if ((start = lseek(fd, off, SEEK_DATA)) == -1) {
+			if (errno == ENXIO)
+				*startp = size;
+		} else if (start >= size)
+			*startp = size;
+		else if ((end = lseek(fd, start, SEEK_HOLE)) != -1) {
+			*startp = start;
+			*endp = MIN(end, size);
+		}
+		if (lseek(fd, cur, SEEK_SET) == -1)
+			fatal("%s: lseek: %s", __func__, strerror(errno));
+	}
+#endif
+}
+
+/* Returns nonzero if the 'len' bytes at 'buf' are all zero */
+int
+buf_is_zero(const void *buf, size_t len)
+{
+	const u_char *p = buf;
+
+	if (len == 0)
+		return 1;
+	return p[0] == 0 && memcmp(p, p + 1, len - 1) == 0;
+}
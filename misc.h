@@ -91,6 +91,24 @@ void bandwidth_limit(struct bwlimit *, size_t);
 int parse_ipqos(const char *);
 void mktemp_proto(char *, size_t);
 
+/* How scp and sftp write file data */
+#define WRITE_MODE_NORMAL	0
+#define WRITE_MODE_PREALLOC	1	/* Preallocate destination files */
+#define WRITE_MODE_DIRECT	2	/* Also write with O_DIRECT */
+#define WRITE_MODE_SPARSE	3	/* scp: leave holes for zero blocks */
+
+/* Alignment of offsets, lengths and buffers for O_DIRECT */
+#define DIRECT_IO_ALIGN		4096
+
+int	 parse_write_mode(const char *);
+const char *write_mode_name(int);
+int	 preallocate(int, off_t, off_t, int);
+void	*direct_io_alloc(size_t);
+int	 direct_io_aligned(off_t, const void *, size_t);
+void	 set_direct_io(int, int *, int);
+void	 file_data_extent(int, off_t, off_t, off_t *, off_t *);
+int	 buf_is_zero(const void *, size_t);
+
 /* readpass.c */
 
 #define RP_ECHO			0x0001
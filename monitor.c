@@ -84,6 +84,7 @@
 #endif
 #include "monitor_wrap.h"
 #include "monitor_fdpass.h"
+#include "monitor_ring.h"
 #include "misc.h"
 #include "compat.h"
 #include "ssh2.h"
@@ -1876,6 +1877,24 @@ monitor_socketpair(int *pair)
 	FD_CLOSEONEXEC(pair[1]);
 }
 
+/* Set up a fresh shared memory transport alongside the socketpair */
+static void
+monitor_ring_setup(struct monitor *mon)
+{
+	if (mon->m_ring != NULL) {
+		mm_ring_destroy(mon->m_ring);
+		xfree(mon->m_ring_child);
+		xfree(mon->m_ring_monitor);
+		mon->m_ring = NULL;
+		mon->m_ring_child = mon->m_ring_monitor = NULL;
+	}
+	if (!options.monitor_shared_memory ||
+	    (mon->m_ring = mm_ring_create()) == NULL)
+		return;
+	mon->m_ring_child = mm_ring_end_new(mon->m_ring, MM_RING_CHILD);
+	mon->m_ring_monitor = mm_ring_end_new(mon->m_ring, MM_RING_MONITOR);
+}
+
 #define MM_MEMSIZE	65536
 
 struct monitor *
@@ -1890,6 +1909,7 @@ monitor_init(void)
 
 	mon->m_recvfd = pair[0];
 	mon->m_sendfd = pair[1];
+	monitor_ring_setup(mon);
 
 	/* Used to share zlib space across processes */
 	if (options.compression) {
@@ -1912,6 +1932,7 @@ monitor_reinit(struct monitor *mon)
 
 	mon->m_recvfd = pair[0];
 	mon->m_sendfd = pair[1];
+	monitor_ring_setup(mon);
 }
 
 #ifdef GSSAPI
@@ -71,6 +71,8 @@ enum monitor_reqtype {
 };
 
 struct mm_master;
+struct mm_ring;
+struct mm_ring_end;
 struct monitor {
 	int			 m_recvfd;
 	int			 m_sendfd;
@@ -78,6 +80,9 @@ struct monitor {
 	struct mm_master	*m_zlib;
 	struct Kex		**m_pkex;
 	pid_t			 m_pid;
+	struct mm_ring		*m_ring;	/* shared memory transport */
+	struct mm_ring_end	*m_ring_child;
+	struct mm_ring_end	*m_ring_monitor;
 };
 
 struct monitor *monitor_init(void);
@@ -78,6 +78,28 @@ mm_make_entry(struct mm_master *mm, struct mmtree *head,
 	return (tmp);
 }
 
+#define MM_SLAB_NPAGES(mm) \
+	(((mm)->size + MM_SLAB_PAGE - 1) / MM_SLAB_PAGE)
+#define MM_SLAB_USEDLEN(mm) \
+	(MM_SLAB_NPAGES(mm) * (MM_SLAB_PAGE / MM_MINSIZE / 8))
+
+static void *
+mm_bookkeeping_alloc(struct mm_master *mm, size_t size)
+{
+	if (mm->mmalloc == NULL)
+		return (xcalloc(1, size));
+	return (memset(mm_xmalloc(mm->mmalloc, size), 0, size));
+}
+
+static void
+mm_bookkeeping_free(struct mm_master *mm, void *address)
+{
+	if (mm->mmalloc == NULL)
+		xfree(address);
+	else
+		mm_free(mm->mmalloc, address);
+}
+
 /* Creates a shared memory area of a certain size */
 
 struct mm_master *
@@ -110,6 +132,12 @@ mm_create(struct mm_master *mmalloc, size_t size)
 
 	mm_make_entry(mm, &mm->rb_free, address, size);
 
+	mm->slab_map = mm_bookkeeping_alloc(mm, MM_SLAB_NPAGES(mm));
+	mm->slab_used = mm_bookkeeping_alloc(mm, MM_SLAB_USEDLEN(mm));
+	memset(mm->slab_free, 0, sizeof(mm->slab_free));
+	memset(mm->slab_pages, 0, sizeof(mm->slab_pages));
+	memset(mm->slab_inuse, 0, sizeof(mm->slab_inuse));
+
 	return (mm);
 }
 
@@ -137,6 +165,8 @@ mm_destroy(struct mm_master *mm)
 {
 	mm_freelist(mm->mmalloc, &mm->rb_free);
 	mm_freelist(mm->mmalloc, &mm->rb_allocated);
+	mm_bookkeeping_free(mm, mm->slab_map);
+	mm_bookkeeping_free(mm, mm->slab_used);
 
 #ifdef HAVE_MMAP
 	if (munmap(mm->address, mm->size) == -1)
@@ -164,27 +194,12 @@ mm_xmalloc(struct mm_master *mm, size_t size)
 }
 
 
-/* Allocates data from a memory mapped area */
+/* Takes size bytes from the start of the free extent mms */
 
-void *
-mm_malloc(struct mm_master *mm, size_t size)
+static void *
+mm_carve(struct mm_master *mm, struct mm_share *mms, size_t size)
 {
-	struct mm_share *mms, *tmp;
-
-	if (size == 0)
-		fatal("mm_malloc: try to allocate 0 space");
-	if (size > SIZE_T_MAX - MM_MINSIZE + 1)
-		fatal("mm_malloc: size too big");
-
-	size = ((size + (MM_MINSIZE - 1)) / MM_MINSIZE) * MM_MINSIZE;
-
-	RB_FOREACH(mms, mmtree, &mm->rb_free) {
-		if (mms->size >= size)
-			break;
-	}
-
-	if (mms == NULL)
-		return (NULL);
+	struct mm_share *tmp;
 
 	/* Debug */
 	memset(mms->address, 0xd0, size);
@@ -206,12 +221,190 @@ mm_malloc(struct mm_master *mm, size_t size)
 	return (tmp->address);
 }
 
+/* Allocates a page for a slab, aligned to MM_SLAB_PAGE within the area */
+
+static void *
+mm_slab_page(struct mm_master *mm)
+{
+	struct mm_share *mms, *tmp;
+	size_t off, pad = 0;
+
+	RB_FOREACH(mms, mmtree, &mm->rb_free) {
+		off = (u_char *)mms->address - (u_char *)mm->address;
+		pad = (MM_SLAB_PAGE - off % MM_SLAB_PAGE) % MM_SLAB_PAGE;
+		if (mms->size >= pad + MM_SLAB_PAGE)
+			break;
+	}
+
+	if (mms == NULL)
+		return (NULL);
+
+	/* Leave the unaligned head of the extent free */
+	if (pad != 0) {
+		tmp = mm_make_entry(mm, &mm->rb_free,
+		    (u_char *)mms->address + pad, mms->size - pad);
+		mms->size = pad;
+		mms = tmp;
+	}
+
+	return (mm_carve(mm, mms, MM_SLAB_PAGE));
+}
+
+/* Returns the slab class that address belongs to, or -1 */
+
+static int
+mm_slab_class(struct mm_master *mm, void *address)
+{
+	size_t off;
+
+	if (address < mm->address ||
+	    address >= (void *)((u_char *)mm->address + mm->size))
+		return (-1);
+	off = (u_char *)address - (u_char *)mm->address;
+	return ((int)mm->slab_map[off / MM_SLAB_PAGE] - 1);
+}
+
+/*
+ * Checks that a chunk lies on a page of class c at a chunk boundary and
+ * is marked as handed out or not according to used. Anything else means
+ * that the bookkeeping has been overwritten.
+ */
+
+static void
+mm_slab_check(struct mm_master *mm, void *address, int c, int used,
+    const char *where)
+{
+	size_t off;
+	u_int bit;
+
+	if (mm_slab_class(mm, address) != c)
+		fatal("%s: memory corruption: %p not in slab class %d",
+		    where, address, c);
+	off = (u_char *)address - (u_char *)mm->address;
+	if (off % (MM_MINSIZE << c) != 0)
+		fatal("%s: memory corruption: %p misaligned", where, address);
+	bit = off / MM_MINSIZE;
+	if (((mm->slab_used[bit / 8] & (1 << (bit % 8))) != 0) != used)
+		fatal("%s: %s %p", where, used ? "not allocated" :
+		    "memory corruption: free list has allocated", address);
+}
+
+static void
+mm_slab_mark(struct mm_master *mm, void *address, int used)
+{
+	u_int bit = ((u_char *)address - (u_char *)mm->address) / MM_MINSIZE;
+
+	if (used)
+		mm->slab_used[bit / 8] |= 1 << (bit % 8);
+	else
+		mm->slab_used[bit / 8] &= ~(1 << (bit % 8));
+}
+
+/* Turns a new page into chunks of class c */
+
+static int
+mm_slab_grow(struct mm_master *mm, int c)
+{
+	struct mm_slab_chunk *chunk;
+	size_t csize = MM_MINSIZE << c;
+	u_char *page;
+	int i;
+
+	if ((page = mm_slab_page(mm)) == NULL)
+		return (-1);
+	mm->slab_map[(page - (u_char *)mm->address) / MM_SLAB_PAGE] = c + 1;
+	for (i = MM_SLAB_PAGE / csize - 1; i >= 0; i--) {
+		chunk = (struct mm_slab_chunk *)(page + i * csize);
+		chunk->next = mm->slab_free[c];
+		mm->slab_free[c] = chunk;
+	}
+	mm->slab_pages[c]++;
+
+	return (0);
+}
+
+static void *
+mm_slab_alloc(struct mm_master *mm, size_t size)
+{
+	struct mm_slab_chunk *chunk;
+	int c;
+
+	for (c = 0; (size_t)(MM_MINSIZE << c) < size; c++)
+		;
+	if (mm->slab_free[c] == NULL && mm_slab_grow(mm, c) == -1)
+		return (NULL);
+
+	chunk = mm->slab_free[c];
+	mm_slab_check(mm, chunk, c, 0, "mm_malloc");
+	mm->slab_free[c] = chunk->next;
+	mm_slab_mark(mm, chunk, 1);
+	mm->slab_inuse[c]++;
+
+	/* Debug */
+	memset(chunk, 0xd0, MM_MINSIZE << c);
+
+	return (chunk);
+}
+
+static void
+mm_slab_release(struct mm_master *mm, void *address, int c)
+{
+	struct mm_slab_chunk *chunk = address;
+
+	mm_slab_check(mm, address, c, 1, "mm_free");
+
+	/* Debug */
+	memset(chunk, 0xd0, MM_MINSIZE << c);
+
+	mm_slab_mark(mm, chunk, 0);
+	chunk->next = mm->slab_free[c];
+	mm->slab_free[c] = chunk;
+	mm->slab_inuse[c]--;
+}
+
+/* Allocates data from a memory mapped area */
+
+void *
+mm_malloc(struct mm_master *mm, size_t size)
+{
+	struct mm_share *mms;
+	void *address;
+
+	if (size == 0)
+		fatal("mm_malloc: try to allocate 0 space");
+	if (size > SIZE_T_MAX - MM_MINSIZE + 1)
+		fatal("mm_malloc: size too big");
+
+	/* Small requests fall back to extents once no page is left */
+	if (size <= MM_SLAB_MAXSIZE &&
+	    (address = mm_slab_alloc(mm, size)) != NULL)
+		return (address);
+
+	size = ((size + (MM_MINSIZE - 1)) / MM_MINSIZE) * MM_MINSIZE;
+
+	RB_FOREACH(mms, mmtree, &mm->rb_free) {
+		if (mms->size >= size)
+			break;
+	}
+
+	if (mms == NULL)
+		return (NULL);
+
+	return (mm_carve(mm, mms, size));
+}
+
 /* Frees memory in a memory mapped area */
 
 void
 mm_free(struct mm_master *mm, void *address)
 {
 	struct mm_share *mms, *prev, tmp;
+	int c;
+
+	if ((c = mm_slab_class(mm, address)) != -1) {
+		mm_slab_release(mm, address, c);
+		return;
+	}
 
 	tmp.address = address;
 	mms = RB_FIND(mmtree, &mm->rb_allocated, &tmp);
@@ -302,6 +495,52 @@ mm_sync_list(struct mmtree *oldtree, struct mmtree *newtree,
 	}
 }
 
+/*
+ * Copies the slab bookkeeping out of the old allocator and checks every
+ * free chunk. The counters are recomputed from the page map rather than
+ * trusted, and each free list walk is bounded by the chunks on its pages
+ * so that a loop in the list is caught.
+ */
+
+static void
+mm_sync_slabs(struct mm_master *mm, struct mm_master *mmold)
+{
+	struct mm_slab_chunk *chunk;
+	u_char *map = mm->slab_map, *used = mm->slab_used;
+	u_int i, c, n, nfree;
+
+	mm_memvalid(mmold, map, MM_SLAB_NPAGES(mm));
+	mm_memvalid(mmold, used, MM_SLAB_USEDLEN(mm));
+	mm->slab_map = mm_bookkeeping_alloc(mm, MM_SLAB_NPAGES(mm));
+	memcpy(mm->slab_map, map, MM_SLAB_NPAGES(mm));
+	mm->slab_used = mm_bookkeeping_alloc(mm, MM_SLAB_USEDLEN(mm));
+	memcpy(mm->slab_used, used, MM_SLAB_USEDLEN(mm));
+
+	memset(mm->slab_pages, 0, sizeof(mm->slab_pages));
+	for (i = 0; i < MM_SLAB_NPAGES(mm); i++) {
+		if (mm->slab_map[i] == 0)
+			continue;
+		if (mm->slab_map[i] > MM_SLAB_CLASSES ||
+		    (i + 1) * MM_SLAB_PAGE > mm->size)
+			fatal("%s: memory corruption: page %u class %u",
+			    __func__, i, mm->slab_map[i]);
+		mm->slab_pages[mm->slab_map[i] - 1]++;
+	}
+
+	for (c = 0; c < MM_SLAB_CLASSES; c++) {
+		n = mm->slab_pages[c] * (MM_SLAB_PAGE / (MM_MINSIZE << c));
+		nfree = 0;
+		for (chunk = mm->slab_free[c]; chunk != NULL;
+		    chunk = chunk->next) {
+			if (nfree++ == n)
+				fatal("%s: memory corruption: loop in class %u",
+				    __func__, c);
+			mm_slab_check(mm, chunk, c, 0, __func__);
+		}
+		mm->slab_inuse[c] = n - nfree;
+	}
+}
+
 void
 mm_share_sync(struct mm_master **pmm, struct mm_master **pmmalloc)
 {
@@ -329,12 +568,14 @@ mm_share_sync(struct mm_master **pmm, struct mm_master **pmmalloc)
 
 	mm_sync_list(&rb_free, &mm->rb_free, mm, mmold);
 	mm_sync_list(&rb_allocated, &mm->rb_allocated, mm, mmold);
+	mm_sync_slabs(mm, mmold);
 
 	mm_destroy(mmold);
 
 	*pmm = mm;
 	*pmmalloc = mmalloc;
 
+	mm_log_stats(mm);
 	debug3("%s: Share sync end", __func__);
 }
 
@@ -350,3 +591,34 @@ mm_memvalid(struct mm_master *mm, void *address, size_t size)
 	if (end > (void *)((u_char *)mm->address + mm->size))
 		fatal("mm_memvalid: address too large: %p", address);
 }
+
+/* Reports usage and fragmentation of an area */
+
+void
+mm_log_stats(struct mm_master *mm)
+{
+	struct mm_share *mms;
+	size_t nfree = 0, largest = 0, nalloc = 0;
+	u_int nextents = 0, c;
+
+	RB_FOREACH(mms, mmtree, &mm->rb_free) {
+		nfree += mms->size;
+		largest = MAX(largest, mms->size);
+		nextents++;
+	}
+	RB_FOREACH(mms, mmtree, &mm->rb_allocated)
+		nalloc++;
+	debug3("mm_log_stats(%p): %lu of %lu bytes free in %u extents, "
+	    "largest %lu (%u%% fragmented), %lu extents allocated", mm,
+	    (u_long)nfree, (u_long)mm->size, nextents, (u_long)largest,
+	    nfree == 0 ? 0 : (u_int)(100 - largest * 100 / nfree),
+	    (u_long)nalloc);
+	for (c = 0; c < MM_SLAB_CLASSES; c++) {
+		if (mm->slab_pages[c] == 0)
+			continue;
+		debug3("mm_log_stats(%p): class %lu: %u pages, %u of %u "
+		    "chunks in use", mm, (u_long)(MM_MINSIZE << c),
+		    mm->slab_pages[c], mm->slab_inuse[c],
+		    mm->slab_pages[c] * (MM_SLAB_PAGE / (MM_MINSIZE << c)));
+	}
+}
@@ -28,12 +28,27 @@
 #ifndef _MM_H_
 #define _MM_H_
 
+#define MM_MINSIZE		128
+
+/*
+ * Requests up to MM_SLAB_MAXSIZE are rounded up to a power of two and
+ * served from pages of MM_SLAB_PAGE bytes split into chunks of that size.
+ */
+#define MM_SLAB_CLASSES		5
+#define MM_SLAB_MAXSIZE		(MM_MINSIZE << (MM_SLAB_CLASSES - 1))
+#define MM_SLAB_PAGE		4096
+
 struct mm_share {
 	RB_ENTRY(mm_share) next;
 	void *address;
 	size_t size;
 };
 
+/* Free slab chunks are linked through their first word */
+struct mm_slab_chunk {
+	struct mm_slab_chunk *next;
+};
+
 struct mm_master {
 	RB_HEAD(mmtree, mm_share) rb_free;
 	struct mmtree rb_allocated;
@@ -41,11 +56,17 @@ struct mm_master {
 	size_t size;
 
 	struct mm_master *mmalloc;	/* Used to completely share */
+
+	/* Size-class slabs for small allocations */
+	u_char *slab_map;		/* class + 1 of each page, 0 if none */
+	u_char *slab_used;		/* one bit per MM_MINSIZE unit */
+	struct mm_slab_chunk *slab_free[MM_SLAB_CLASSES];
+	u_int slab_pages[MM_SLAB_CLASSES];
+	u_int slab_inuse[MM_SLAB_CLASSES];
 };
 
 RB_PROTOTYPE(mmtree, mm_share, next, mm_compare)
 
-#define MM_MINSIZE		128
 
 #define MM_ADDRESS_END(x)	(void *)((u_char *)(x)->address + (x)->size)
 
@@ -59,4 +80,5 @@ void *mm_xmalloc(struct mm_master *, size_t);
 void mm_free(struct mm_master *, void *);
 
 void mm_memvalid(struct mm_master *, void *, size_t);
+void mm_log_stats(struct mm_master *);
 #endif /* _MM_H_ */
@@ -0,0 +1,226 @@
+/* $OpenBSD$ */
+
+/*
+ * Copyright (c) 2026 The OpenBSD project
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Shared memory rings for monitor requests and answers. Each direction
+ * has a ring of MM_RING_SIZE bytes holding messages in the same framing
+ * as on the monitor socket (length, type, payload). A message too large
+ * for the ring leaves an empty record there and follows on the socket,
+ * so the ring alone decides the order of messages.
+ *
+ * A receiver that finds its ring empty sets a waiting flag and sleeps
+ * on the socket. The sender writes a one byte doorbell only if it is the
+ * one to clear that flag, so a busy peer costs no syscalls and no
+ * doorbell is ever left unread: the socket still reports the death of
+ * the peer and carries passed descriptors in sequence with the messages.
+ * Without atomic operations no ring is set up and the socket is used.
+ *
+ * Offsets count bytes ever written and wrap modulo 2^32. Each side keeps
+ * the offset it owns in private memory and only publishes it, and checks
+ * the one it reads back from the peer, so a compromised child cannot make
+ * the monitor read or write outside the ring.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "xmalloc.h"
+#include "buffer.h"
+#include "log.h"
+#include "misc.h"
+#include "monitor_ring.h"
+
+/* Same limit as mm_request_receive() */
+#define MM_RING_MAXMSG		(256 * 1024)
+
+#if defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+# define ring_barrier()		__sync_synchronize()
+# define ring_clear(p)		__sync_bool_compare_and_swap((p), 1, 0)
+#else
+# define RING_NO_ATOMICS
+# define ring_barrier()
+# define ring_clear(p)		0
+#endif
+
+struct mm_ring_half {
+	volatile u_int	head;		/* written by the sender */
+	volatile u_int	tail;		/* written by the receiver */
+	volatile u_int	waiting;	/* receiver is asleep on the socket */
+	u_char		data[MM_RING_SIZE];
+};
+
+struct mm_ring {
+	struct mm_ring_half	req;	/* unprivileged child to monitor */
+	struct mm_ring_half	ans;	/* monitor to child */
+};
+
+struct mm_ring *
+mm_ring_create(void)
+{
+	struct mm_ring *ring;
+
+#ifdef RING_NO_ATOMICS
+	error("%s: no atomic operations on this platform", __func__);
+	return NULL;
+#endif
+	ring = xmmap(sizeof(*ring));
+	if (ring == (void *)MAP_FAILED) {
+		error("%s: mmap(%lu): %s", __func__, (u_long)sizeof(*ring),
+		    strerror(errno));
+		return NULL;
+	}
+	memset(ring, 0, sizeof(*ring));
+	return ring;
+}
+
+void
+mm_ring_destroy(struct mm_ring *ring)
+{
+#ifdef HAVE_MMAP
+	if (munmap(ring, sizeof(*ring)) == -1)
+		fatal("%s: munmap: %s", __func__, strerror(errno));
+#endif
+}
+
+struct mm_ring_end *
+mm_ring_end_new(struct mm_ring *ring, int side)
+{
+	struct mm_ring_end *end;
+
+	end = xcalloc(1, sizeof(*end));
+	end->tx = side == MM_RING_CHILD ? &ring->req : &ring->ans;
+	end->rx = side == MM_RING_CHILD ? &ring->ans : &ring->req;
+	return end;
+}
+
+static void
+ring_copy_in(struct mm_ring_half *h, u_int off, const void *p, u_int len)
+{
+	u_int o = off & (MM_RING_SIZE - 1), n = MIN(len, MM_RING_SIZE - o);
+
+	memcpy(h->data + o, p, n);
+	memcpy(h->data, (const u_char *)p + n, len - n);
+}
+
+static void
+ring_copy_out(struct mm_ring_half *h, u_int off, void *p, u_int len)
+{
+	u_int o = off & (MM_RING_SIZE - 1), n = MIN(len, MM_RING_SIZE - o);
+
+	memcpy(p, h->data + o, n);
+	memcpy((u_char *)p + n, h->data, len - n);
+}
+
+/*
+ * Queue a message for the peer. Returns 0 if it is in the ring, or 1 if
+ * it does not fit and must follow on the socket.
+ */
+int
+mm_ring_put(struct mm_ring_end *end, u_char type, Buffer *m)
+{
+	u_int mlen = buffer_len(m), used;
+	u_char hdr[5];
+
+	used = end->head - end->tx->tail;
+	if (used > MM_RING_SIZE)
+		fatal("%s: ring corrupt: %u bytes used", __func__, used);
+	if (mlen > MM_RING_SIZE - sizeof(hdr) ||
+	    MM_RING_SIZE - used < sizeof(hdr) + mlen) {
+		/* Leave an empty record to keep its place */
+		if (MM_RING_SIZE - used < 4)
+			fatal("%s: ring full", __func__);
+		put_u32(hdr, 0);
+		ring_copy_in(end->tx, end->head, hdr, 4);
+		end->head += 4;
+		ring_barrier();
+		end->tx->head = end->head;
+		return 1;
+	}
+	put_u32(hdr, mlen + 1);
+	hdr[4] = type;
+	ring_copy_in(end->tx, end->head, hdr, sizeof(hdr));
+	ring_copy_in(end->tx, end->head + sizeof(hdr), buffer_ptr(m), mlen);
+	end->head += sizeof(hdr) + mlen;
+	ring_barrier();
+	end->tx->head = end->head;
+	return 0;
+}
+
+/*
+ * Returns 1 if the peer is asleep and a doorbell must be written to
+ * wake it, after a message has been queued.
+ */
+int
+mm_ring_wake(struct mm_ring_end *end)
+{
+	ring_barrier();
+	return end->tx->waiting && ring_clear(&end->tx->waiting);
+}
+
+/*
+ * Prepare to sleep on the socket while the ring is empty. Returns 1 if
+ * the caller must read a doorbell, or 0 if a message arrived meanwhile.
+ */
+int
+mm_ring_sleep(struct mm_ring_end *end)
+{
+	end->rx->waiting = 1;
+	ring_barrier();
+	if (end->rx->head == end->tail)
+		return 1;
+	/* If the sender cleared the flag first, its doorbell is coming */
+	return !ring_clear(&end->rx->waiting);
+}
+
+/*
+ * Take the next message from the ring, with its type as first byte.
+ * Returns 0 on success, 1 if the message follows on the socket, or -1
+ * if the ring is empty.
+ */
+int
+mm_ring_get(struct mm_ring_end *end, Buffer *m)
+{
+	u_int avail, msg_len;
+	u_char buf[4];
+
+	avail = end->rx->head - end->tail;
+	if (avail == 0)
+		return -1;
+	ring_barrier();
+	if (avail < sizeof(buf) || avail > MM_RING_SIZE)
+		fatal("%s: ring corrupt: %u bytes available", __func__, avail);
+	ring_copy_out(end->rx, end->tail, buf, sizeof(buf));
+	msg_len = get_u32(buf);
+	if (msg_len > avail - sizeof(buf) || msg_len > MM_RING_MAXMSG)
+		fatal("%s: ring corrupt: bad msg_len %u", __func__, msg_len);
+	buffer_clear(m);
+	ring_copy_out(end->rx, end->tail + sizeof(buf),
+	    buffer_append_space(m, msg_len), msg_len);
+	end->tail += sizeof(buf) + msg_len;
+	end->rx->tail = end->tail;
+	return msg_len == 0 ? 1 : 0;
+}
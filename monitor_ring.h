@@ -0,0 +1,48 @@
+/* $OpenBSD$ */
+
+/*
+ * Copyright (c) 2026 The OpenBSD project
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _MM_RING_H_
+#define _MM_RING_H_
+
+/* Bytes of ring in each direction; must be a power of two */
+#define MM_RING_SIZE		(64 * 1024)
+
+/* Written to the monitor socket to wake a peer waiting on the ring */
+#define MM_RING_DOORBELL	'r'
+
+#define MM_RING_CHILD		0
+#define MM_RING_MONITOR		1
+
+struct mm_ring;
+
+/* One process's view of the ring; kept in private memory */
+struct mm_ring_end {
+	struct mm_ring_half	*tx, *rx;
+	u_int			 head;	/* next write offset into tx */
+	u_int			 tail;	/* next read offset from rx */
+};
+
+struct mm_ring *mm_ring_create(void);
+void	 mm_ring_destroy(struct mm_ring *);
+struct mm_ring_end *mm_ring_end_new(struct mm_ring *, int);
+int	 mm_ring_put(struct mm_ring_end *, u_char, Buffer *);
+int	 mm_ring_wake(struct mm_ring_end *);
+int	 mm_ring_sleep(struct mm_ring_end *);
+int	 mm_ring_get(struct mm_ring_end *, Buffer *);
+
+#endif /* _MM_RING_H_ */
@@ -70,6 +70,7 @@
 #include "monitor_wrap.h"
 #include "atomicio.h"
 #include "monitor_fdpass.h"
+#include "monitor_ring.h"
 #include "misc.h"
 #include "schnorr.h"
 #include "jpake.h"
@@ -98,14 +99,41 @@ mm_is_monitor(void)
 	return (pmonitor && pmonitor->m_pid > 0);
 }
 
+/* Our end of the shared memory transport for sock, if there is one */
+static struct mm_ring_end *
+mm_ring_lookup(int sock)
+{
+	if (pmonitor == NULL || pmonitor->m_ring == NULL)
+		return NULL;
+	if (sock == pmonitor->m_recvfd)
+		return pmonitor->m_ring_child;
+	if (sock == pmonitor->m_sendfd)
+		return pmonitor->m_ring_monitor;
+	return NULL;
+}
+
 void
 mm_request_send(int sock, enum monitor_reqtype type, Buffer *m)
 {
+	struct mm_ring_end *ring = mm_ring_lookup(sock);
 	u_int mlen = buffer_len(m);
 	u_char buf[5];
+	int inline_msg;
 
 	debug3("%s entering: type %d", __func__, type);
 
+	if (ring != NULL) {
+		inline_msg = mm_ring_put(ring, type, m);
+		if (mm_ring_wake(ring)) {
+			buf[0] = MM_RING_DOORBELL;
+			if (atomicio(vwrite, sock, buf, 1) != 1)
+				fatal("%s: write: %s", __func__,
+				    strerror(errno));
+		}
+		/* A message too big for the ring follows on the socket */
+		if (!inline_msg)
+			return;
+	}
 	put_u32(buf, mlen + 1);
 	buf[4] = (u_char) type;		/* 1st byte of payload is mesg-type */
 	if (atomicio(vwrite, sock, buf, sizeof(buf)) != sizeof(buf))
@@ -117,11 +145,31 @@ mm_request_send(int sock, enum monitor_reqtype type, Buffer *m)
 void
 mm_request_receive(int sock, Buffer *m)
 {
+	struct mm_ring_end *ring = mm_ring_lookup(sock);
 	u_char buf[4];
 	u_int msg_len;
+	int r;
 
 	debug3("%s entering", __func__);
 
+	if (ring != NULL) {
+		/* Sleep on the socket only while the ring is empty */
+		while ((r = mm_ring_get(ring, m)) == -1) {
+			if (!mm_ring_sleep(ring))
+				continue;
+			if (atomicio(read, sock, buf, 1) != 1) {
+				if (errno == EPIPE)
+					cleanup_exit(255);
+				fatal("%s: read: %s", __func__,
+				    strerror(errno));
+			}
+			if (buf[0] != MM_RING_DOORBELL)
+				fatal("%s: read: bad doorbell %u", __func__,
+				    buf[0]);
+		}
+		if (r == 0)
+			return;
+	}
 	if (atomicio(read, sock, buf, sizeof(buf)) != sizeof(buf)) {
 		if (errno == EPIPE)
 			cleanup_exit(255);
@@ -134,6 +134,9 @@ static u_int muxserver_pid = 0;
 
 static Channel *mux_listener_channel = NULL;
 
+/* SendEnv patterns, compiled on first use */
+static struct pattern_list *send_env_patterns = NULL;
+
 struct mux_master_state {
 	int hello_rcvd;
 };
@@ -248,11 +251,13 @@ env_permitted(char *env)
 		return 0;
 	}
 
-	for (i = 0; i < options.num_send_env; i++)
-		if (match_pattern(name, options.send_env[i]))
-			return 1;
-
-	return 0;
+	if (send_env_patterns == NULL) {
+		send_env_patterns = match_pattern_list_compile("", 0, 0);
+		for (i = 0; i < options.num_send_env; i++)
+			match_pattern_list_append(send_env_patterns,
+			    options.send_env[i]);
+	}
+	return match_pattern_list_compiled(send_env_patterns, name) == 1;
 }
 
 /* Mux master protocol message handlers */
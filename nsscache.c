@@ -0,0 +1,316 @@
+/* $OpenBSD$ */
+
+/*
+ * Copyright (c) 2026 The OpenBSD project
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A short lived cache of name service lookups. Authenticating a user
+ * looks up the same passwd entry and group memberships several times:
+ * for Match Group, for AllowGroups/DenyGroups, for the first switch to
+ * the user's uid and again when setting up the session. With a directory
+ * service behind NSS each of those can mean network round trips, so the
+ * answers are kept for NSSCACHE_TTL seconds. The cache lives in process
+ * memory; the privsep children forked from the monitor inherit it, but
+ * nothing a child learns flows back.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <grp.h>
+#include <pwd.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+#include "log.h"
+#include "misc.h"
+#include "nsscache.h"
+
+#define NSSCACHE_TTL		30	/* seconds */
+#define NSSCACHE_ENTRIES	8	/* of each kind */
+#define NSSCACHE_HIST		6
+
+/*
+ * Platforms where initgroups() does no more than set the list that
+ * getgrouplist() returns, so that it can be answered from the cache.
+ * Elsewhere it may do more: on AIX it applies the user's login
+ * attributes, and on OS X it opts in to memberd's extended groups.
+ */
+#if defined(HAVE_GETGROUPLIST) && (defined(__linux__) || \
+    defined(__OpenBSD__) || defined(__NetBSD__) || \
+    defined(__FreeBSD__) || defined(__DragonFly__))
+# define NSSCACHE_SETGROUPS
+#endif
+
+struct nss_pwent {
+	char		*name;		/* NULL if the slot is unused */
+	struct passwd	*pw;		/* NULL if there is no such user */
+	time_t		 expires;
+};
+
+struct nss_grent {
+	char		*user;		/* NULL if the slot is unused */
+	gid_t		 base;
+	int		 ngroups;
+	gid_t		*gids;
+	char		**names;	/* looked up on first use */
+	int		 nnames;
+	time_t		 expires;
+};
+
+static struct nss_pwent pwcache[NSSCACHE_ENTRIES];
+static struct nss_grent grcache[NSSCACHE_ENTRIES];
+static u_int pwnext, grnext;
+
+/* Counters and lookup latencies reported by nsscache_log_stats() */
+static u_long pw_hits, pw_misses, gr_hits, gr_misses, names_misses;
+static u_long latency[NSSCACHE_HIST];
+static const char *latency_label[NSSCACHE_HIST] = {
+	"<100us", "<1ms", "<10ms", "<100ms", "<1s", ">=1s"
+};
+
+static void
+lookup_start(struct timeval *tv)
+{
+	gettimeofday(tv, NULL);
+}
+
+static void
+lookup_done(struct timeval *start)
+{
+	struct timeval now;
+	long long us;
+	int i;
+
+	gettimeofday(&now, NULL);
+	us = (now.tv_sec - start->tv_sec) * 1000000LL +
+	    (now.tv_usec - start->tv_usec);
+	for (i = 0, us /= 100; i < NSSCACHE_HIST - 1 && us > 0; i++)
+		us /= 10;
+	latency[i]++;
+}
+
+static void
+pwfree(struct passwd *pw)
+{
+	xfree(pw->pw_name);
+	xfree(pw->pw_passwd);
+	xfree(pw->pw_gecos);
+#ifdef HAVE_PW_CLASS_IN_PASSWD
+	xfree(pw->pw_class);
+#endif
+	xfree(pw->pw_dir);
+	xfree(pw->pw_shell);
+	xfree(pw);
+}
+
+static void
+pwent_clear(struct nss_pwent *e)
+{
+	if (e->name == NULL)
+		return;
+	xfree(e->name);
+	if (e->pw != NULL)
+		pwfree(e->pw);
+	memset(e, 0, sizeof(*e));
+}
+
+static void
+grent_clear(struct nss_grent *e)
+{
+	int i;
+
+	if (e->user == NULL)
+		return;
+	xfree(e->user);
+	if (e->gids != NULL)
+		xfree(e->gids);
+	for (i = 0; i < e->nnames; i++)
+		xfree(e->names[i]);
+	if (e->names != NULL)
+		xfree(e->names);
+	memset(e, 0, sizeof(*e));
+}
+
+/*
+ * As getpwnam(), but answered from the cache when possible. The result
+ * must not be modified or freed, and is only valid until the next call.
+ */
+struct passwd *
+nsscache_getpwnam(const char *name)
+{
+	struct nss_pwent *e;
+	struct passwd *pw;
+	struct timeval tv;
+	time_t now = time(NULL);
+	u_int i;
+
+	for (i = 0; i < NSSCACHE_ENTRIES; i++) {
+		e = &pwcache[i];
+		if (e->name == NULL || strcmp(e->name, name) != 0)
+			continue;
+		if (e->expires > now) {
+			pw_hits++;
+			return e->pw;
+		}
+		pwent_clear(e);
+	}
+	pw_misses++;
+	lookup_start(&tv);
+	pw = getpwnam(name);
+	lookup_done(&tv);
+
+	e = &pwcache[pwnext++ % NSSCACHE_ENTRIES];
+	pwent_clear(e);
+	e->name = xstrdup(name);
+	e->pw = pw == NULL ? NULL : pwcopy(pw);
+	e->expires = now + NSSCACHE_TTL;
+	return e->pw;
+}
+
+static struct nss_grent *
+grent_lookup(const char *user, gid_t base)
+{
+	struct nss_grent *e;
+	struct timeval tv;
+	time_t now = time(NULL);
+	u_int i;
+	int n, max;
+
+	for (i = 0; i < NSSCACHE_ENTRIES; i++) {
+		e = &grcache[i];
+		if (e->user == NULL || e->base != base ||
+		    strcmp(e->user, user) != 0)
+			continue;
+		if (e->expires > now) {
+			gr_hits++;
+			return e;
+		}
+		grent_clear(e);
+	}
+	gr_misses++;
+
+	e = &grcache[grnext++ % NSSCACHE_ENTRIES];
+	grent_clear(e);
+	e->user = xstrdup(user);
+	e->base = base;
+	max = NGROUPS_MAX;
+#if defined(HAVE_SYSCONF) && defined(_SC_NGROUPS_MAX)
+	max = MAX(NGROUPS_MAX, sysconf(_SC_NGROUPS_MAX));
+#endif
+	e->gids = xcalloc(max, sizeof(*e->gids));
+	lookup_start(&tv);
+	/*
+	 * When the list is too small, glibc sets n to the size it needs and
+	 * others to the number of groups stored, so grow the list only while
+	 * asked to and never report more groups than it holds.
+	 */
+	for (;;) {
+		n = max;
+		if (getgrouplist(user, base, e->gids, &n) != -1)
+			break;
+		if (n <= max) {
+			logit("getgrouplist: groups list too small");
+			n = max;
+			break;
+		}
+		e->gids = xrealloc(e->gids, n, sizeof(*e->gids));
+		max = n;
+	}
+	lookup_done(&tv);
+	e->ngroups = MIN(n, max);
+	e->expires = now + NSSCACHE_TTL;
+	return e;
+}
+
+/*
+ * As getgrouplist() with a list as large as the system allows. Sets
+ * *gids to the cached list, which must not be modified or freed, and
+ * returns its length.
+ */
+int
+nsscache_getgrouplist(const char *user, gid_t base, gid_t **gids)
+{
+	struct nss_grent *e = grent_lookup(user, base);
+
+	*gids = e->gids;
+	return e->ngroups;
+}
+
+/*
+ * Sets *names to the names of the groups nsscache_getgrouplist() would
+ * return, leaving out those without one, and returns how many there are.
+ * The names must not be modified or freed.
+ */
+int
+nsscache_groupnames(const char *user, gid_t base, char ***names)
+{
+	struct nss_grent *e = grent_lookup(user, base);
+	struct group *gr;
+	struct timeval tv;
+	int i;
+
+	if (e->names == NULL) {
+		names_misses++;
+		e->names = xcalloc(MAX(e->ngroups, 1), sizeof(*e->names));
+		lookup_start(&tv);
+		for (i = 0; i < e->ngroups; i++)
+			if ((gr = getgrgid(e->gids[i])) != NULL)
+				e->names[e->nnames++] = xstrdup(gr->gr_name);
+		lookup_done(&tv);
+	}
+	*names = e->names;
+	return e->nnames;
+}
+
+/* As initgroups(), from the cached group list where that is the same */
+int
+nsscache_initgroups(const char *user, gid_t base)
+{
+#ifdef NSSCACHE_SETGROUPS
+	gid_t *gids;
+	int ngroups;
+
+	ngroups = nsscache_getgrouplist(user, base, &gids);
+	return setgroups(ngroups, gids);
+#else
+	return initgroups(user, base);
+#endif
+}
+
+void
+nsscache_log_stats(void)
+{
+	char buf[256], tmp[32];
+	int i;
+
+	buf[0] = '\0';
+	for (i = 0; i < NSSCACHE_HIST; i++) {
+		snprintf(tmp, sizeof(tmp), " %s %lu", latency_label[i],
+		    latency[i]);
+		strlcat(buf, tmp, sizeof(buf));
+	}
+	debug("nsscache: passwd %lu hits %lu misses, groups %lu hits "
+	    "%lu misses %lu name lookups", pw_hits, pw_misses, gr_hits,
+	    gr_misses, names_misses);
+	debug("nsscache: lookup latency%s", buf);
+}
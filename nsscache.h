@@ -0,0 +1,28 @@
+/* $OpenBSD$ */
+
+/*
+ * Copyright (c) 2026 The OpenBSD project
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _NSSCACHE_H_
+#define _NSSCACHE_H_
+
+struct passwd *nsscache_getpwnam(const char *);
+int	 nsscache_getgrouplist(const char *, gid_t, gid_t **);
+int	 nsscache_groupnames(const char *, gid_t, char ***);
+int	 nsscache_initgroups(const char *, gid_t);
+void	 nsscache_log_stats(void);
+
+#endif /* _NSSCACHE_H_ */
@@ -69,6 +69,12 @@
 /* backward compat for protocol 2 */
 #define _PATH_SSH_USER_HOSTFILE2	"~/.ssh/known_hosts2"
 
+/*
+ * Per-user cache of the GSSAPI key exchange mechanisms found to work with
+ * each host. Holds only hashes of the host and principal names.
+ */
+#define _PATH_SSH_USER_GSS_KEX_CACHE	"~/.ssh/gss_kex_cache"
+
 /*
  * Name of the default file containing client-side authentication key. This
  * file should only be readable by the user him/herself.
@@ -0,0 +1,194 @@
+/*	$OpenBSD$	*/
+/*	Placed in the Public Domain.	*/
+
+/*
+ * Check the compiled address lists against a plain walk of the list and
+ * time them on a large generated allow list, such as one exported from
+ * an address management system.
+ *
+ * usage: addrmatch-bench [-n prefixes] [-l lookups]
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+#include "buffer.h"
+#include "log.h"
+#include "match.h"
+
+#define NCHECK	300
+#define NPOOL	4096
+
+static u_int32_t seed = 0x2545f491;
+
+static u_int32_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+/* Fill buf with a random address inside net/masklen, or anywhere */
+static void
+rnd_addr(char *buf, size_t len, const u_char *net, int v6, int masklen)
+{
+	u_char a[16];
+	int i, n = v6 ? 16 : 4;
+
+	for (i = 0; i < n; i++) {
+		a[i] = rnd() & 0xff;
+		if (net == NULL)
+			continue;
+		if (i < masklen / 8)
+			a[i] = net[i];
+		else if (i == masklen / 8)
+			a[i] = (net[i] & (0xff << (8 - masklen % 8))) |
+			    (a[i] & (0xff >> (masklen % 8)));
+	}
+	inet_ntop(v6 ? AF_INET6 : AF_INET, a, buf, len);
+}
+
+static double
+elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+	    (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct addr_list *l;
+	struct xaddr *xa, *pool[NPOOL];
+	struct timeval start;
+	Buffer list;
+	char addr[64], net[64], **ent, *cp, *pooladdr[NPOOL];
+	u_char (*nets)[16];
+	int *masklens, *v6;
+	int ch, i, j, r, want, nprefix = 10000, nlookup = 1000000;
+	int hits = 0, failed = 0;
+	double t;
+
+	while ((ch = getopt(argc, argv, "n:l:")) != -1) {
+		switch (ch) {
+		case 'n':
+			nprefix = atoi(optarg);
+			break;
+		case 'l':
+			nlookup = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n prefixes] "
+			    "[-l lookups]\n", argv[0]);
+			exit(2);
+		}
+	}
+	if (nprefix < 1 || nlookup < 1)
+		fatal("bad arguments");
+	log_init(argv[0], SYSLOG_LEVEL_ERROR, SYSLOG_FACILITY_USER, 1);
+
+	/* Mostly IPv4 networks, some IPv6, some negated, a few wildcards */
+	ent = xcalloc(nprefix, sizeof(*ent));
+	nets = xcalloc(nprefix, sizeof(*nets));
+	masklens = xcalloc(nprefix, sizeof(*masklens));
+	v6 = xcalloc(nprefix, sizeof(*v6));
+	buffer_init(&list);
+	for (i = 0; i < nprefix; i++) {
+		v6[i] = rnd() % 10 == 0;
+		masklens[i] = v6[i] ? 16 + rnd() % 113 : 12 + rnd() % 21;
+		rnd_addr(net, sizeof(net), NULL, v6[i], 0);
+		inet_pton(v6[i] ? AF_INET6 : AF_INET, net, nets[i]);
+		for (j = masklens[i]; j < (v6[i] ? 128 : 32); j++)
+			nets[i][j / 8] &= ~(0x80 >> (j % 8));
+		inet_ntop(v6[i] ? AF_INET6 : AF_INET, nets[i], net,
+		    sizeof(net));
+		if (i % 500 == 499)
+			xasprintf(&ent[i], "%s%u.%u.*", rnd() % 4 ? "" : "!",
+			    nets[i][0], nets[i][1]);
+		else
+			xasprintf(&ent[i], "%s%s/%d", rnd() % 10 ? "" : "!",
+			    net, masklens[i]);
+		if (i > 0)
+			buffer_append(&list, ",", 1);
+		buffer_append(&list, ent[i], strlen(ent[i]));
+	}
+	buffer_append(&list, "\0", 1);
+
+	gettimeofday(&start, NULL);
+	if ((l = addr_list_compile(buffer_ptr(&list))) == NULL)
+		fatal("addr_list_compile failed");
+	printf("%d prefixes compiled in %.2f ms\n", nprefix,
+	    elapsed(&start) * 1e3);
+
+	/* Check against each entry on its own, half inside a listed net */
+	for (i = 0; i < NCHECK; i++) {
+		j = rnd() % nprefix;
+		if (i % 2)
+			rnd_addr(addr, sizeof(addr), nets[j], v6[j],
+			    masklens[j]);
+		else
+			rnd_addr(addr, sizeof(addr), NULL, v6[j], 0);
+		for (want = 0, j = 0; j < nprefix && want != -1; j++) {
+			cp = ent[j];
+			if ((r = addr_match_list(addr, cp)) != 0)
+				want = r;
+		}
+		xa = addr_parse(addr);
+		r = addr_list_match(l, addr, xa);
+		xfree(xa);
+		if (r != want || addr_match_list(addr,
+		    buffer_ptr(&list)) != want) {
+			printf("FAIL %s: expected %d, got %d\n", addr, want, r);
+			failed++;
+		}
+		hits += want != 0;
+	}
+	printf("%d addresses checked, %d in list, %d failed\n", NCHECK, hits,
+	    failed);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 20; i++) {
+		rnd_addr(addr, sizeof(addr), NULL, 0, 0);
+		addr_match_list(addr, buffer_ptr(&list));
+	}
+	printf("addr_match_list: %.3f ms per call\n",
+	    elapsed(&start) * 1e3 / 20);
+
+	for (i = 0; i < NPOOL; i++) {
+		j = rnd() % nprefix;
+		rnd_addr(addr, sizeof(addr), i % 2 ? nets[j] : NULL, v6[j],
+		    masklens[j]);
+		pooladdr[i] = xstrdup(addr);
+		pool[i] = addr_parse(addr);
+	}
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nlookup; i++)
+		addr_list_match(l, pooladdr[i % NPOOL], pool[i % NPOOL]);
+	t = elapsed(&start);
+	printf("addr_list_match: %.1f ns per lookup\n", t * 1e9 / nlookup);
+	for (i = 0; i < NPOOL; i++) {
+		xfree(pool[i]);
+		xfree(pooladdr[i]);
+	}
+
+	addr_list_free(l);
+	buffer_free(&list);
+	return failed ? 1 : 0;
+}
@@ -29,6 +29,8 @@ EOD
 
 run_trial user 192.168.0.1 somehost yes		"permit, first entry"
 run_trial user 192.168.30.1 somehost no		"deny, negative match"
+run_trial user 192.168.30.255 somehost no	"deny, negative match, last address"
+run_trial user 192.168.31.0 somehost yes	"permit, next to negative match"
 run_trial user 19.0.0.1 somehost no		"deny, no match"
 run_trial user 10.255.255.254 somehost yes	"permit, list middle"
 run_trial user 192.168.30.1 192.168.0.1 no	"deny, faked IP in hostname"
@@ -40,6 +42,7 @@ run_trial user ::3 somehost no			"deny IP6 negated"
 run_trial user ::4 somehost no			"deny, IP6 no match"
 run_trial user 2000::1 somehost yes		"permit, IP6 network"
 run_trial user 2001::1 somehost no		"deny, IP6 network"
+run_trial user 2000:ffff::3 somehost yes	"permit, IP6 network end"
 
 cp $OBJ/sshd_proxy_bak $OBJ/sshd_proxy
 rm $OBJ/sshd_proxy_bak
@@ -0,0 +1,50 @@
+#	Placed in the Public Domain.
+
+tid="connect with listener options"
+
+cp $OBJ/sshd_config $OBJ/sshd_config.orig
+
+# Start sshd with the given extra options and log in a few times
+listener_connect ()
+{
+	cp $OBJ/sshd_config.orig $OBJ/sshd_config
+	for opt in "$@"; do
+		echo "$opt" >> $OBJ/sshd_config
+	done
+	start_sshd
+
+	for p in 1 2; do
+		for i in 1 2 3; do
+			${SSH} -o "Protocol=$p" -F $OBJ/ssh_config somehost true
+			if [ $? -ne 0 ]; then
+				fail "ssh connect with protocol $p and $* failed"
+			fi
+		done
+	done
+
+	$SUDO kill `$SUDO cat $PIDFILE`
+	rm -f $PIDFILE
+	# Let the listening sockets go away before the next sshd starts
+	sleep 1
+}
+
+verbose "$tid: pre-forked workers"
+listener_connect "PreforkWorkers 1:4"
+
+verbose "$tid: multiple listeners"
+listener_connect "ListenerProcesses 3"
+listener_connect "ListenerProcesses 2" "PreforkWorkers 1:4"
+
+verbose "$tid: identification read by the listener"
+listener_connect "PreauthConnections 8"
+listener_connect "PreauthConnections 8" "PreforkWorkers 1:4" \
+    "PerSourceMaxStartups 4"
+
+for n in -1 16385; do
+	cp $OBJ/sshd_config.orig $OBJ/sshd_config
+	echo "PreauthConnections $n" >> $OBJ/sshd_config
+	${SSHD} -t -f $OBJ/sshd_config >/dev/null 2>&1 && \
+	    fail "sshd accepted PreauthConnections $n"
+done
+
+cp $OBJ/sshd_config.orig $OBJ/sshd_config
@@ -11,3 +11,12 @@ for p in 1 2; do
 		fail "ssh privsep+proxyconnect protocol $p failed"
 	fi
 done
+
+echo 'MonitorSharedMemory yes' >> $OBJ/sshd_proxy
+
+for p in 1 2; do
+	${SSH} -$p -F $OBJ/ssh_proxy 999.999.999.999 true
+	if [ $? -ne 0 ]; then
+		fail "ssh privsep+shm+proxyconnect protocol $p failed"
+	fi
+done
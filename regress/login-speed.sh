@@ -0,0 +1,34 @@
+#	$OpenBSD$
+#	Placed in the Public Domain.
+
+tid="login speed"
+
+# Not run by default: measures logins per second over the proxy
+# connection, with and without the shared memory monitor transport.
+
+tries=200
+
+cp $OBJ/sshd_proxy $OBJ/sshd_proxy_bak
+for shm in no yes; do
+	cp $OBJ/sshd_proxy_bak $OBJ/sshd_proxy
+	echo 'UsePrivilegeSeparation yes' >> $OBJ/sshd_proxy
+	echo "MonitorSharedMemory $shm" >> $OBJ/sshd_proxy
+	for p in 1 2; do
+		trace "proto $p MonitorSharedMemory $shm"
+		start=`date +%s`
+		n=0
+		while [ $n -lt $tries ]; do
+			${SSH} -$p -F $OBJ/ssh_proxy somehost true
+			if [ $? -ne 0 ]; then
+				fail "ssh -$p failed with MonitorSharedMemory $shm"
+				break
+			fi
+			n=`expr $n + 1`
+		done
+		secs=`expr \`date +%s\` - $start`
+		[ $secs -eq 0 ] && secs=1
+		echo "proto $p MonitorSharedMemory $shm: $n logins" \
+		    "in $secs secs, `expr $n / $secs` logins/sec"
+	done
+done
+cp $OBJ/sshd_proxy_bak $OBJ/sshd_proxy
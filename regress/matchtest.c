@@ -0,0 +1,297 @@
+/*	$OpenBSD$	*/
+/*	Placed in the Public Domain.	*/
+
+/*
+ * Check match_pattern() and the compiled pattern lists against the
+ * original backtracking matcher, on fixed cases and on random patterns,
+ * and with -b time them.
+ *
+ * usage: matchtest [-b] [-n iterations]
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+#include "log.h"
+#include "match.h"
+
+static int failed = 0;
+
+/* The recursive matcher from match.c 1.27 */
+static int
+ref_match_pattern(const char *s, const char *pattern)
+{
+	for (;;) {
+		if (!*pattern)
+			return !*s;
+		if (*pattern == '*') {
+			pattern++;
+			if (!*pattern)
+				return 1;
+			if (*pattern != '?' && *pattern != '*') {
+				for (; *s; s++)
+					if (*s == *pattern &&
+					    ref_match_pattern(s + 1, pattern + 1))
+						return 1;
+				return 0;
+			}
+			for (; *s; s++)
+				if (ref_match_pattern(s, pattern))
+					return 1;
+			return 0;
+		}
+		if (!*s)
+			return 0;
+		if (*pattern != '?' && *pattern != *s)
+			return 0;
+		s++;
+		pattern++;
+	}
+}
+
+static int
+ref_match_pattern_list(const char *string, const char *pattern, u_int len,
+    int dolower)
+{
+	char sub[1024];
+	int negated, got_positive = 0;
+	u_int i, subi;
+
+	for (i = 0; i < len;) {
+		if (pattern[i] == '!') {
+			negated = 1;
+			i++;
+		} else
+			negated = 0;
+		for (subi = 0;
+		    i < len && subi < sizeof(sub) - 1 && pattern[i] != ',';
+		    subi++, i++)
+			sub[subi] = dolower && isupper(pattern[i]) ?
+			    (char)tolower(pattern[i]) : pattern[i];
+		if (subi >= sizeof(sub) - 1)
+			return 0;
+		if (i < len && pattern[i] == ',')
+			i++;
+		sub[subi] = '\0';
+		if (ref_match_pattern(string, sub)) {
+			if (negated)
+				return -1;
+			got_positive = 1;
+		}
+	}
+	return got_positive;
+}
+
+static void
+check_pattern(const char *s, const char *pattern)
+{
+	int want = ref_match_pattern(s, pattern);
+	int got = match_pattern(s, pattern);
+
+	if (got != want) {
+		printf("FAIL match_pattern(\"%s\", \"%s\"): expected %d, "
+		    "got %d\n", s, pattern, want, got);
+		failed++;
+	}
+}
+
+static void
+check_list(const char *s, const char *list, u_int len, int dolower)
+{
+	struct pattern_list *pl;
+	int want = ref_match_pattern_list(s, list, len, dolower);
+	int got;
+
+	pl = match_pattern_list_compile(list, len, dolower);
+	got = match_pattern_list_compiled(pl, s);
+	match_pattern_list_free(pl);
+	if (got != want) {
+		printf("FAIL pattern list (\"%s\", \"%.*s\", %d): expected "
+		    "%d, got %d\n", s, (int)len, list, dolower, want, got);
+		failed++;
+	}
+}
+
+static const char *fixed_patterns[] = {
+	"", "*", "**", "***", "?", "??", "*?", "?*", "*?*", "a", "a*", "*a",
+	"*a*", "a**", "a*a", "a?a", "*aa*", "a*b*a", "*ab*ab*", "a**b", "?a*?",
+	"ba**", "*.example.com", "host?.example.*", "*a*a*a*a*a*a*a*b", "ab*ba",
+	"abab*", "*baba",
+	NULL
+};
+
+static const char *fixed_strings[] = {
+	"", "a", "b", "aa", "ab", "ba", "aaa", "aba", "abba", "ababab",
+	"host1.example.com", "www.example.com", "example.com",
+	"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+	NULL
+};
+
+static const char *fixed_lists[] = {
+	"", ",", "a,", ",a", "!a", "a,!a", "!a,a", "*,!b*", "!", "!,a",
+	"a,,b", "A*,b", "*.EXAMPLE.com,!www.*", "!*", "*,!*",
+	NULL
+};
+
+static u_int32_t seed = 0x2545f491;
+
+static u_int32_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static void
+rnd_string(char *buf, size_t maxlen, const char *alphabet)
+{
+	size_t i, n = rnd() % maxlen, na = strlen(alphabet);
+
+	for (i = 0; i < n; i++)
+		buf[i] = alphabet[rnd() % na];
+	buf[n] = '\0';
+}
+
+static void
+run_tests(int iterations)
+{
+	char s[32], p[32], toolong[1100];
+	int i, j, k;
+
+	for (i = 0; fixed_patterns[i] != NULL; i++)
+		for (j = 0; fixed_strings[j] != NULL; j++)
+			check_pattern(fixed_strings[j], fixed_patterns[i]);
+	for (i = 0; fixed_lists[i] != NULL; i++)
+		for (j = 0; fixed_strings[j] != NULL; j++)
+			for (k = 0; k < 2; k++)
+				check_list(fixed_strings[j], fixed_lists[i],
+				    strlen(fixed_lists[i]), k);
+
+	/* Only part of the list is given */
+	check_list("b", "a,b", 1, 0);
+	check_list("a", "a*b,c", 1, 0);
+	check_list("ab", "a*b,c", 2, 0);
+
+	/* Entries too long for match_pattern_list() fail the rest */
+	memset(toolong, 'x', sizeof(toolong));
+	toolong[0] = 'a';
+	toolong[1] = ',';
+	for (i = 1021; i <= 1025; i++) {
+		toolong[i + 2] = '\0';
+		check_list("a", toolong, strlen(toolong), 0);
+		toolong[0] = '!';
+		check_list("", toolong, strlen(toolong), 0);
+		toolong[0] = 'a';
+		toolong[i + 2] = 'x';
+	}
+
+	for (i = 0; i < iterations; i++) {
+		rnd_string(s, 12, "ab");
+		rnd_string(p, 10, "ab*?");
+		check_pattern(s, p);
+		rnd_string(p, 16, "aB*?,!");
+		check_list(s, p, strlen(p), i & 1);
+	}
+}
+
+static double
+elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+	    (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+static void
+run_bench(int iterations)
+{
+	static const char *hosts[] = {
+		"gw1.dc1.example.com", "db-master.prod.example.net",
+		"build17.ci.example.org", "localhost", "10.1.2.3",
+	};
+	const char *patlist = "*.dc1.example.com,*.dc2.example.com,"
+	    "!*.test.example.net,*.prod.example.net,build??.ci.*,"
+	    "*-canary-*.example.org,bastion*,10.1.*";
+	const char *hard = "*a*a*a*a*a*a*a*a*b";
+	char aaa[32];
+	struct pattern_list *pl;
+	struct timeval start;
+	int i, n = 0;
+	double t;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < iterations; i++)
+		n += match_hostname(hosts[i % 5], patlist, strlen(patlist));
+	t = elapsed(&start);
+	printf("match_hostname: %.1f ns per call\n", t * 1e9 / iterations);
+
+	pl = match_pattern_list_compile(patlist, strlen(patlist), 1);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < iterations; i++)
+		n += match_pattern_list_compiled(pl, hosts[i % 5]);
+	t = elapsed(&start);
+	printf("match_pattern_list_compiled: %.1f ns per call\n",
+	    t * 1e9 / iterations);
+	match_pattern_list_free(pl);
+
+	/* Backtracking is exponential in the stars on this one */
+	memset(aaa, 'a', sizeof(aaa) - 1);
+	aaa[sizeof(aaa) - 1] = '\0';
+	gettimeofday(&start, NULL);
+	n += ref_match_pattern(aaa, hard);
+	printf("old matcher, pathological pattern: %.3f ms\n",
+	    elapsed(&start) * 1e3);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 1000; i++)
+		n += match_pattern(aaa, hard);
+	printf("match_pattern, pathological pattern: %.3f us\n",
+	    elapsed(&start) * 1e3);
+	if (n == -1)
+		printf("\n");	/* keep the results live */
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, bench = 0, iterations = 200000;
+
+	while ((ch = getopt(argc, argv, "bn:")) != -1) {
+		switch (ch) {
+		case 'b':
+			bench = 1;
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b] [-n iterations]\n",
+			    argv[0]);
+			exit(2);
+		}
+	}
+	if (iterations < 1)
+		fatal("bad iterations");
+	log_init(argv[0], SYSLOG_LEVEL_ERROR, SYSLOG_FACILITY_USER, 1);
+
+	if (bench)
+		run_bench(iterations * 10);
+	else {
+		run_tests(iterations);
+		printf("matchtest: %s\n", failed ? "FAILED" : "passed");
+	}
+	return failed ? 1 : 0;
+}
@@ -82,6 +82,35 @@ cp ${DATA} ${DIR}/copy
 $SCP $scpopts -r somehost:${DIR} ${DIR2} || fail "copy failed"
 diff ${DIFFOPT} ${DIR} ${DIR2} || fail "corrupted copy"
 
+verbose "$tid: many small files to remote dir without pipelining"
+scpclean
+rm -rf ${DIR2}
+for i in 1 2 3 4 5 6 7 8 9; do echo $i > ${DIR}/copy$i; done
+cp ${DATA} ${DIR}/copy
+$SCP $scpopts -oScpPipeline=no -r ${DIR} somehost:${DIR2} || \
+	fail "copy failed"
+diff ${DIFFOPT} ${DIR} ${DIR2} || fail "corrupted copy"
+
+verbose "$tid: unwritable file in pipelined copy"
+scpclean
+for i in 1 2 3 4 5 6 7 8 9; do echo $i > ${DIR}/copy$i; done
+mkdir ${DIR2}/copy5
+$SCP $scpopts ${DIR}/copy* somehost:${DIR2} 2>/dev/null && \
+	fail "copy succeeded"
+for i in 1 2 3 4 6 7 8 9; do
+	cmp ${DIR}/copy$i ${DIR2}/copy$i || fail "corrupted copy"
+done
+
+verbose "$tid: sparse write mode"
+scpclean
+dd if=${DATA} of=${COPY2} bs=1024 seek=1024 count=8 >/dev/null 2>&1
+cat ${DATA} > ${COPY}
+$SCP $scpopts -w sparse ${COPY2} somehost:${COPY} || fail "copy failed"
+cmp ${COPY2} ${COPY} || fail "corrupted copy"
+rm -f ${COPY}
+$SCP $scpopts -w sparse ${COPY2} somehost:${COPY} || fail "copy failed"
+cmp ${COPY2} ${COPY} || fail "corrupted copy"
+
 verbose "$tid: shell metacharacters"
 scpclean
 (cd ${DIR} && \
@@ -56,6 +56,10 @@ echo "ls ${OBJ}" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 \
 	|| fail "ls failed"
 # XXX always successful
 
+verbose "$tid: ls -R"
+echo "ls -R ${OBJ}" | ${SFTP} -D ${SFTPSERVER} 2>&1 | \
+	grep "copy.dd:" >/dev/null 2>&1 || fail "ls -R failed"
+
 verbose "$tid: shell"
 echo "!echo hi there" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 \
 	|| fail "shell failed"
@@ -93,6 +97,26 @@ echo "get \"$DATA\" $COPY" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 \
 	|| fail "get failed"
 cmp $DATA ${COPY} || fail "corrupted copy after get"
 
+rm -f ${COPY}
+verbose "$tid: get resume"
+dd if=$DATA of=${COPY} bs=1024 count=8 >/dev/null 2>&1
+echo "get -a $DATA $COPY" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 \
+	|| fail "get -a failed"
+cmp $DATA ${COPY} || fail "corrupted copy after get -a"
+
+rm -f ${COPY}
+verbose "$tid: get verify"
+echo "get -c $DATA $COPY" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 \
+	|| fail "get -c failed"
+cmp $DATA ${COPY} || fail "corrupted copy after get -c"
+
+rm -f ${COPY} ${COPY}.sparse
+verbose "$tid: get sparse"
+dd if=$DATA of=${COPY}.sparse bs=1024 seek=1024 count=8 >/dev/null 2>&1
+echo "get ${COPY}.sparse $COPY" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 \
+	|| fail "get sparse failed"
+cmp ${COPY}.sparse ${COPY} || fail "corrupted copy after get sparse"
+
 if [ "$os" != "cygwin" ]; then
 rm -f ${QUOTECOPY}
 cp $DATA ${QUOTECOPY}
@@ -152,6 +176,24 @@ echo "put $DATA $COPY" | \
 	${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 || fail "put failed"
 cmp $DATA ${COPY} || fail "corrupted copy after put"
 
+cat $DATA $DATA > ${COPY}
+verbose "$tid: put resume"
+echo "put -a $DATA $COPY" | \
+	${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 || fail "put -a failed"
+cmp $DATA ${COPY} || fail "corrupted copy after put -a"
+
+rm -f ${COPY}
+verbose "$tid: put verify"
+echo "put -c $DATA $COPY" | \
+	${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 || fail "put -c failed"
+cmp $DATA ${COPY} || fail "corrupted copy after put -c"
+
+rm -f ${COPY}.sparse2
+verbose "$tid: put sparse"
+echo "put ${COPY}.sparse ${COPY}.sparse2" | \
+	${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 || fail "put sparse failed"
+cmp ${COPY}.sparse ${COPY}.sparse2 || fail "corrupted copy after put sparse"
+
 if [ "$os" != "cygwin" ]; then
 rm -f ${QUOTECOPY}
 verbose "$tid: put filename with quotes"
@@ -243,6 +285,7 @@ echo "lchdir ${COPY}.dd" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 \
 	|| fail "lchdir failed"
 
 rm -rf ${COPY} ${COPY}.1 ${COPY}.2 ${COPY}.dd ${COPY}.dd2 ${BATCH}.*
+rm -f ${COPY}.sparse ${COPY}.sparse2
 rm -rf ${QUOTECOPY} "$SPACECOPY" "$GLOBMETACOPY"
 
 
@@ -13,7 +13,7 @@ get $DATA ${COPY}.1
 put $DATA ${COPY}.2
 EOF
 
-BUFFERSIZE="5 1000 32000 64000"
+BUFFERSIZE="5 1000 32000 64000 1000000"
 REQUESTS="1 2 10"
 
 for B in ${BUFFERSIZE}; do
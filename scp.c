@@ -109,6 +109,7 @@
 
 #include "xmalloc.h"
 #include "atomicio.h"
+#include "buffer.h"
 #include "pathnames.h"
 #include "log.h"
 #include "misc.h"
@@ -117,6 +118,20 @@
 extern char *__progname;
 
 #define COPY_BUFLEN	16384
+#define COPY_BUFLEN_MAX	(256 * 1024)
+
+/* States of the pipelined protocol extension */
+#define PIPELINE_OFF		0
+#define PIPELINE_OFFERED	1	/* Offered to, or by, the other end */
+#define PIPELINE_ON		2
+
+/*
+ * Pipelining is offered to the remote scp with this option. Older
+ * versions accept and ignore -o options when run with -f or -t.
+ */
+#define PIPELINE_OPTION	"ScpPipeline"
+/* Passed to a remote sink as an -o option, which older ones ignore */
+#define WRITE_MODE_OPTION	"ScpWriteMode"
 
 int do_cmd(char *host, char *remuser, char *cmd, int *fdin, int *fdout);
 int do_cmd2(char *host, char *remuser, char *cmd, int fdin, int fdout);
@@ -138,6 +153,26 @@ int verbose_mode = 0;
 /* This is set to zero if the progressmeter is not desired. */
 int showprogress = 1;
 
+/* How received files are written, one of WRITE_MODE_* */
+int write_mode = WRITE_MODE_NORMAL;
+
+/*
+ * Whether to offer to pipeline transfers, and the state of the current
+ * transfer. When pipelining, the source streams files without waiting
+ * for each to be acknowledged, and collects the sink's replies as they
+ * arrive.
+ */
+int pipeline_enable = -1;
+int pipeline = PIPELINE_OFF;
+
+/* Output queued for the sink and replies still due from it */
+Buffer pipeline_out;
+u_int pipeline_pending;
+
+/* Data read ahead from the remote end */
+char readbuf[COPY_BUFLEN_MAX];
+size_t readbuf_off, readbuf_len;
+
 /*
  * This is set to non-zero if remote-remote copy should be piped
  * through this process.
@@ -356,8 +391,10 @@ int pflag, iamremote, iamrecursive, targetshouldbedirectory;
 
 #define	CMDNEEDS	64
 char cmd[CMDNEEDS];		/* must hold "rcp -r -p -d\0" */
+char sink_opts[64];		/* options only for a remote sink */
 
 int response(void);
+static void pipeline_finish(void);
 void rsource(char *, struct stat *);
 void sink(int, char *[]);
 void source(int, char *[]);
@@ -369,7 +406,7 @@ int
 main(int argc, char **argv)
 {
 	int ch, fflag, tflag, status, n;
-	char *targ, **newargv;
+	char *cp, *targ, **newargv;
 	const char *errstr;
 	extern char *optarg;
 	extern int optind;
@@ -395,7 +432,7 @@ main(int argc, char **argv)
 	addargs(&args, "-oClearAllForwardings=yes");
 
 	fflag = tflag = 0;
-	while ((ch = getopt(argc, argv, "dfl:prtvBCc:i:P:q12346S:o:F:")) != -1)
+	while ((ch = getopt(argc, argv, "dfl:prtvw:BCc:i:P:q12346S:o:F:")) != -1)
 		switch (ch) {
 		/* User-visible flags. */
 		case '1':
@@ -410,6 +447,25 @@ main(int argc, char **argv)
 			throughlocal = 1;
 			break;
 		case 'o':
+			if (strncasecmp(optarg, PIPELINE_OPTION "=",
+			    sizeof(PIPELINE_OPTION)) == 0) {
+				cp = optarg + sizeof(PIPELINE_OPTION);
+				if (strcasecmp(cp, "yes") == 0)
+					pipeline_enable = 1;
+				else if (strcasecmp(cp, "no") == 0)
+					pipeline_enable = 0;
+				else
+					usage();
+				break;
+			}
+			if (strncasecmp(optarg, WRITE_MODE_OPTION "=",
+			    sizeof(WRITE_MODE_OPTION)) == 0) {
+				cp = optarg + sizeof(WRITE_MODE_OPTION);
+				if ((write_mode = parse_write_mode(cp)) == -1)
+					usage();
+				break;
+			}
+			/* FALLTHROUGH */
 		case 'c':
 		case 'i':
 		case 'F':
@@ -445,6 +501,10 @@ main(int argc, char **argv)
 		case 'S':
 			ssh_program = xstrdup(optarg);
 			break;
+		case 'w':
+			if ((write_mode = parse_write_mode(optarg)) == -1)
+				usage();
+			break;
 		case 'v':
 			addargs(&args, "-v");
 			addargs(&remote_remote_args, "-v");
@@ -485,11 +545,23 @@ main(int argc, char **argv)
 
 	remin = STDIN_FILENO;
 	remout = STDOUT_FILENO;
+	buffer_init(&pipeline_out);
+
+	/* As the remote end, pipeline only if the other scp asked to */
+	if (pipeline_enable == -1)
+		pipeline_enable = !iamremote;
+	if (iamremote && pipeline_enable)
+		pipeline = PIPELINE_OFFERED;
 
 	if (fflag) {
 		/* Follow "protocol", send data. */
 		(void) response();
+		if (pipeline == PIPELINE_OFFERED) {
+			(void) atomicio(vwrite, remout, "P\n", 2);
+			pipeline = PIPELINE_ON;
+		}
 		source(argc, argv);
+		pipeline_finish();
 		exit(errs != 0);
 	}
 	if (tflag) {
@@ -509,6 +581,9 @@ main(int argc, char **argv)
 	    verbose_mode ? " -v" : "",
 	    iamrecursive ? " -r" : "", pflag ? " -p" : "",
 	    targetshouldbedirectory ? " -d" : "");
+	if (write_mode != WRITE_MODE_NORMAL)
+		(void) snprintf(sink_opts, sizeof sink_opts, " -o%s=%s",
+		    WRITE_MODE_OPTION, write_mode_name(write_mode));
 
 	(void) signal(SIGPIPE, lostconn);
 
@@ -550,6 +625,212 @@ scpio(void *_cnt, size_t s)
 	return 0;
 }
 
+/*
+ * read(2) for the remote end that reads ahead, so that parsing records a
+ * byte at a time does not cost a system call per byte.
+ */
+static ssize_t
+scpread(int fd, void *buf, size_t n)
+{
+	struct pollfd pfd;
+	int direct;
+	ssize_t r;
+
+	if (fd != remin || readbuf_off == readbuf_len) {
+		direct = fd != remin || n >= sizeof(readbuf);
+		/* atomicio() only waits for input itself when given read() */
+		while ((r = read(fd, direct ? buf : readbuf,
+		    direct ? n : sizeof(readbuf))) == -1 &&
+		    (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			(void)poll(&pfd, 1, -1);
+		}
+		if (direct || r <= 0)
+			return r;
+		readbuf_off = 0;
+		readbuf_len = r;
+	}
+	n = MIN(n, readbuf_len - readbuf_off);
+	memcpy(buf, readbuf + readbuf_off, n);
+	readbuf_off += n;
+	return n;
+}
+
+/* Pick the I/O size for a file; larger files use larger chunks */
+static int
+copy_buflen(off_t size)
+{
+	int len;
+
+	for (len = COPY_BUFLEN; len < COPY_BUFLEN_MAX && (off_t)len * 64 < size;
+	    len *= 2)
+		;
+	return len;
+}
+
+/* Collect replies from the sink; wait for all of them if 'all' is set */
+static void
+pipeline_replies(int all)
+{
+	struct pollfd pfd;
+
+	while (pipeline_pending > 0) {
+		if (!all && readbuf_off == readbuf_len) {
+			pfd.fd = remin;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, 0) <= 0)
+				return;
+		}
+		pipeline_pending--;
+		(void) response();
+	}
+}
+
+/*
+ * Send 'len' bytes to the sink, reading its replies whenever it is not
+ * accepting data so that neither end can block the other.
+ */
+static void
+pipeline_send(const char *buf, size_t len)
+{
+	struct pollfd pfd[2];
+	ssize_t r;
+
+	set_nonblock(remout);
+	while (len > 0) {
+		if ((r = write(remout, buf, len)) > 0) {
+			if (limit_kbps > 0)
+				bandwidth_limit(&bwlimit, r);
+			buf += r;
+			len -= r;
+			continue;
+		}
+		if (r == 0 || (errno != EINTR && errno != EAGAIN &&
+		    errno != EWOULDBLOCK))
+			lostconn(0);
+		pfd[0].fd = remout;
+		pfd[0].events = POLLOUT;
+		pfd[1].fd = remin;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		if (poll(pfd, pipeline_pending > 0 ? 2 : 1, -1) == -1 &&
+		    errno != EINTR)
+			lostconn(0);
+		if (pfd[1].revents != 0)
+			pipeline_replies(0);
+	}
+	unset_nonblock(remout);
+}
+
+static void
+pipeline_flush(void)
+{
+	if (buffer_len(&pipeline_out) > 0) {
+		pipeline_send(buffer_ptr(&pipeline_out),
+		    buffer_len(&pipeline_out));
+		buffer_clear(&pipeline_out);
+	}
+	pipeline_replies(0);
+}
+
+/* Send queued output and wait for every reply still due */
+static void
+pipeline_finish(void)
+{
+	if (pipeline != PIPELINE_ON)
+		return;
+	pipeline_flush();
+	pipeline_replies(1);
+}
+
+/*
+ * Send a record or file data to the sink. When pipelining, small writes
+ * are gathered so that many small files go out in a single write.
+ */
+static void
+scpwrite(const void *buf, size_t len)
+{
+	if (pipeline != PIPELINE_ON) {
+		(void) atomicio(vwrite, remout, (void *)buf, len);
+		return;
+	}
+	if (len >= COPY_BUFLEN) {
+		pipeline_flush();
+		pipeline_send(buf, len);
+		return;
+	}
+	buffer_append(&pipeline_out, buf, len);
+	if (buffer_len(&pipeline_out) >= COPY_BUFLEN_MAX)
+		pipeline_flush();
+}
+
+/* Wait for the sink to reply to a record, or just count it if pipelining */
+static int
+sink_reply(void)
+{
+	if (pipeline == PIPELINE_ON) {
+		pipeline_pending++;
+		return 0;
+	}
+	return response();
+}
+
+/* Wait for the reply to the last record, after any others still due */
+static int
+sink_sync(void)
+{
+	if (pipeline == PIPELINE_ON) {
+		pipeline_flush();
+		pipeline_replies(1);
+	}
+	return response();
+}
+
+/*
+ * Read the sink's greeting. A sink that was offered pipelining accepts
+ * with "P\n" in place of the usual acknowledgement.
+ */
+static int
+sink_hello(void)
+{
+	char ch;
+
+	if (pipeline != PIPELINE_OFFERED)
+		return response();
+	if (atomicio(scpread, remin, &ch, 1) != 1)
+		lostconn(0);
+	if (ch != 'P') {
+		/* An older sink; leave its reply to be read as usual */
+		readbuf_off--;
+		pipeline = PIPELINE_OFF;
+		return response();
+	}
+	do {
+		if (atomicio(scpread, remin, &ch, 1) != 1)
+			lostconn(0);
+	} while (ch != '\n');
+	pipeline = PIPELINE_ON;
+	if (verbose_mode)
+		fprintf(stderr, "Pipelining transfers\n");
+	return 0;
+}
+
+/* Skip the contents of a file that the sink could not create */
+static void
+sink_discard(off_t size)
+{
+	char buf[8192];
+	size_t amt;
+
+	for (; size > 0; size -= amt) {
+		amt = MIN(size, (off_t)sizeof(buf));
+		if (atomicio(scpread, remin, buf, amt) != amt)
+			lostconn(0);
+	}
+	(void) response();
+}
+
 void
 toremote(char *targ, int argc, char **argv)
 {
@@ -606,7 +887,7 @@ toremote(char *targ, int argc, char **argv)
 				exit(1);
 			(void) xfree(bp);
 			host = cleanhostname(thost);
-			xasprintf(&bp, "%s -t -- %s", cmd, targ);
+			xasprintf(&bp, "%s%s -t -- %s", cmd, sink_opts, targ);
 			if (do_cmd2(host, tuser, bp, remin, remout) < 0)
 				exit(1);
 			(void) xfree(bp);
@@ -652,18 +933,23 @@ toremote(char *targ, int argc, char **argv)
 				errs = 1;
 		} else {	/* local to remote */
 			if (remin == -1) {
-				xasprintf(&bp, "%s -t -- %s", cmd, targ);
+				xasprintf(&bp, "%s%s%s -t -- %s", cmd,
+				    sink_opts, pipeline_enable ? " -o"
+				    PIPELINE_OPTION "=yes" : "", targ);
 				host = cleanhostname(thost);
+				pipeline = pipeline_enable ?
+				    PIPELINE_OFFERED : PIPELINE_OFF;
 				if (do_cmd(host, tuser, bp, &remin,
 				    &remout) < 0)
 					exit(1);
-				if (response() < 0)
+				if (sink_hello() < 0)
 					exit(1);
 				(void) xfree(bp);
 			}
 			source(1, argv + i);
 		}
 	}
+	pipeline_finish();
 	xfree(arg);
 }
 
@@ -705,7 +991,9 @@ tolocal(int argc, char **argv)
 				suser = pwd->pw_name;
 		}
 		host = cleanhostname(host);
-		xasprintf(&bp, "%s -f -- %s", cmd, src);
+		xasprintf(&bp, "%s%s -f -- %s", cmd, pipeline_enable ?
+		    " -o" PIPELINE_OPTION "=yes" : "", src);
+		pipeline = pipeline_enable ? PIPELINE_OFFERED : PIPELINE_OFF;
 		if (do_cmd(host, suser, bp, &remin, &remout) < 0) {
 			(void) xfree(bp);
 			++errs;
@@ -715,6 +1003,7 @@ tolocal(int argc, char **argv)
 		sink(1, argv + argc - 1);
 		(void) close(remin);
 		remin = remout = -1;
+		readbuf_off = readbuf_len = 0;
 	}
 }
 
@@ -724,7 +1013,7 @@ source(int argc, char **argv)
 	struct stat stb;
 	static BUF buffer;
 	BUF *bp;
-	off_t i, statbytes;
+	off_t i, statbytes, data_start, data_end;
 	size_t amt;
 	int fd = -1, haderr, indx;
 	char *last, *name, buf[2048], encname[MAXPATHLEN];
@@ -783,8 +1072,8 @@ syserr:			run_err("%s: %s", name, strerror(errno));
 				fprintf(stderr, "Sending file timestamps: %s",
 				    buf);
 			}
-			(void) atomicio(vwrite, remout, buf, strlen(buf));
-			if (response() < 0)
+			scpwrite(buf, strlen(buf));
+			if (sink_reply() < 0)
 				goto next;
 		}
 #define	FILEMODEMASK	(S_ISUID|S_ISGID|S_IRWXU|S_IRWXG|S_IRWXO)
@@ -794,10 +1083,12 @@ syserr:			run_err("%s: %s", name, strerror(errno));
 		if (verbose_mode) {
 			fprintf(stderr, "Sending file modes: %s", buf);
 		}
-		(void) atomicio(vwrite, remout, buf, strlen(buf));
-		if (response() < 0)
+		scpwrite(buf, strlen(buf));
+		/* When pipelining, the sink only replies once it has the data */
+		if (pipeline != PIPELINE_ON && response() < 0)
 			goto next;
-		if ((bp = allocbuf(&buffer, fd, COPY_BUFLEN)) == NULL) {
+		if ((bp = allocbuf(&buffer, fd,
+		    copy_buflen(stb.st_size))) == NULL) {
 next:			if (fd != -1) {
 				(void) close(fd);
 				fd = -1;
@@ -806,15 +1097,31 @@ next:			if (fd != -1) {
 		}
 		if (showprogress)
 			start_progress_meter(curfile, stb.st_size, &statbytes);
-		set_nonblock(remout);
+		if (pipeline != PIPELINE_ON)
+			set_nonblock(remout);
+		data_start = data_end = 0;
 		for (haderr = i = 0; i < stb.st_size; i += bp->cnt) {
 			amt = bp->cnt;
 			if (i + (off_t)amt > stb.st_size)
 				amt = stb.st_size - i;
-			if (!haderr) {
+			/* Send holes in sparse files without reading them */
+			if (!haderr && i >= data_end)
+				file_data_extent(fd, i, stb.st_size,
+				    &data_start, &data_end);
+			if (!haderr && i + (off_t)amt <= data_start) {
+				memset(bp->buf, 0, amt);
+				if (lseek(fd, i + amt, SEEK_SET) == -1)
+					haderr = errno;
+			} else if (!haderr) {
 				if (atomicio(read, fd, bp->buf, amt) != amt)
 					haderr = errno;
 			}
+			if (pipeline == PIPELINE_ON) {
+				scpwrite(bp->buf, amt);
+				if (!haderr)
+					statbytes += amt;
+				continue;
+			}
 			/* Keep writing after error to retain sync */
 			if (haderr) {
 				(void)atomicio(vwrite, remout, bp->buf, amt);
@@ -824,7 +1131,8 @@ next:			if (fd != -1) {
 			    &statbytes) != amt)
 				haderr = errno;
 		}
-		unset_nonblock(remout);
+		if (pipeline != PIPELINE_ON)
+			unset_nonblock(remout);
 		if (showprogress)
 			stop_progress_meter();
 
@@ -834,10 +1142,10 @@ next:			if (fd != -1) {
 			fd = -1;
 		}
 		if (!haderr)
-			(void) atomicio(vwrite, remout, "", 1);
+			scpwrite("", 1);
 		else
 			run_err("%s: %s", name, strerror(haderr));
-		(void) response();
+		(void) sink_reply();
 	}
 }
 
@@ -861,8 +1169,8 @@ rsource(char *name, struct stat *statp)
 		(void) snprintf(path, sizeof(path), "T%lu 0 %lu 0\n",
 		    (u_long) statp->st_mtime,
 		    (u_long) statp->st_atime);
-		(void) atomicio(vwrite, remout, path, strlen(path));
-		if (response() < 0) {
+		scpwrite(path, strlen(path));
+		if (sink_reply() < 0) {
 			closedir(dirp);
 			return;
 		}
@@ -871,8 +1179,9 @@ rsource(char *name, struct stat *statp)
 	    (u_int) (statp->st_mode & FILEMODEMASK), 0, last);
 	if (verbose_mode)
 		fprintf(stderr, "Entering directory: %s", path);
-	(void) atomicio(vwrite, remout, path, strlen(path));
-	if (response() < 0) {
+	scpwrite(path, strlen(path));
+	/* Even when pipelining, the contents depend on the directory */
+	if (sink_sync() < 0) {
 		closedir(dirp);
 		return;
 	}
@@ -890,8 +1199,8 @@ rsource(char *name, struct stat *statp)
 		source(1, vect);
 	}
 	(void) closedir(dirp);
-	(void) atomicio(vwrite, remout, "E\n", 2);
-	(void) response();
+	scpwrite("E\n", 2);
+	(void) sink_reply();
 }
 
 void
@@ -903,9 +1212,9 @@ sink(int argc, char **argv)
 		YES, NO, DISPLAYED
 	} wrerr;
 	BUF *bp;
-	off_t i;
+	off_t i, osize;
 	size_t j, count;
-	int amt, exists, first, ofd;
+	int amt, direct, exists, first, ofd, sparse;
 	mode_t mode, omode, mask;
 	off_t size, statbytes;
 	int setimes, targisdir, wrerrno = 0;
@@ -928,17 +1237,23 @@ sink(int argc, char **argv)
 	if (targetshouldbedirectory)
 		verifydir(targ);
 
-	(void) atomicio(vwrite, remout, "", 1);
+	if (iamremote && pipeline == PIPELINE_OFFERED) {
+		/* Accept the offer in place of the usual acknowledgement */
+		(void) atomicio(vwrite, remout, "P\n", 2);
+		pipeline = PIPELINE_ON;
+	} else
+		(void) atomicio(vwrite, remout, "", 1);
 	if (stat(targ, &stb) == 0 && S_ISDIR(stb.st_mode))
 		targisdir = 1;
 	for (first = 1;; first = 0) {
 		cp = buf;
-		if (atomicio(read, remin, cp, 1) != 1)
+		if (atomicio(scpread, remin, cp, 1) != 1)
 			return;
 		if (*cp++ == '\n')
 			SCREWUP("unexpected <newline>");
 		do {
-			if (atomicio(read, remin, &ch, sizeof(ch)) != sizeof(ch))
+			if (atomicio(scpread, remin, &ch, sizeof(ch)) !=
+			    sizeof(ch))
 				SCREWUP("lost connection");
 			*cp++ = ch;
 		} while (cp < &buf[sizeof(buf) - 1] && ch != '\n');
@@ -946,6 +1261,15 @@ sink(int argc, char **argv)
 		if (verbose_mode)
 			fprintf(stderr, "Sink: %s", buf);
 
+		if (!iamremote && pipeline == PIPELINE_OFFERED &&
+		    strcmp(buf, "P\n") == 0) {
+			/* The source will not wait for acknowledgements */
+			pipeline = PIPELINE_ON;
+			if (verbose_mode)
+				fprintf(stderr, "Pipelining transfers\n");
+			continue;
+		}
+
 		if (buf[0] == '\01' || buf[0] == '\02') {
 			if (iamremote == 0)
 				(void) atomicio(vwrite, STDERR_FILENO,
@@ -1067,16 +1391,40 @@ sink(int argc, char **argv)
 		mode |= S_IWRITE;
 		if ((ofd = open(np, O_WRONLY|O_CREAT, mode)) < 0) {
 bad:			run_err("%s: %s", np, strerror(errno));
+			/* A pipelining source has sent the file anyway */
+			if (pipeline == PIPELINE_ON && buf[0] == 'C')
+				sink_discard(size);
 			continue;
 		}
-		(void) atomicio(vwrite, remout, "", 1);
-		if ((bp = allocbuf(&buffer, ofd, COPY_BUFLEN)) == NULL) {
+		if (pipeline != PIPELINE_ON)
+			(void) atomicio(vwrite, remout, "", 1);
+		if ((bp = allocbuf(&buffer, ofd, copy_buflen(size))) == NULL) {
 			(void) close(ofd);
+			if (pipeline == PIPELINE_ON)
+				sink_discard(size);
 			continue;
 		}
 		cp = bp->buf;
 		wrerr = NO;
 
+		/*
+		 * If asked, leave holes for blocks of zeros in regular files.
+		 * An existing file is overwritten as it is, so that its
+		 * layout on disk does not change; holes only extend it.
+		 */
+		sparse = write_mode == WRITE_MODE_SPARSE &&
+		    (!exists || S_ISREG(stb.st_mode));
+		osize = exists ? stb.st_size : 0;
+
+		/* Reserve space for the whole file up front if asked */
+		direct = 0;
+		if ((write_mode == WRITE_MODE_PREALLOC ||
+		    write_mode == WRITE_MODE_DIRECT) && size > 0 &&
+		    preallocate(ofd, 0, size, 1) == -1 &&
+		    preallocate(ofd, 0, size, 0) == -1 && verbose_mode)
+			fprintf(stderr, "%s: preallocate: %s\n", np,
+			    strerror(errno));
+
 		statbytes = 0;
 		if (showprogress)
 			start_progress_meter(curfile, size, &statbytes);
@@ -1087,7 +1435,7 @@ bad:			run_err("%s: %s", np, strerror(errno));
 				amt = size - i;
 			count += amt;
 			do {
-				j = atomicio6(read, remin, cp, amt,
+				j = atomicio6(scpread, remin, cp, amt,
 				    scpio, &statbytes);
 				if (j == 0) {
 					run_err("%s", j != EPIPE ?
@@ -1101,7 +1449,17 @@ bad:			run_err("%s: %s", np, strerror(errno));
 
 			if (count == bp->cnt) {
 				/* Keep reading so we stay sync'd up. */
-				if (wrerr == NO) {
+				if (wrerr == NO && sparse && i >= osize &&
+				    buf_is_zero(bp->buf, count)) {
+					if (lseek(ofd, count, SEEK_CUR) == -1) {
+						wrerr = YES;
+						wrerrno = errno;
+					}
+				} else if (wrerr == NO) {
+					if (write_mode == WRITE_MODE_DIRECT)
+						set_direct_io(ofd, &direct,
+						    direct_io_aligned(i,
+						    bp->buf, count));
 					if (atomicio(vwrite, ofd, bp->buf,
 					    count) != count) {
 						wrerr = YES;
@@ -1115,6 +1473,8 @@ bad:			run_err("%s: %s", np, strerror(errno));
 		unset_nonblock(remin);
 		if (showprogress)
 			stop_progress_meter();
+		/* The final partial block cannot be written directly */
+		set_direct_io(ofd, &direct, 0);
 		if (count != 0 && wrerr == NO &&
 		    atomicio(vwrite, ofd, bp->buf, count) != count) {
 			wrerr = YES;
@@ -1182,7 +1542,7 @@ response(void)
 {
 	char ch, *cp, resp, rbuf[2048];
 
-	if (atomicio(read, remin, &resp, sizeof(resp)) != sizeof(resp))
+	if (atomicio(scpread, remin, &resp, sizeof(resp)) != sizeof(resp))
 		lostconn(0);
 
 	cp = rbuf;
@@ -1195,7 +1555,8 @@ response(void)
 	case 1:		/* error, followed by error msg */
 	case 2:		/* fatal error, "" */
 		do {
-			if (atomicio(read, remin, &ch, sizeof(ch)) != sizeof(ch))
+			if (atomicio(scpread, remin, &ch, sizeof(ch)) !=
+			    sizeof(ch))
 				lostconn(0);
 			*cp++ = ch;
 		} while (cp < &rbuf[sizeof(rbuf) - 1] && ch != '\n');
@@ -1216,6 +1577,7 @@ usage(void)
 	(void) fprintf(stderr,
 	    "usage: scp [-12346BCpqrv] [-c cipher] [-F ssh_config] [-i identity_file]\n"
 	    "           [-l limit] [-o ssh_option] [-P port] [-S program]\n"
+	    "           [-w write_mode]\n"
 	    "           [[user@]host1:]file1 ... [[user@]host2:]file2\n");
 	exit(1);
 }
@@ -1227,6 +1589,9 @@ run_err(const char *fmt,...)
 	va_list ap;
 
 	++errs;
+	/* Keep the message in order with any pipelined output */
+	if (buffer_len(&pipeline_out) > 0)
+		pipeline_flush();
 	if (fp != NULL || (remout != -1 && (fp = fdopen(remout, "w")))) {
 		(void) fprintf(fp, "%c", 0x01);
 		(void) fprintf(fp, "scp: ");
@@ -1308,7 +1673,12 @@ allocbuf(BUF *bp, int fd, int blksize)
 #endif /* HAVE_STRUCT_STAT_ST_BLKSIZE */
 	if (bp->cnt >= size)
 		return (bp);
-	if (bp->buf == NULL)
+	if (write_mode == WRITE_MODE_DIRECT) {
+		/* Direct writes need an aligned buffer */
+		if (bp->buf != NULL)
+			xfree(bp->buf);
+		bp->buf = direct_io_alloc(size);
+	} else if (bp->buf == NULL)
 		bp->buf = xmalloc(size);
 	else
 		bp->buf = xrealloc(bp->buf, 1, size);
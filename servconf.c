@@ -45,6 +45,7 @@
 #include "match.h"
 #include "channels.h"
 #include "groupaccess.h"
+#include "nsscache.h"
 
 static void add_listen_addr(ServerOptions *, char *, int);
 static void add_one_listen_addr(ServerOptions *, char *, int);
@@ -123,6 +124,17 @@ initialize_server_options(ServerOptions *options)
 	options->max_startups_begin = -1;
 	options->max_startups_rate = -1;
 	options->max_startups = -1;
+	options->prefork_min = -1;
+	options->prefork_max = -1;
+	options->listener_procs = -1;
+	options->preauth_connections = -1;
+	options->per_source_max_startups = -1;
+	options->per_net_max_startups = -1;
+	options->per_source_max_failures = -1;
+	options->per_net_max_failures = -1;
+	options->per_source_masklen_ipv4 = -1;
+	options->per_source_masklen_ipv6 = -1;
+	options->monitor_shared_memory = -1;
 	options->max_authtries = -1;
 	options->max_sessions = -1;
 	options->banner = NULL;
@@ -131,6 +143,7 @@ initialize_server_options(ServerOptions *options)
 	options->client_alive_count_max = -1;
 	options->authorized_keys_file = NULL;
 	options->authorized_keys_file2 = NULL;
+	options->authorized_keys_index = -1;
 	options->num_accept_env = 0;
 	options->permit_tun = -1;
 	options->num_permitted_opens = -1;
@@ -263,6 +276,28 @@ fill_default_server_options(ServerOptions *options)
 		options->max_startups_rate = 100;		/* 100% */
 	if (options->max_startups_begin == -1)
 		options->max_startups_begin = options->max_startups;
+	if (options->prefork_min == -1)
+		options->prefork_min = 0;
+	if (options->prefork_max == -1)
+		options->prefork_max = options->prefork_min;
+	if (options->listener_procs == -1)
+		options->listener_procs = 1;
+	if (options->preauth_connections == -1)
+		options->preauth_connections = 0;
+	if (options->per_source_max_startups == -1)
+		options->per_source_max_startups = 0;
+	if (options->per_net_max_startups == -1)
+		options->per_net_max_startups = 0;
+	if (options->per_source_max_failures == -1)
+		options->per_source_max_failures = 0;
+	if (options->per_net_max_failures == -1)
+		options->per_net_max_failures = 0;
+	if (options->per_source_masklen_ipv4 == -1)
+		options->per_source_masklen_ipv4 = 24;
+	if (options->per_source_masklen_ipv6 == -1)
+		options->per_source_masklen_ipv6 = 56;
+	if (options->monitor_shared_memory == -1)
+		options->monitor_shared_memory = 0;
 	if (options->max_authtries == -1)
 		options->max_authtries = DEFAULT_AUTH_FAIL_MAX;
 	if (options->max_sessions == -1)
@@ -282,6 +317,8 @@ fill_default_server_options(ServerOptions *options)
 	}
 	if (options->authorized_keys_file == NULL)
 		options->authorized_keys_file = xstrdup(_PATH_SSH_USER_PERMITTED_KEYS);
+	if (options->authorized_keys_index == -1)
+		options->authorized_keys_index = 0;
 	if (options->permit_tun == -1)
 		options->permit_tun = SSH_TUNMODE_NO;
 	if (options->zero_knowledge_password_authentication == -1)
@@ -327,10 +364,14 @@ typedef enum {
 	sAllowUsers, sDenyUsers, sAllowGroups, sDenyGroups,
 	sIgnoreUserKnownHosts, sCiphers, sMacs, sProtocol, sPidFile,
 	sGatewayPorts, sPubkeyAuthentication, sXAuthLocation, sSubsystem,
-	sMaxStartups, sMaxAuthTries, sMaxSessions,
+	sMaxStartups, sPreforkWorkers, sListenerProcesses,
+	sPreauthConnections, sPerSourceMaxStartups, sPerSourceMaxFailures,
+	sPerSourceNetBlockSize, sMonitorSharedMemory,
+	sMaxAuthTries, sMaxSessions,
 	sBanner, sUseDNS, sHostbasedAuthentication,
 	sHostbasedUsesNameFromPacketOnly, sClientAliveInterval,
 	sClientAliveCountMax, sAuthorizedKeysFile, sAuthorizedKeysFile2,
+	sAuthorizedKeysIndex,
 	sGssAuthentication, sGssCleanupCreds, sGssStrictAcceptor,
 	sGssKeyEx, sGssStoreRekey,
 	sAcceptEnv, sPermitTunnel,
@@ -450,6 +491,13 @@ static struct {
 	{ "gatewayports", sGatewayPorts, SSHCFG_ALL },
 	{ "subsystem", sSubsystem, SSHCFG_GLOBAL },
 	{ "maxstartups", sMaxStartups, SSHCFG_GLOBAL },
+	{ "preforkworkers", sPreforkWorkers, SSHCFG_GLOBAL },
+	{ "listenerprocesses", sListenerProcesses, SSHCFG_GLOBAL },
+	{ "preauthconnections", sPreauthConnections, SSHCFG_GLOBAL },
+	{ "persourcemaxstartups", sPerSourceMaxStartups, SSHCFG_GLOBAL },
+	{ "persourcemaxfailures", sPerSourceMaxFailures, SSHCFG_GLOBAL },
+	{ "persourcenetblocksize", sPerSourceNetBlockSize, SSHCFG_GLOBAL },
+	{ "monitorsharedmemory", sMonitorSharedMemory, SSHCFG_GLOBAL },
 	{ "maxauthtries", sMaxAuthTries, SSHCFG_ALL },
 	{ "maxsessions", sMaxSessions, SSHCFG_ALL },
 	{ "banner", sBanner, SSHCFG_ALL },
@@ -460,6 +508,7 @@ static struct {
 	{ "clientalivecountmax", sClientAliveCountMax, SSHCFG_GLOBAL },
 	{ "authorizedkeysfile", sAuthorizedKeysFile, SSHCFG_ALL },
 	{ "authorizedkeysfile2", sAuthorizedKeysFile2, SSHCFG_ALL },
+	{ "authorizedkeysindex", sAuthorizedKeysIndex, SSHCFG_ALL },
 	{ "useprivilegeseparation", sUsePrivilegeSeparation, SSHCFG_GLOBAL},
 	{ "acceptenv", sAcceptEnv, SSHCFG_GLOBAL },
 	{ "permittunnel", sPermitTunnel, SSHCFG_ALL },
@@ -603,7 +652,7 @@ match_cfg_line_group(const char *grps, int line, const char *user)
 	if (user == NULL)
 		goto out;
 
-	if ((pw = getpwnam(user)) == NULL) {
+	if ((pw = nsscache_getpwnam(user)) == NULL) {
 		debug("Can't match group at line %d because user %.100s does "
 		    "not exist", line, user);
 	} else if (ga_init(pw->pw_name, pw->pw_gid) == 0) {
@@ -694,6 +743,222 @@ match_cfg_line(char **condition, int line, const char *user, const char *host,
 	return result;
 }
 
+/*
+ * The Match blocks of the configuration are compiled once, when it is
+ * first parsed, into a table of their criteria and the lines they hold.
+ * Each connection then only evaluates the criteria, with addresses and
+ * networks already parsed, and reprocesses the lines of the blocks that
+ * apply to it instead of the whole configuration.
+ */
+#define MATCH_USER	1
+#define MATCH_GROUP	2
+#define MATCH_HOST	3
+#define MATCH_ADDRESS	4
+
+struct match_crit {
+	int		 type;
+	char		*arg;
+	struct pattern_list *pats;	/* MATCH_USER and MATCH_HOST */
+	struct addr_list *addrs;	/* MATCH_ADDRESS only */
+};
+
+struct match_block {
+	int		 linenum;
+	char		*condition;	/* for debug messages */
+	u_int		 ncrit;
+	struct match_crit *crit;
+	u_int		 nlines;
+	char		**lines;
+	int		*linenums;
+};
+
+static struct match_block *match_blocks = NULL;
+static u_int num_match_blocks = 0;
+static int match_blocks_compiled = 0;
+
+static void
+match_blocks_free(void)
+{
+	struct match_block *mb;
+	u_int i, j;
+
+	for (i = 0; i < num_match_blocks; i++) {
+		mb = &match_blocks[i];
+		for (j = 0; j < mb->ncrit; j++) {
+			xfree(mb->crit[j].arg);
+			if (mb->crit[j].pats != NULL)
+				match_pattern_list_free(mb->crit[j].pats);
+			if (mb->crit[j].addrs != NULL)
+				addr_list_free(mb->crit[j].addrs);
+		}
+		for (j = 0; j < mb->nlines; j++)
+			xfree(mb->lines[j]);
+		if (mb->crit != NULL)
+			xfree(mb->crit);
+		if (mb->lines != NULL) {
+			xfree(mb->lines);
+			xfree(mb->linenums);
+		}
+		xfree(mb->condition);
+	}
+	if (match_blocks != NULL)
+		xfree(match_blocks);
+	match_blocks = NULL;
+	num_match_blocks = 0;
+	match_blocks_compiled = 0;
+}
+
+/* Compile the Match blocks of a configuration already checked for syntax */
+static void
+match_blocks_compile(const char *filename, Buffer *conf)
+{
+	struct match_block *mb = NULL;
+	struct match_crit *mc;
+	char *obuf, *cbuf, *line, *copy, *cp, *arg;
+	int linenum;
+
+	match_blocks_free();
+	obuf = cbuf = xstrdup(buffer_ptr(conf));
+	for (linenum = 1; (line = strsep(&cbuf, "\n")) != NULL; linenum++) {
+		cp = copy = xstrdup(line);
+		if ((arg = strdelim(&cp)) != NULL && *arg == '\0')
+			arg = strdelim(&cp);
+		if (arg == NULL || *arg == '\0' || *arg == '#')
+			goto next;
+		if (strcasecmp(arg, "match") != 0) {
+			/* Lines before the first Match are never reprocessed */
+			if (mb == NULL)
+				goto next;
+			mb->lines = xrealloc(mb->lines, mb->nlines + 1,
+			    sizeof(*mb->lines));
+			mb->linenums = xrealloc(mb->linenums, mb->nlines + 1,
+			    sizeof(*mb->linenums));
+			mb->lines[mb->nlines] = xstrdup(line);
+			mb->linenums[mb->nlines++] = linenum;
+			goto next;
+		}
+		match_blocks = xrealloc(match_blocks, num_match_blocks + 1,
+		    sizeof(*match_blocks));
+		mb = &match_blocks[num_match_blocks++];
+		memset(mb, 0, sizeof(*mb));
+		mb->linenum = linenum;
+		mb->condition = xstrdup(cp);
+		while ((arg = strdelim(&cp)) != NULL && *arg != '\0') {
+			mb->crit = xrealloc(mb->crit, mb->ncrit + 1,
+			    sizeof(*mb->crit));
+			mc = &mb->crit[mb->ncrit++];
+			memset(mc, 0, sizeof(*mc));
+			if (strcasecmp(arg, "user") == 0)
+				mc->type = MATCH_USER;
+			else if (strcasecmp(arg, "group") == 0)
+				mc->type = MATCH_GROUP;
+			else if (strcasecmp(arg, "host") == 0)
+				mc->type = MATCH_HOST;
+			else if (strcasecmp(arg, "address") == 0)
+				mc->type = MATCH_ADDRESS;
+			if ((arg = strdelim(&cp)) == NULL || *arg == '\0' ||
+			    mc->type == 0)
+				fatal("%s line %d: Bad Match condition",
+				    filename, linenum);
+			mc->arg = xstrdup(arg);
+			if (mc->type == MATCH_USER || mc->type == MATCH_HOST)
+				mc->pats = match_pattern_list_compile(arg,
+				    strlen(arg), mc->type == MATCH_HOST);
+			if (mc->type == MATCH_ADDRESS &&
+			    (mc->addrs = addr_list_compile(arg)) == NULL)
+				fatal("%s line %d: Bad Match condition",
+				    filename, linenum);
+		}
+ next:
+		xfree(copy);
+	}
+	xfree(obuf);
+	match_blocks_compiled = 1;
+	debug2("%s: %u Match blocks", __func__, num_match_blocks);
+}
+
+/* Compile an AllowUsers or DenyUsers entry, refusing a bad address list */
+static struct user_pattern *
+user_list_compile(const char *filename, const char *what, const char *entry)
+{
+	const char *host;
+
+	if ((host = strchr(entry, '@')) != NULL &&
+	    addr_match_list(NULL, host + 1) == -2)
+		fatal("%s: bad address list in %s entry \"%.100s\"",
+		    filename, what, entry);
+	return match_user_compile(entry);
+}
+
+/*
+ * Compile AllowUsers and DenyUsers once the configuration is loaded, so
+ * that the connections forked from this process need not.
+ */
+static void
+user_lists_compile(const char *filename, ServerOptions *options)
+{
+	u_int i;
+
+	for (i = 0; i < options->num_allow_users; i++)
+		options->allow_user_pats[i] = user_list_compile(filename,
+		    "AllowUsers", options->allow_users[i]);
+	for (i = 0; i < options->num_deny_users; i++)
+		options->deny_user_pats[i] = user_list_compile(filename,
+		    "DenyUsers", options->deny_users[i]);
+}
+
+/* As match_cfg_line() for a compiled block, stopping at the first miss */
+static int
+match_block_eval(struct match_block *mb, const char *user, const char *host,
+    const char *address, const struct xaddr *xa)
+{
+	struct match_crit *mc;
+	int result = 1;
+	u_int i;
+
+	debug3("checking match for '%s' user %s host %s addr %s",
+	    mb->condition, user ? user : "(null)", host ? host : "(null)",
+	    address ? address : "(null)");
+
+	for (i = 0; i < mb->ncrit && result; i++) {
+		mc = &mb->crit[i];
+		switch (mc->type) {
+		case MATCH_USER:
+			if (!user ||
+			    match_pattern_list_compiled(mc->pats, user) != 1)
+				result = 0;
+			else
+				debug("user %.100s matched 'User %.100s' at "
+				    "line %d", user, mc->arg, mb->linenum);
+			break;
+		case MATCH_GROUP:
+			if (match_cfg_line_group(mc->arg, mb->linenum,
+			    user) != 1)
+				result = 0;
+			break;
+		case MATCH_HOST:
+			if (!host ||
+			    match_pattern_list_compiled(mc->pats, host) != 1)
+				result = 0;
+			else
+				debug("connection from %.100s matched 'Host "
+				    "%.100s' at line %d", host, mc->arg,
+				    mb->linenum);
+			break;
+		case MATCH_ADDRESS:
+			if (addr_list_match(mc->addrs, address, xa) != 1)
+				result = 0;
+			else
+				debug("connection from %.100s matched 'Address "
+				    "%.100s' at line %d", address, mc->arg,
+				    mb->linenum);
+			break;
+		}
+	}
+	debug3("match %sfound", result ? "" : "not ");
+	return result;
+}
+
 #define WHITESPACE " \t\r\n"
 
 int
@@ -701,14 +966,15 @@ process_server_config_line(ServerOptions *options, char *line,
     const char *filename, int linenum, int *activep, const char *user,
     const char *host, const char *address)
 {
-	char *cp, **charptr, *arg, *p;
-	int cmdline = 0, *intptr, value, value2, n;
+	char *cp, **charptr, *arg, *p, *keyword;
+	int cmdline = 0, *intptr, *intptr2, value, value2, n;
 	SyslogFacility *log_facility_ptr;
 	LogLevel *log_level_ptr;
 	ServerOpCodes opcode;
 	int port;
 	u_int i, flags = 0;
 	size_t len;
+	const char *errstr;
 
 	cp = line;
 	if ((arg = strdelim(&cp)) == NULL)
@@ -718,6 +984,7 @@ process_server_config_line(ServerOptions *options, char *line,
 		arg = strdelim(&cp);
 	if (!arg || !*arg || *arg == '#')
 		return 0;
+	keyword = arg;
 	intptr = NULL;
 	charptr = NULL;
 	opcode = parse_token(arg, filename, linenum, &flags);
@@ -1264,6 +1531,105 @@ process_server_config_line(ServerOptions *options, char *line,
 			options->max_startups = options->max_startups_begin;
 		break;
 
+	case sPreforkWorkers:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: Missing PreforkWorkers spec.",
+			    filename, linenum);
+		if (strcmp(arg, "no") == 0) {
+			options->prefork_min = options->prefork_max = 0;
+			break;
+		}
+		if ((n = sscanf(arg, "%d:%d", &options->prefork_min,
+		    &options->prefork_max)) == 1)
+			options->prefork_max = options->prefork_min;
+		else if (n != 2)
+			fatal("%s line %d: Illegal PreforkWorkers spec.",
+			    filename, linenum);
+		if (options->prefork_min < 0 ||
+		    options->prefork_max < options->prefork_min ||
+		    options->prefork_max > PREFORK_WORKERS_MAX)
+			fatal("%s line %d: Illegal PreforkWorkers spec.",
+			    filename, linenum);
+		break;
+
+	case sListenerProcesses:
+		intptr = &options->listener_procs;
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: missing integer value.",
+			    filename, linenum);
+		value = atoi(arg);
+		if (value < 1 || value > LISTENER_PROCS_MAX)
+			fatal("%s line %d: ListenerProcesses must be "
+			    "between 1 and %d.", filename, linenum,
+			    LISTENER_PROCS_MAX);
+		if (*activep && *intptr == -1)
+			*intptr = value;
+		break;
+
+	case sPreauthConnections:
+		intptr = &options->preauth_connections;
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: missing integer value.",
+			    filename, linenum);
+		value = strtonum(arg, 0, PREAUTH_CONNECTIONS_MAX, &errstr);
+		if (errstr != NULL)
+			fatal("%s line %d: PreauthConnections must be "
+			    "between 0 and %d.", filename, linenum,
+			    PREAUTH_CONNECTIONS_MAX);
+		if (*activep && *intptr == -1)
+			*intptr = value;
+		break;
+
+	case sMonitorSharedMemory:
+		intptr = &options->monitor_shared_memory;
+		goto parse_flag;
+
+	case sPerSourceMaxStartups:
+		intptr = &options->per_source_max_startups;
+		intptr2 = &options->per_net_max_startups;
+		goto parse_persource;
+
+	case sPerSourceMaxFailures:
+		intptr = &options->per_source_max_failures;
+		intptr2 = &options->per_net_max_failures;
+ parse_persource:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: Missing %s spec.",
+			    filename, linenum, keyword);
+		if (strcmp(arg, "none") == 0)
+			value = value2 = 0;
+		else if ((n = sscanf(arg, "%d:%d", &value, &value2)) == 1)
+			value2 = 0;
+		else if (n != 2 || value < 0 || value2 < 0)
+			fatal("%s line %d: Illegal %s spec.",
+			    filename, linenum, keyword);
+		if (*activep && *intptr == -1) {
+			*intptr = value;
+			*intptr2 = value2;
+		}
+		break;
+
+	case sPerSourceNetBlockSize:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: Missing PerSourceNetBlockSize spec.",
+			    filename, linenum);
+		if ((n = sscanf(arg, "%d:%d", &value, &value2)) == 1)
+			value2 = 128;
+		if ((n != 1 && n != 2) || value < 0 || value > 32 ||
+		    value2 < 0 || value2 > 128)
+			fatal("%s line %d: Illegal PerSourceNetBlockSize spec.",
+			    filename, linenum);
+		if (*activep && options->per_source_masklen_ipv4 == -1) {
+			options->per_source_masklen_ipv4 = value;
+			options->per_source_masklen_ipv6 = value2;
+		}
+		break;
+
 	case sMaxAuthTries:
 		intptr = &options->max_authtries;
 		goto parse_int;
@@ -1288,6 +1654,9 @@ process_server_config_line(ServerOptions *options, char *line,
 	case sAuthorizedKeysFile2:
 		charptr = &options->authorized_keys_file2;
 		goto parse_tilde_filename;
+	case sAuthorizedKeysIndex:
+		intptr = &options->authorized_keys_index;
+		goto parse_flag;
 	case sAuthorizedPrincipalsFile:
 		charptr = &options->authorized_principals_file;
  parse_tilde_filename:
@@ -1491,9 +1860,36 @@ parse_server_match_config(ServerOptions *options, const char *user,
     const char *host, const char *address)
 {
 	ServerOptions mo;
+	struct match_block *mb;
+	struct xaddr *xa;
+	int active, bad_options = 0;
+	char *line;
+	u_int i, j;
+
+	if (!match_blocks_compiled)
+		match_blocks_compile("reprocess config", &cfg);
 
 	initialize_server_options(&mo);
-	parse_server_config(&mo, "reprocess config", &cfg, user, host, address);
+	xa = address == NULL ? NULL : addr_parse(address);
+	for (i = 0; i < num_match_blocks; i++) {
+		mb = &match_blocks[i];
+		if (!match_block_eval(mb, user, host, address, xa))
+			continue;
+		for (j = 0; j < mb->nlines; j++) {
+			active = 1;
+			line = xstrdup(mb->lines[j]);
+			if (process_server_config_line(&mo, line,
+			    "reprocess config", mb->linenums[j], &active,
+			    user, host, address) != 0)
+				bad_options++;
+			xfree(line);
+		}
+	}
+	if (xa != NULL)
+		xfree(xa);
+	if (bad_options > 0)
+		fatal("reprocess config: terminating, %d bad configuration "
+		    "options", bad_options);
 	copy_set_server_options(options, &mo, 0);
 }
 
@@ -1543,6 +1939,7 @@ copy_set_server_options(ServerOptions *dst, ServerOptions *src, int preauth)
 	M_CP_INTOPT(max_authtries);
 	M_CP_INTOPT(ip_qos_interactive);
 	M_CP_INTOPT(ip_qos_bulk);
+	M_CP_INTOPT(authorized_keys_index);
 
 	M_CP_STROPT(banner);
 	if (preauth)
@@ -1580,6 +1977,10 @@ parse_server_config(ServerOptions *options, const char *filename, Buffer *conf,
 	if (bad_options > 0)
 		fatal("%s: terminating, %d bad configuration options",
 		    filename, bad_options);
+	if (user == NULL) {
+		match_blocks_compile(filename, conf);
+		user_lists_compile(filename, options);
+	}
 }
 
 static const char *
@@ -1714,6 +2115,8 @@ dump_config(ServerOptions *o)
 	dump_cfg_int(sX11DisplayOffset, o->x11_display_offset);
 	dump_cfg_int(sMaxAuthTries, o->max_authtries);
 	dump_cfg_int(sMaxSessions, o->max_sessions);
+	dump_cfg_int(sListenerProcesses, o->listener_procs);
+	dump_cfg_int(sPreauthConnections, o->preauth_connections);
 	dump_cfg_int(sClientAliveInterval, o->client_alive_interval);
 	dump_cfg_int(sClientAliveCountMax, o->client_alive_count_max);
 
@@ -1727,6 +2130,7 @@ dump_config(ServerOptions *o)
 	    o->hostbased_uses_name_from_packet_only);
 	dump_cfg_fmtint(sRSAAuthentication, o->rsa_authentication);
 	dump_cfg_fmtint(sPubkeyAuthentication, o->pubkey_authentication);
+	dump_cfg_fmtint(sAuthorizedKeysIndex, o->authorized_keys_index);
 #ifdef KRB5
 	dump_cfg_fmtint(sKerberosAuthentication, o->kerberos_authentication);
 	dump_cfg_fmtint(sKerberosOrLocalPasswd, o->kerberos_or_local_passwd);
@@ -1763,6 +2167,7 @@ dump_config(ServerOptions *o)
 	dump_cfg_fmtint(sCompression, o->compression);
 	dump_cfg_fmtint(sGatewayPorts, o->gateway_ports);
 	dump_cfg_fmtint(sUseDNS, o->use_dns);
+	dump_cfg_fmtint(sMonitorSharedMemory, o->monitor_shared_memory);
 	dump_cfg_fmtint(sAllowTcpForwarding, o->allow_tcp_forwarding);
 	dump_cfg_fmtint(sUsePrivilegeSeparation, use_privsep);
 
@@ -1803,6 +2208,13 @@ dump_config(ServerOptions *o)
 
 	printf("maxstartups %d:%d:%d\n", o->max_startups_begin,
 	    o->max_startups_rate, o->max_startups);
+	printf("preforkworkers %d:%d\n", o->prefork_min, o->prefork_max);
+	printf("persourcemaxstartups %d:%d\n", o->per_source_max_startups,
+	    o->per_net_max_startups);
+	printf("persourcemaxfailures %d:%d\n", o->per_source_max_failures,
+	    o->per_net_max_failures);
+	printf("persourcenetblocksize %d:%d\n", o->per_source_masklen_ipv4,
+	    o->per_source_masklen_ipv6);
 
 	for (i = 0; tunmode_desc[i].val != -1; i++)
 		if (tunmode_desc[i].val == o->permit_tun) {
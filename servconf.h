@@ -27,6 +27,9 @@
 #define MAX_HOSTCERTS		256	/* Max # host certificates. */
 #define MAX_ACCEPT_ENV		256	/* Max # of env vars. */
 #define MAX_MATCH_GROUPS	256	/* Max # of groups for Match. */
+#define PREFORK_WORKERS_MAX	1024	/* Max # of pre-forked workers. */
+#define LISTENER_PROCS_MAX	256	/* Max # of listener processes. */
+#define PREAUTH_CONNECTIONS_MAX	16384	/* Max # of held connections. */
 
 /* permit_root_login */
 #define	PERMIT_NOT_SET		-1
@@ -116,8 +119,10 @@ typedef struct {
 	int	allow_agent_forwarding;
 	u_int num_allow_users;
 	char   *allow_users[MAX_ALLOW_USERS];
+	struct user_pattern *allow_user_pats[MAX_ALLOW_USERS];	/* compiled */
 	u_int num_deny_users;
 	char   *deny_users[MAX_DENY_USERS];
+	struct user_pattern *deny_user_pats[MAX_DENY_USERS];	/* compiled */
 	u_int num_allow_groups;
 	char   *allow_groups[MAX_ALLOW_GROUPS];
 	u_int num_deny_groups;
@@ -134,6 +139,17 @@ typedef struct {
 	int	max_startups_begin;
 	int	max_startups_rate;
 	int	max_startups;
+	int	prefork_min;		/* idle pre-forked workers to keep */
+	int	prefork_max;		/* upper bound when pool grows */
+	int	listener_procs;		/* SO_REUSEPORT listener processes */
+	int	preauth_connections;	/* held by listener until ident */
+	int	per_source_max_startups;	/* per address, 0 = none */
+	int	per_net_max_startups;		/* per netblock, 0 = none */
+	int	per_source_max_failures;	/* recent failures, per address */
+	int	per_net_max_failures;		/* recent failures, per netblock */
+	int	per_source_masklen_ipv4;	/* netblock size */
+	int	per_source_masklen_ipv6;
+	int	monitor_shared_memory;	/* privsep IPC over shared rings */
 	int	max_authtries;
 	int	max_sessions;
 	char   *banner;			/* SSH-2 banner message */
@@ -150,6 +166,7 @@ typedef struct {
 
 	char   *authorized_keys_file;	/* File containing public keys */
 	char   *authorized_keys_file2;
+	int	authorized_keys_index;	/* keep sidecar index of key files */
 
 	char   *adm_forced_command;
 
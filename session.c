@@ -91,6 +91,7 @@
 #include "kex.h"
 #include "monitor_wrap.h"
 #include "sftp.h"
+#include "nsscache.h"
 
 #if defined(KRB5) && defined(USE_AFS)
 #include <kafs.h>
@@ -1488,12 +1489,13 @@ do_setusercontext(struct passwd *pw)
 			exit(1);
 		}
 		/* Initialize the group list. */
-		if (initgroups(pw->pw_name, pw->pw_gid) < 0) {
+		if (nsscache_initgroups(pw->pw_name, pw->pw_gid) < 0) {
 			perror("initgroups");
 			exit(1);
 		}
 		endgrent();
 #endif
+		nsscache_log_stats();
 
 		platform_setusercontext_post_groups(pw);
 
@@ -39,10 +39,18 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#else
+# ifdef HAVE_SYS_POLL_H
+#  include <sys/poll.h>
+# endif
+#endif
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "xmalloc.h"
@@ -62,9 +70,54 @@ extern int showprogress;
 /* Minimum amount of data to read at a time */
 #define MIN_READ_SIZE	512
 
+/* Flush queued requests once this many bytes are pending */
+#define OQUEUE_FLUSH	(64 * 1024)
+
+/* Size of reads from the server */
+#define IQUEUE_READ	(64 * 1024)
+
+/* Transfer size used when none was given and server limits are unknown */
+#define DEFAULT_COPY_BUFLEN	32768
+
+/* Largest transfer size chosen automatically from the server's limits */
+#define LIMITS_COPY_BUFLEN	(512 * 1024)
+
+/* Most outstanding requests chosen automatically */
+#define DEFAULT_NUM_REQUESTS	64
+
+/* Bytes in flight that an automatic number of requests aims for */
+#define DEFAULT_INFLIGHT	(DEFAULT_NUM_REQUESTS * DEFAULT_COPY_BUFLEN)
+
 /* Maximum depth to descend in directory trees */
 #define MAX_DIR_DEPTH 64
 
+/* Seconds that remote listings and attributes are reused for */
+#define CACHE_TTL	5
+
+/* Maximum number of cached listings and attributes */
+#define CACHE_MAX	128
+
+/*
+ * A remote directory listing or the attributes of a single path, kept
+ * for a short while so that repeated lookups from ls, glob expansion
+ * and completion need not go to the server. Any change made through
+ * the connection discards the lot.
+ */
+struct cache_ent {
+	TAILQ_ENTRY(cache_ent) tq;
+	char *path;
+	int type;
+#define CACHE_DIR	1
+#define CACHE_STAT	2
+#define CACHE_LSTAT	3
+	time_t expires;
+	Attrib a;		/* CACHE_STAT and CACHE_LSTAT */
+	SFTP_DIRENT **dir;	/* CACHE_DIR, in server order */
+	SFTP_DIRENT **sorted;	/* CACHE_DIR, sorted by filename */
+	u_int nents;
+};
+TAILQ_HEAD(cache_head, cache_ent);
+
 struct sftp_conn {
 	int fd_in;
 	int fd_out;
@@ -76,9 +129,20 @@ struct sftp_conn {
 #define SFTP_EXT_STATVFS	0x00000002
 #define SFTP_EXT_FSTATVFS	0x00000004
 #define SFTP_EXT_HARDLINK	0x00000008
+#define SFTP_EXT_BLOCKHASH	0x00000010
+#define SFTP_EXT_HASH		0x00000020
+#define SFTP_EXT_DIRTREE	0x00000040
+#define SFTP_EXT_EXTENTS	0x00000080
+#define SFTP_EXT_LIMITS		0x00000100
 	u_int exts;
+	u_int max_msglen;	/* largest message we may send */
 	u_int64_t limit_kbps;
+	int write_mode;		/* WRITE_MODE_* for downloads */
 	struct bwlimit bwlimit_in, bwlimit_out;
+	Buffer oqueue;		/* requests not yet written */
+	Buffer iqueue;		/* replies read but not yet consumed */
+	struct cache_head cache;	/* most recently used first */
+	u_int ncache;
 };
 
 static char *
@@ -95,28 +159,74 @@ sftpio(void *_bwlimit, size_t amount)
 	return 0;
 }
 
+/*
+ * Write out any queued requests. Called before waiting for a reply and
+ * whenever the server must see a request before we do local work.
+ */
 static void
-send_msg(struct sftp_conn *conn, Buffer *m)
+flush_msgs(struct sftp_conn *conn)
 {
-	u_char mlen[4];
-	struct iovec iov[2];
+	u_int len = buffer_len(&conn->oqueue);
 
-	if (buffer_len(m) > SFTP_MAX_MSG_LENGTH)
+	if (len == 0)
+		return;
+	if (atomicio6(vwrite, conn->fd_out, buffer_ptr(&conn->oqueue), len,
+	    conn->limit_kbps > 0 ? sftpio : NULL, &conn->bwlimit_out) != len)
+		fatal("Couldn't send packet: %s", strerror(errno));
+	buffer_clear(&conn->oqueue);
+}
+
+/*
+ * Queue a request. Requests are coalesced and written together once
+ * OQUEUE_FLUSH bytes have accumulated or a reply is needed.
+ */
+static void
+send_msg(struct sftp_conn *conn, Buffer *m)
+{
+	if (buffer_len(m) > conn->max_msglen)
 		fatal("Outbound message too long %u", buffer_len(m));
 
-	/* Send length first */
-	put_u32(mlen, buffer_len(m));
-	iov[0].iov_base = mlen;
-	iov[0].iov_len = sizeof(mlen);
-	iov[1].iov_base = buffer_ptr(m);
-	iov[1].iov_len = buffer_len(m);
+	buffer_put_int(&conn->oqueue, buffer_len(m));
+	buffer_append(&conn->oqueue, buffer_ptr(m), buffer_len(m));
+	buffer_clear(m);
 
-	if (atomiciov6(writev, conn->fd_out, iov, 2,
-	    conn->limit_kbps > 0 ? sftpio : NULL, &conn->bwlimit_out) != 
-	    buffer_len(m) + sizeof(mlen))
-		fatal("Couldn't send packet: %s", strerror(errno));
+	if (buffer_len(&conn->oqueue) >= OQUEUE_FLUSH)
+		flush_msgs(conn);
+}
 
-	buffer_clear(m);
+/*
+ * Read at least "want" more bytes into the input queue. Reads are done
+ * in large chunks so that several replies may be picked up at once.
+ */
+static void
+fill_iqueue(struct sftp_conn *conn, u_int want)
+{
+	struct pollfd pfd;
+	u_int len = MAX(want, IQUEUE_READ);
+	u_char *p;
+	ssize_t r;
+
+	while (want > 0) {
+		p = buffer_append_space(&conn->iqueue, len);
+		r = read(conn->fd_in, p, len);
+		buffer_consume_end(&conn->iqueue, r > 0 ? len - r : len);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			pfd.fd = conn->fd_in;
+			pfd.events = POLLIN;
+			(void)poll(&pfd, 1, -1);
+			continue;
+		}
+		if (r == 0)
+			fatal("Connection closed");
+		if (r == -1)
+			fatal("Couldn't read packet: %s", strerror(errno));
+		if (conn->limit_kbps > 0)
+			bandwidth_limit(&conn->bwlimit_in, r);
+		want -= MIN((u_int)r, want);
+		len = MAX(want, IQUEUE_READ);
+	}
 }
 
 static void
@@ -124,28 +234,19 @@ get_msg(struct sftp_conn *conn, Buffer *m)
 {
 	u_int msg_len;
 
-	buffer_append_space(m, 4);
-	if (atomicio6(read, conn->fd_in, buffer_ptr(m), 4,
-	    conn->limit_kbps > 0 ? sftpio : NULL, &conn->bwlimit_in) != 4) {
-		if (errno == EPIPE)
-			fatal("Connection closed");
-		else
-			fatal("Couldn't read packet: %s", strerror(errno));
-	}
+	flush_msgs(conn);
 
-	msg_len = buffer_get_int(m);
-	if (msg_len > SFTP_MAX_MSG_LENGTH)
+	if (buffer_len(&conn->iqueue) < 4)
+		fill_iqueue(conn, 4 - buffer_len(&conn->iqueue));
+	msg_len = get_u32(buffer_ptr(&conn->iqueue));
+	if (msg_len > SFTP_MAX_LARGE_MSG_LENGTH)
 		fatal("Received message too long %u", msg_len);
+	buffer_consume(&conn->iqueue, 4);
 
-	buffer_append_space(m, msg_len);
-	if (atomicio6(read, conn->fd_in, buffer_ptr(m), msg_len,
-	    conn->limit_kbps > 0 ? sftpio : NULL, &conn->bwlimit_in)
-	    != msg_len) {
-		if (errno == EPIPE)
-			fatal("Connection closed");
-		else
-			fatal("Read packet: %s", strerror(errno));
-	}
+	if (buffer_len(&conn->iqueue) < msg_len)
+		fill_iqueue(conn, msg_len - buffer_len(&conn->iqueue));
+	buffer_append(m, buffer_ptr(&conn->iqueue), msg_len);
+	buffer_consume(&conn->iqueue, msg_len);
 }
 
 static void
@@ -329,6 +430,60 @@ get_decode_statvfs(struct sftp_conn *conn, struct sftp_statvfs *st,
 	return 0;
 }
 
+/*
+ * Ask the server for its "limits@openssh.com" and size messages and
+ * transfers to match. A transfer_buflen of 0 asks for an automatic size.
+ */
+static void
+apply_limits(struct sftp_conn *conn)
+{
+	Buffer msg;
+	u_int type, id;
+	u_int64_t packet_len, read_len, write_len, open_handles, max;
+
+	buffer_init(&msg);
+	id = conn->msg_id++;
+	buffer_put_char(&msg, SSH2_FXP_EXTENDED);
+	buffer_put_int(&msg, id);
+	buffer_put_cstring(&msg, "limits@openssh.com");
+	send_msg(conn, &msg);
+	debug3("Sent message limits@openssh.com I:%u", id);
+
+	get_msg(conn, &msg);
+	type = buffer_get_char(&msg);
+	if (buffer_get_int(&msg) != id)
+		fatal("ID mismatch in limits reply");
+	if (type != SSH2_FXP_EXTENDED_REPLY) {
+		debug("Server refused limits request, type %u", type);
+		buffer_free(&msg);
+		return;
+	}
+	packet_len = buffer_get_int64(&msg);
+	read_len = buffer_get_int64(&msg);
+	write_len = buffer_get_int64(&msg);
+	open_handles = buffer_get_int64(&msg);
+	buffer_free(&msg);
+	debug2("Server limits: packet %llu read %llu write %llu handles %llu",
+	    (unsigned long long)packet_len, (unsigned long long)read_len,
+	    (unsigned long long)write_len, (unsigned long long)open_handles);
+
+	if (packet_len > 0)
+		conn->max_msglen = MIN(packet_len, SFTP_MAX_LARGE_MSG_LENGTH);
+
+	/* Leave room for the request headers around the data */
+	max = MIN(read_len, write_len);
+	if (max == 0 || conn->max_msglen < 1024)
+		return;
+	max = MIN(max, conn->max_msglen - 1024);
+	if (conn->transfer_buflen == 0)
+		conn->transfer_buflen = MIN(max, LIMITS_COPY_BUFLEN);
+	else if (conn->transfer_buflen > max) {
+		debug("Reducing transfer size from %u to server limit %llu",
+		    conn->transfer_buflen, (unsigned long long)max);
+		conn->transfer_buflen = max;
+	}
+}
+
 struct sftp_conn *
 do_init(int fd_in, int fd_out, u_int transfer_buflen, u_int num_requests,
     u_int64_t limit_kbps)
@@ -343,7 +498,13 @@ do_init(int fd_in, int fd_out, u_int transfer_buflen, u_int num_requests,
 	ret->transfer_buflen = transfer_buflen;
 	ret->num_requests = num_requests;
 	ret->exts = 0;
+	ret->max_msglen = SFTP_MAX_MSG_LENGTH;
 	ret->limit_kbps = 0;
+	ret->write_mode = WRITE_MODE_NORMAL;
+	buffer_init(&ret->oqueue);
+	buffer_init(&ret->iqueue);
+	TAILQ_INIT(&ret->cache);
+	ret->ncache = 0;
 
 	buffer_init(&msg);
 	buffer_put_char(&msg, SSH2_FXP_INIT);
@@ -387,6 +548,26 @@ do_init(int fd_in, int fd_out, u_int transfer_buflen, u_int num_requests,
 		    strcmp(value, "1") == 0) {
 			ret->exts |= SFTP_EXT_HARDLINK;
 			known = 1;
+		} else if (strcmp(name, "blockhash@openssh.com") == 0 &&
+		    strcmp(value, "1") == 0) {
+			ret->exts |= SFTP_EXT_BLOCKHASH;
+			known = 1;
+		} else if (strcmp(name, "hash@openssh.com") == 0 &&
+		    strcmp(value, "1") == 0) {
+			ret->exts |= SFTP_EXT_HASH;
+			known = 1;
+		} else if (strcmp(name, "opendir-tree@openssh.com") == 0 &&
+		    strcmp(value, "1") == 0) {
+			ret->exts |= SFTP_EXT_DIRTREE;
+			known = 1;
+		} else if (strcmp(name, "extents@openssh.com") == 0 &&
+		    strcmp(value, "1") == 0) {
+			ret->exts |= SFTP_EXT_EXTENTS;
+			known = 1;
+		} else if (strcmp(name, "limits@openssh.com") == 0 &&
+		    strcmp(value, "1") == 0) {
+			ret->exts |= SFTP_EXT_LIMITS;
+			known = 1;
 		}
 		if (known) {
 			debug2("Server supports extension \"%s\" revision %s",
@@ -400,10 +581,27 @@ do_init(int fd_in, int fd_out, u_int transfer_buflen, u_int num_requests,
 
 	buffer_free(&msg);
 
+	/* Size requests to fit the server's limits */
+	if ((ret->exts & SFTP_EXT_LIMITS) != 0)
+		apply_limits(ret);
+	if (ret->transfer_buflen == 0)
+		ret->transfer_buflen = DEFAULT_COPY_BUFLEN;
+
 	/* Some filexfer v.0 servers don't support large packets */
 	if (ret->version == 0)
 		ret->transfer_buflen = MIN(ret->transfer_buflen, 20480);
 
+	/*
+	 * Keep about as much data in flight with large transfers as the
+	 * traditional defaults did, rather than multiplying it.
+	 */
+	if (ret->num_requests == 0) {
+		ret->num_requests = MAX(1, MIN(DEFAULT_NUM_REQUESTS,
+		    DEFAULT_INFLIGHT / ret->transfer_buflen));
+	}
+	debug2("Transfer size %u, %u outstanding requests",
+	    ret->transfer_buflen, ret->num_requests);
+
 	ret->limit_kbps = limit_kbps;
 	if (ret->limit_kbps > 0) {
 		bandwidth_limit_init(&ret->bwlimit_in, ret->limit_kbps,
@@ -421,6 +619,12 @@ sftp_proto_version(struct sftp_conn *conn)
 	return conn->version;
 }
 
+void
+sftp_set_write_mode(struct sftp_conn *conn, int mode)
+{
+	conn->write_mode = mode;
+}
+
 int
 do_close(struct sftp_conn *conn, char *handle, u_int handle_len)
 {
@@ -446,9 +650,211 @@ do_close(struct sftp_conn *conn, char *handle, u_int handle_len)
 }
 
 
+static void
+cache_free(struct sftp_conn *conn, struct cache_ent *ent)
+{
+	TAILQ_REMOVE(&conn->cache, ent, tq);
+	conn->ncache--;
+	if (ent->dir != NULL)
+		free_sftp_dirents(ent->dir);
+	if (ent->sorted != NULL)
+		xfree(ent->sorted);
+	xfree(ent->path);
+	xfree(ent);
+}
+
+/* Forget everything cached, after the remote side has been changed */
+static void
+cache_flush(struct sftp_conn *conn)
+{
+	if (conn->ncache > 0)
+		debug3("Flushing %u cached remote entries", conn->ncache);
+	while (!TAILQ_EMPTY(&conn->cache))
+		cache_free(conn, TAILQ_FIRST(&conn->cache));
+}
+
+/* Copy of 'path' without trailing slashes, to use as a cache key */
+static char *
+cache_key(const char *path)
+{
+	char *key = xstrdup(path);
+	size_t len = strlen(key);
+
+	while (len > 1 && key[len - 1] == '/')
+		key[--len] = '\0';
+	return key;
+}
+
+static struct cache_ent *
+cache_find(struct sftp_conn *conn, int type, const char *key)
+{
+	struct cache_ent *ent, *next;
+	time_t now = time(NULL);
+
+	for (ent = TAILQ_FIRST(&conn->cache); ent != NULL; ent = next) {
+		next = TAILQ_NEXT(ent, tq);
+		if (ent->expires < now) {
+			cache_free(conn, ent);
+			continue;
+		}
+		if (ent->type == type && strcmp(ent->path, key) == 0) {
+			TAILQ_REMOVE(&conn->cache, ent, tq);
+			TAILQ_INSERT_HEAD(&conn->cache, ent, tq);
+			return ent;
+		}
+	}
+	return NULL;
+}
+
+static struct cache_ent *
+cache_add(struct sftp_conn *conn, int type, const char *path)
+{
+	struct cache_ent *ent;
+
+	while (conn->ncache >= CACHE_MAX)
+		cache_free(conn, TAILQ_LAST(&conn->cache, cache_head));
+	ent = xcalloc(1, sizeof(*ent));
+	ent->path = cache_key(path);
+	ent->type = type;
+	ent->expires = time(NULL) + CACHE_TTL;
+	TAILQ_INSERT_HEAD(&conn->cache, ent, tq);
+	conn->ncache++;
+	return ent;
+}
+
+static SFTP_DIRENT **
+dirents_dup(SFTP_DIRENT **dir, u_int *np)
+{
+	SFTP_DIRENT **ret;
+	u_int i, n;
+
+	for (n = 0; dir[n] != NULL; n++)
+		;
+	ret = xcalloc(n + 1, sizeof(*ret));
+	for (i = 0; i < n; i++) {
+		ret[i] = xmalloc(sizeof(*ret[i]));
+		ret[i]->filename = xstrdup(dir[i]->filename);
+		ret[i]->longname = xstrdup(dir[i]->longname);
+		memcpy(&ret[i]->a, &dir[i]->a, sizeof(dir[i]->a));
+	}
+	if (np != NULL)
+		*np = n;
+	return ret;
+}
+
 static int
-do_lsreaddir(struct sftp_conn *conn, char *path, int printflag,
-    SFTP_DIRENT ***dir)
+dirent_comp(const void *aa, const void *bb)
+{
+	return strcmp((*(SFTP_DIRENT * const *)aa)->filename,
+	    (*(SFTP_DIRENT * const *)bb)->filename);
+}
+
+static void
+cache_add_dir(struct sftp_conn *conn, const char *path, SFTP_DIRENT **dir)
+{
+	struct cache_ent *ent;
+
+	if ((ent = cache_find(conn, CACHE_DIR, path)) != NULL)
+		cache_free(conn, ent);
+	ent = cache_add(conn, CACHE_DIR, path);
+	ent->dir = dirents_dup(dir, &ent->nents);
+	ent->sorted = xcalloc(ent->nents + 1, sizeof(*ent->sorted));
+	memcpy(ent->sorted, ent->dir, ent->nents * sizeof(*ent->sorted));
+	qsort(ent->sorted, ent->nents, sizeof(*ent->sorted), dirent_comp);
+}
+
+static void
+cache_add_attrib(struct sftp_conn *conn, int type, const char *path,
+    Attrib *a)
+{
+	struct cache_ent *ent;
+	char *key = cache_key(path);
+
+	if ((ent = cache_find(conn, type, key)) != NULL)
+		cache_free(conn, ent);
+	xfree(key);
+	ent = cache_add(conn, type, path);
+	memcpy(&ent->a, a, sizeof(*a));
+}
+
+/*
+ * Look up cached attributes for 'path'. The lstat attributes of a path
+ * may also come from a cached listing of its directory, and those of
+ * anything but a symlink answer a stat too.
+ */
+static Attrib *
+cache_attrib(struct sftp_conn *conn, int type, const char *path)
+{
+	static Attrib a;
+	struct cache_ent *ent;
+	SFTP_DIRENT key, *keyp = &key, **d;
+	char *cp, *parent = cache_key(path);
+	Attrib *ret = NULL;
+
+	if ((ent = cache_find(conn, type, parent)) != NULL ||
+	    (type == CACHE_STAT &&
+	    (ent = cache_find(conn, CACHE_LSTAT, parent)) != NULL &&
+	    (ent->a.flags & SSH2_FILEXFER_ATTR_PERMISSIONS) &&
+	    !S_ISLNK(ent->a.perm))) {
+		ret = &ent->a;
+		goto out;
+	}
+	if ((cp = strrchr(parent, '/')) == NULL || cp[1] == '\0')
+		goto out;
+	key.filename = cp + 1;
+	if (cp == parent)
+		cp++;
+	*cp = '\0';
+	if ((ent = cache_find(conn, CACHE_DIR, parent)) == NULL)
+		goto out;
+	d = bsearch(&keyp, ent->sorted, ent->nents, sizeof(*ent->sorted),
+	    dirent_comp);
+	if (d != NULL && (type == CACHE_LSTAT ||
+	    ((*d)->a.flags & SSH2_FILEXFER_ATTR_PERMISSIONS &&
+	    !S_ISLNK((*d)->a.perm))))
+		ret = &(*d)->a;
+ out:
+	xfree(parent);
+	if (ret == NULL)
+		return NULL;
+	debug3("Using cached attributes for \"%s\"", path);
+	memcpy(&a, ret, sizeof(a));
+	return &a;
+}
+
+/*
+ * Returns nonzero if 'path', sent in a tree listing, is a plain relative
+ * path that cannot escape the tree. A single trailing '/' is allowed; it
+ * marks a directory the server could not read.
+ */
+static int
+tree_path_ok(const char *path)
+{
+	const char *cp;
+	size_t len;
+
+	if (*path == '\0' || *path == '/')
+		return 0;
+	for (cp = path; *cp != '\0'; cp += len + (cp[len] == '/')) {
+		len = strcspn(cp, "/");
+		if (len == 0 || (len == 1 && cp[0] == '.') ||
+		    (len == 2 && cp[0] == '.' && cp[1] == '.'))
+			return 0;
+		if (cp[len] == '/' && cp[len + 1] == '\0')
+			break;
+	}
+	return 1;
+}
+
+/*
+ * Read the directory 'path' into 'dir'. If 'tree' is set, read the
+ * whole tree below it, 'depth' levels deep, with a single
+ * "opendir-tree@openssh.com" request; the names returned are then
+ * relative to 'path'.
+ */
+static int
+do_lsreaddir(struct sftp_conn *conn, char *path, int printflag, int tree,
+    u_int depth, const char *pattern, SFTP_DIRENT ***dir)
 {
 	Buffer msg;
 	u_int count, type, id, handle_len, i, expected_id, ents = 0;
@@ -457,9 +863,18 @@ do_lsreaddir(struct sftp_conn *conn, char *path, int printflag,
 	id = conn->msg_id++;
 
 	buffer_init(&msg);
-	buffer_put_char(&msg, SSH2_FXP_OPENDIR);
-	buffer_put_int(&msg, id);
-	buffer_put_cstring(&msg, path);
+	if (tree) {
+		buffer_put_char(&msg, SSH2_FXP_EXTENDED);
+		buffer_put_int(&msg, id);
+		buffer_put_cstring(&msg, "opendir-tree@openssh.com");
+		buffer_put_cstring(&msg, path);
+		buffer_put_int(&msg, depth);
+		buffer_put_cstring(&msg, pattern == NULL ? "" : pattern);
+	} else {
+		buffer_put_char(&msg, SSH2_FXP_OPENDIR);
+		buffer_put_int(&msg, id);
+		buffer_put_cstring(&msg, path);
+	}
 	send_msg(conn, &msg);
 
 	buffer_clear(&msg);
@@ -536,7 +951,8 @@ do_lsreaddir(struct sftp_conn *conn, char *path, int printflag,
 			 * These can be used to attack recursive ops
 			 * (e.g. send '../../../../etc/passwd')
 			 */
-			if (strchr(filename, '/') != NULL) {
+			if (tree ? !tree_path_ok(filename) :
+			    strchr(filename, '/') != NULL) {
 				error("Server sent suspect path \"%s\" "
 				    "during readdir of \"%s\"", filename, path);
 				goto next;
@@ -573,7 +989,274 @@ do_lsreaddir(struct sftp_conn *conn, char *path, int printflag,
 int
 do_readdir(struct sftp_conn *conn, char *path, SFTP_DIRENT ***dir)
 {
-	return(do_lsreaddir(conn, path, 0, dir));
+	struct cache_ent *ent;
+	char *key = cache_key(path);
+	int r;
+
+	ent = cache_find(conn, CACHE_DIR, key);
+	xfree(key);
+	if (ent != NULL) {
+		debug3("Using cached listing of \"%s\"", path);
+		*dir = dirents_dup(ent->dir, NULL);
+		return 0;
+	}
+	r = do_lsreaddir(conn, path, 0, 0, 0, NULL, dir);
+	if (r == 0 && !interrupted)
+		cache_add_dir(conn, path, *dir);
+	return r;
+}
+
+/*
+ * A remote directory tree fetched in one go. The entries are sorted by
+ * their parent directory and then by name, so that the contents of any
+ * directory in the tree can be found with a binary search.
+ */
+struct sftp_tree {
+	char *root;		/* Path the listing was made from */
+	u_int depth;		/* Levels listed, 0 for unlimited */
+	SFTP_DIRENT **ents;	/* Named relative to 'root' */
+	u_int nents;
+	char **unreadable;	/* Directories listed but not read */
+	u_int nunreadable;
+};
+
+/* Length of the parent directory part of a relative tree path */
+static size_t
+tree_parent_len(const char *path)
+{
+	const char *cp;
+
+	return (cp = strrchr(path, '/')) == NULL ? 0 : (size_t)(cp - path);
+}
+
+static int
+tree_key_comp(const char *parent, size_t plen, const char *name,
+    const char *path)
+{
+	size_t len = tree_parent_len(path);
+	int r;
+
+	if ((r = strncmp(parent, path, MIN(plen, len))) != 0)
+		return r;
+	if (plen != len)
+		return plen < len ? -1 : 1;
+	return strcmp(name, path + len + (len != 0));
+}
+
+static int
+tree_ent_comp(const void *aa, const void *bb)
+{
+	const char *a = (*(SFTP_DIRENT * const *)aa)->filename;
+	const char *b = (*(SFTP_DIRENT * const *)bb)->filename;
+	size_t len = tree_parent_len(a);
+
+	return tree_key_comp(a, len, a + len + (len != 0), b);
+}
+
+/* Index of the first entry not ordered before 'parent'/'name' */
+static u_int
+tree_search(struct sftp_tree *tree, const char *parent, size_t plen,
+    const char *name)
+{
+	u_int lo = 0, hi = tree->nents, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (tree_key_comp(parent, plen, name,
+		    tree->ents[mid]->filename) > 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Return the name of 'path' relative to the top of 'tree' without any
+ * trailing slashes, or NULL if it lies outside the tree.
+ */
+static char *
+tree_relative(struct sftp_tree *tree, const char *path)
+{
+	const char *rel = NULL;
+	char *ret;
+	size_t len = strlen(tree->root);
+
+	while (len > 1 && tree->root[len - 1] == '/')
+		len--;
+	if (strcmp(tree->root, ".") == 0 && *path != '/') {
+		if (strcmp(path, ".") == 0 || strcmp(path, "./") == 0)
+			rel = "";
+		else
+			rel = strncmp(path, "./", 2) == 0 ? path + 2 : path;
+	} else if (strncmp(path, tree->root, len) == 0) {
+		if (tree->root[len - 1] == '/')
+			rel = path + len;
+		else if (path[len] == '\0' || path[len] == '/')
+			rel = path + len + (path[len] == '/');
+	}
+	if (rel == NULL)
+		return NULL;
+	ret = xstrdup(rel);
+	for (len = strlen(ret); len > 0 && ret[len - 1] == '/'; len--)
+		ret[len - 1] = '\0';
+	return ret;
+}
+
+/* Find the entry for 'rel', which must not be the top of the tree */
+static SFTP_DIRENT *
+tree_find(struct sftp_tree *tree, const char *rel)
+{
+	size_t len = tree_parent_len(rel);
+	const char *name = rel + len + (len != 0);
+	u_int i;
+
+	i = tree_search(tree, rel, len, name);
+	if (i < tree->nents && tree_key_comp(rel, len, name,
+	    tree->ents[i]->filename) == 0)
+		return tree->ents[i];
+	return NULL;
+}
+
+/*
+ * Fetch a listing of the remote tree below 'path', 'depth' levels deep
+ * or the whole tree if 'depth' is zero. If 'pattern' is not NULL, only
+ * directories and files whose name matches it are listed. Returns NULL
+ * if the server does not support this or the listing failed.
+ */
+struct sftp_tree *
+do_readdir_tree(struct sftp_conn *conn, char *path, u_int depth,
+    const char *pattern)
+{
+	struct sftp_tree *tree;
+	SFTP_DIRENT **ents;
+	char *key;
+	int cached;
+	size_t len;
+	u_int n;
+
+	if ((conn->exts & SFTP_EXT_DIRTREE) == 0)
+		return NULL;
+	/* A single level already listed is better served by do_readdir() */
+	if (depth == 1) {
+		key = cache_key(path);
+		cached = cache_find(conn, CACHE_DIR, key) != NULL;
+		xfree(key);
+		if (cached)
+			return NULL;
+	}
+	if (do_lsreaddir(conn, path, 0, 1, depth, pattern, &ents) != 0)
+		return NULL;
+
+	tree = xcalloc(1, sizeof(*tree));
+	for (n = 0; ents[n] != NULL; n++) {
+		len = strlen(ents[n]->filename);
+		if (ents[n]->filename[len - 1] != '/')
+			continue;
+		ents[n]->filename[len - 1] = '\0';
+		tree->unreadable = xrealloc(tree->unreadable,
+		    tree->nunreadable + 1, sizeof(*tree->unreadable));
+		tree->unreadable[tree->nunreadable++] =
+		    xstrdup(ents[n]->filename);
+	}
+	qsort(ents, n, sizeof(*ents), tree_ent_comp);
+	debug2("Listed %u entries below \"%s\"", n, path);
+
+	tree->root = xstrdup(path);
+	tree->depth = depth;
+	tree->ents = ents;
+	tree->nents = n;
+	return tree;
+}
+
+/*
+ * Read the contents of 'path' into 'dir' like do_readdir(), from 'tree'
+ * if it lists that directory or from the server otherwise.
+ */
+int
+tree_readdir(struct sftp_conn *conn, struct sftp_tree *tree, char *path,
+    SFTP_DIRENT ***dir)
+{
+	char *rel;
+	SFTP_DIRENT *d;
+	size_t len;
+	u_int i, n;
+
+	if (tree == NULL || (rel = tree_relative(tree, path)) == NULL)
+		return do_readdir(conn, path, dir);
+	if (*rel != '\0') {
+		d = tree_find(tree, rel);
+		/* Nothing to ask the server about a listed plain file */
+		if (d != NULL && !S_ISDIR(d->a.perm) && !S_ISLNK(d->a.perm)) {
+			xfree(rel);
+			return -1;
+		}
+		/* Directories at the deepest level were not entered */
+		for (i = 1, n = 0; rel[n] != '\0'; n++)
+			if (rel[n] == '/')
+				i++;
+		if ((tree->depth != 0 && i >= tree->depth) ||
+		    d == NULL || !S_ISDIR(d->a.perm)) {
+			xfree(rel);
+			return do_readdir(conn, path, dir);
+		}
+		/* Let the server report why it could not read it */
+		for (i = 0; i < tree->nunreadable; i++) {
+			if (strcmp(tree->unreadable[i], rel) == 0) {
+				xfree(rel);
+				return do_readdir(conn, path, dir);
+			}
+		}
+	}
+
+	len = strlen(rel);
+	i = tree_search(tree, rel, len, "");
+	*dir = xmalloc(sizeof(**dir));
+	for (n = 0; i < tree->nents; i++, n++) {
+		d = tree->ents[i];
+		if (tree_parent_len(d->filename) != len ||
+		    strncmp(d->filename, rel, len) != 0)
+			break;
+		*dir = xrealloc(*dir, n + 2, sizeof(**dir));
+		(*dir)[n] = xmalloc(sizeof(***dir));
+		(*dir)[n]->filename = xstrdup(d->filename + len + (len != 0));
+		(*dir)[n]->longname = xstrdup(d->longname);
+		memcpy(&(*dir)[n]->a, &d->a, sizeof(d->a));
+	}
+	(*dir)[n] = NULL;
+	xfree(rel);
+	return 0;
+}
+
+/* Return the attributes of 'path' from 'tree', or NULL if not listed */
+Attrib *
+tree_lstat(struct sftp_tree *tree, char *path)
+{
+	char *rel;
+	SFTP_DIRENT *d = NULL;
+
+	if (tree == NULL || (rel = tree_relative(tree, path)) == NULL)
+		return NULL;
+	if (*rel != '\0')
+		d = tree_find(tree, rel);
+	xfree(rel);
+	return d == NULL ? NULL : &d->a;
+}
+
+void
+free_sftp_tree(struct sftp_tree *tree)
+{
+	u_int i;
+
+	if (tree == NULL)
+		return;
+	free_sftp_dirents(tree->ents);
+	for (i = 0; i < tree->nunreadable; i++)
+		xfree(tree->unreadable[i]);
+	if (tree->unreadable != NULL)
+		xfree(tree->unreadable);
+	xfree(tree->root);
+	xfree(tree);
 }
 
 void free_sftp_dirents(SFTP_DIRENT **s)
@@ -595,6 +1278,7 @@ do_rm(struct sftp_conn *conn, char *path)
 
 	debug2("Sending SSH2_FXP_REMOVE \"%s\"", path);
 
+	cache_flush(conn);
 	id = conn->msg_id++;
 	send_string_request(conn, id, SSH2_FXP_REMOVE, path, strlen(path));
 	status = get_status(conn, id);
@@ -608,6 +1292,7 @@ do_mkdir(struct sftp_conn *conn, char *path, Attrib *a, int printflag)
 {
 	u_int status, id;
 
+	cache_flush(conn);
 	id = conn->msg_id++;
 	send_string_attrs_request(conn, id, SSH2_FXP_MKDIR, path,
 	    strlen(path), a);
@@ -624,6 +1309,7 @@ do_rmdir(struct sftp_conn *conn, char *path)
 {
 	u_int status, id;
 
+	cache_flush(conn);
 	id = conn->msg_id++;
 	send_string_request(conn, id, SSH2_FXP_RMDIR, path,
 	    strlen(path));
@@ -639,6 +1325,10 @@ Attrib *
 do_stat(struct sftp_conn *conn, char *path, int quiet)
 {
 	u_int id;
+	Attrib *a;
+
+	if ((a = cache_attrib(conn, CACHE_STAT, path)) != NULL)
+		return a;
 
 	id = conn->msg_id++;
 
@@ -646,13 +1336,16 @@ do_stat(struct sftp_conn *conn, char *path, int quiet)
 	    conn->version == 0 ? SSH2_FXP_STAT_VERSION_0 : SSH2_FXP_STAT,
 	    path, strlen(path));
 
-	return(get_decode_stat(conn, id, quiet));
+	if ((a = get_decode_stat(conn, id, quiet)) != NULL)
+		cache_add_attrib(conn, CACHE_STAT, path, a);
+	return a;
 }
 
 Attrib *
 do_lstat(struct sftp_conn *conn, char *path, int quiet)
 {
 	u_int id;
+	Attrib *a;
 
 	if (conn->version == 0) {
 		if (quiet)
@@ -662,14 +1355,18 @@ do_lstat(struct sftp_conn *conn, char *path, int quiet)
 		return(do_stat(conn, path, quiet));
 	}
 
+	if ((a = cache_attrib(conn, CACHE_LSTAT, path)) != NULL)
+		return a;
+
 	id = conn->msg_id++;
 	send_string_request(conn, id, SSH2_FXP_LSTAT, path,
 	    strlen(path));
 
-	return(get_decode_stat(conn, id, quiet));
+	if ((a = get_decode_stat(conn, id, quiet)) != NULL)
+		cache_add_attrib(conn, CACHE_LSTAT, path, a);
+	return a;
 }
 
-#ifdef notyet
 Attrib *
 do_fstat(struct sftp_conn *conn, char *handle, u_int handle_len, int quiet)
 {
@@ -681,13 +1378,13 @@ do_fstat(struct sftp_conn *conn, char *handle, u_int handle_len, int quiet)
 
 	return(get_decode_stat(conn, id, quiet));
 }
-#endif
 
 int
 do_setstat(struct sftp_conn *conn, char *path, Attrib *a)
 {
 	u_int status, id;
 
+	cache_flush(conn);
 	id = conn->msg_id++;
 	send_string_attrs_request(conn, id, SSH2_FXP_SETSTAT, path,
 	    strlen(path), a);
@@ -706,6 +1403,7 @@ do_fsetstat(struct sftp_conn *conn, char *handle, u_int handle_len,
 {
 	u_int status, id;
 
+	cache_flush(conn);
 	id = conn->msg_id++;
 	send_string_attrs_request(conn, id, SSH2_FXP_FSETSTAT, handle,
 	    handle_len, a);
@@ -774,6 +1472,7 @@ do_rename(struct sftp_conn *conn, char *oldpath, char *newpath)
 	buffer_init(&msg);
 
 	/* Send rename request */
+	cache_flush(conn);
 	id = conn->msg_id++;
 	if ((conn->exts & SFTP_EXT_POSIX_RENAME)) {
 		buffer_put_char(&msg, SSH2_FXP_EXTENDED);
@@ -808,6 +1507,7 @@ do_hardlink(struct sftp_conn *conn, char *oldpath, char *newpath)
 	buffer_init(&msg);
 
 	/* Send link request */
+	cache_flush(conn);
 	id = conn->msg_id++;
 	if ((conn->exts & SFTP_EXT_HARDLINK) == 0) {
 		error("Server does not support hardlink@openssh.com extension");
@@ -846,6 +1546,7 @@ do_symlink(struct sftp_conn *conn, char *oldpath, char *newpath)
 	buffer_init(&msg);
 
 	/* Send symlink request */
+	cache_flush(conn);
 	id = conn->msg_id++;
 	buffer_put_char(&msg, SSH2_FXP_SYMLINK);
 	buffer_put_int(&msg, id);
@@ -983,18 +1684,466 @@ send_read_request(struct sftp_conn *conn, u_int id, u_int64_t offset,
 	buffer_free(&msg);
 }
 
+/*
+ * Map of which blocks of a partially transferred file are already
+ * identical on both sides, built from "blockhash@openssh.com" replies.
+ */
+struct blockmap {
+	u_int64_t blocksize;
+	u_int64_t covered;	/* Bytes of the file described by the map */
+	u_int64_t nblocks;
+	u_char *same;		/* Nonzero if block matches on both sides */
+};
+
+/*
+ * Pick a block size for a file of 'size' bytes. Small blocks find more
+ * matching data, but cost more digests on the wire, so aim for about
+ * sqrt(size) and cap the total number of blocks.
+ */
+static u_int
+blockhash_size(u_int64_t size)
+{
+	u_int64_t bs;
+
+	for (bs = SFTP_BLOCKHASH_MIN; bs < SFTP_BLOCKHASH_MAX; bs <<= 1) {
+		if (bs * bs >= size &&
+		    bs * SFTP_BLOCKHASH_COUNT * 16 >= size)
+			break;
+	}
+	return bs;
+}
+
+static void
+blockmap_free(struct blockmap *map)
+{
+	if (map == NULL)
+		return;
+	xfree(map->same);
+	xfree(map);
+}
+
+/* An outstanding "blockhash@openssh.com" request */
+struct blockhash_req {
+	u_int id;
+	u_int64_t offset, len;
+	TAILQ_ENTRY(blockhash_req) tq;
+};
+
+static void
+send_blockhash_req(struct sftp_conn *conn, char *handle, u_int handle_len,
+    struct blockhash_req *req, u_int blocksize)
+{
+	Buffer msg;
+
+	req->id = conn->msg_id++;
+	buffer_init(&msg);
+	buffer_put_char(&msg, SSH2_FXP_EXTENDED);
+	buffer_put_int(&msg, req->id);
+	buffer_put_cstring(&msg, "blockhash@openssh.com");
+	buffer_put_string(&msg, handle, handle_len);
+	buffer_put_int64(&msg, req->offset);
+	buffer_put_int64(&msg, req->len);
+	buffer_put_int(&msg, blocksize);
+	send_msg(conn, &msg);
+	buffer_free(&msg);
+}
+
+/*
+ * Compare the first 'overlap' bytes of the open remote file 'handle' with
+ * 'local_fd' block by block. Returns a map of the blocks that match, or
+ * NULL if the server could not supply block hashes.
+ */
+static struct blockmap *
+get_blockmap(struct sftp_conn *conn, char *handle, u_int handle_len,
+    int local_fd, u_int64_t overlap)
+{
+	Buffer msg;
+	struct blockmap *map;
+	TAILQ_HEAD(reqhead, blockhash_req) requests;
+	struct blockhash_req *req;
+	u_char *hash, digest[SFTP_HASH_LEN];
+	u_int64_t blk, off, span, next, done, nsame = 0;
+	u_int type, id, count, hlen, i, num_req = 0;
+	int failed = 0;
+	ssize_t r;
+
+	if ((conn->exts & SFTP_EXT_BLOCKHASH) == 0) {
+		logit("Server does not support blockhash@openssh.com "
+		    "extension, transferring whole file");
+		return NULL;
+	}
+	if (overlap == 0)
+		return NULL;
+
+	map = xmalloc(sizeof(*map));
+	map->blocksize = blockhash_size(overlap);
+	map->covered = overlap;
+	map->nblocks = (overlap + map->blocksize - 1) / map->blocksize;
+	map->same = xcalloc(map->nblocks, sizeof(*map->same));
+
+	/* Each request asks for at most one full reply worth of digests */
+	span = map->blocksize * MIN(SFTP_BLOCKHASH_COUNT,
+	    SFTP_BLOCKHASH_BYTES / map->blocksize);
+	TAILQ_INIT(&requests);
+	buffer_init(&msg);
+	for (next = 0; next < overlap || num_req > 0;) {
+		while (next < overlap && num_req < conn->num_requests) {
+			req = xmalloc(sizeof(*req));
+			req->offset = next;
+			req->len = MIN(span, overlap - next);
+			next += req->len;
+			TAILQ_INSERT_TAIL(&requests, req, tq);
+			num_req++;
+			send_blockhash_req(conn, handle, handle_len, req,
+			    map->blocksize);
+		}
+
+		buffer_clear(&msg);
+		get_msg(conn, &msg);
+		type = buffer_get_char(&msg);
+		id = buffer_get_int(&msg);
+		debug3("Received blockhash reply T:%u I:%u", type, id);
+		req = TAILQ_FIRST(&requests);
+		if (id != req->id)
+			fatal("ID mismatch (%u != %u)", id, req->id);
+		TAILQ_REMOVE(&requests, req, tq);
+		if (type == SSH2_FXP_STATUS) {
+			u_int status = buffer_get_int(&msg);
+
+			if (!failed)
+				error("Couldn't get block hashes: %s",
+				    fx2txt(status));
+			failed = 1;
+			xfree(req);
+			num_req--;
+			continue;
+		} else if (type != SSH2_FXP_EXTENDED_REPLY)
+			fatal("Expected SSH2_FXP_EXTENDED_REPLY(%u) packet, "
+			    "got %u", SSH2_FXP_EXTENDED_REPLY, type);
+
+		count = buffer_get_int(&msg);
+		blk = req->offset / map->blocksize;
+		done = (u_int64_t)count * map->blocksize;
+		if (count > SFTP_BLOCKHASH_COUNT || blk + count > map->nblocks)
+			fatal("Server sent too many block hashes (%u)", count);
+		for (i = 0; i < count; i++, blk++) {
+			hash = buffer_get_string(&msg, &hlen);
+			if (hlen != SFTP_HASH_LEN)
+				fatal("Bad block hash length %u", hlen);
+			off = blk * map->blocksize;
+			r = hash_file_range(local_fd, off,
+			    MIN(map->blocksize, overlap - off), digest);
+			if (r != -1 && memcmp(hash, digest, hlen) == 0) {
+				map->same[blk] = 1;
+				nsame++;
+			}
+			xfree(hash);
+		}
+
+		/* A short reply that made progress: ask for the rest */
+		if (count > 0 && done < req->len && !failed) {
+			debug3("Short blockhash reply, %u hashes", count);
+			req->offset += done;
+			req->len -= done;
+			TAILQ_INSERT_TAIL(&requests, req, tq);
+			send_blockhash_req(conn, handle, handle_len, req,
+			    map->blocksize);
+			continue;
+		}
+		xfree(req);
+		num_req--;
+	}
+	buffer_free(&msg);
+
+	if (failed) {
+		blockmap_free(map);
+		return NULL;
+	}
+	debug("%llu of %llu blocks of %llu bytes already match",
+	    (unsigned long long)nsame, (unsigned long long)map->nblocks,
+	    (unsigned long long)map->blocksize);
+	return map;
+}
+
+/*
+ * Advance 'offset' past blocks that are already identical on both sides
+ * and clamp '*lenp' so that the next transfer stops short of the
+ * following identical block.
+ */
+static u_int64_t
+blockmap_next(struct blockmap *map, u_int64_t offset, u_int *lenp)
+{
+	u_int64_t blk;
+
+	if (map == NULL)
+		return offset;
+	while (offset < map->covered) {
+		blk = offset / map->blocksize;
+		if (!map->same[blk])
+			break;
+		offset = MIN((blk + 1) * map->blocksize, map->covered);
+	}
+	for (blk = offset / map->blocksize + 1; offset < map->covered &&
+	    blk < map->nblocks && blk * map->blocksize < offset + *lenp;
+	    blk++) {
+		if (map->same[blk]) {
+			*lenp = blk * map->blocksize - offset;
+			break;
+		}
+	}
+	return offset;
+}
+
+/* Most data extents tracked for a sparse file; the rest is sent whole */
+#define EXTENTS_TOTAL_MAX	65536
+
+/* The data in a sparse file. Anything outside the extents reads as zero */
+struct extentmap {
+	u_int64_t floor;	/* Everything below here is treated as data */
+	u_int64_t size;
+	u_int n, cur;
+	struct extent {
+		u_int64_t off, len;
+	} *ext;
+};
+
+static void
+extentmap_free(struct extentmap *map)
+{
+	if (map == NULL)
+		return;
+	if (map->ext != NULL)
+		xfree(map->ext);
+	xfree(map);
+}
+
+/*
+ * Append an extent. Returns -1 once the map is full, in which case the
+ * rest of the file from 'off' has been added as one extent.
+ */
+static int
+extentmap_add(struct extentmap *map, u_int64_t off, u_int64_t len)
+{
+	if (map->n + 1 >= EXTENTS_TOTAL_MAX)
+		len = map->size - off;
+	if ((map->n & 63) == 0)
+		map->ext = xrealloc(map->ext, map->n + 64, sizeof(*map->ext));
+	map->ext[map->n].off = off;
+	map->ext[map->n].len = len;
+	map->n++;
+	return map->n >= EXTENTS_TOTAL_MAX ? -1 : 0;
+}
+
+/* Returns 'map', or NULL if it has no holes worth skipping */
+static struct extentmap *
+extentmap_finish(struct extentmap *map)
+{
+	if (map->size <= map->floor || (map->n == 1 &&
+	    map->ext[0].off == map->floor && map->ext[0].len ==
+	    map->size - map->floor)) {
+		extentmap_free(map);
+		return NULL;
+	}
+	debug("%u data extents in %llu bytes", map->n,
+	    (unsigned long long)map->size);
+	return map;
+}
+
+/* Find the data in the local file 'fd' of 'size' bytes above 'floor' */
+static struct extentmap *
+get_local_extents(int fd, u_int64_t size, u_int64_t floor)
+{
+	struct extentmap *map;
+	off_t start, end;
+	u_int64_t off;
+
+	map = xcalloc(1, sizeof(*map));
+	map->floor = floor;
+	map->size = size;
+	for (off = floor; off < size; off = end) {
+		file_data_extent(fd, off, size, &start, &end);
+		if (start >= end || extentmap_add(map, start, end - start) < 0)
+			break;
+	}
+	return extentmap_finish(map);
+}
+
+/*
+ * Ask the server where the data in the open file 'handle' lies above
+ * 'floor'. Returns NULL if that is unknown or the file has no holes.
+ */
+static struct extentmap *
+get_remote_extents(struct sftp_conn *conn, char *handle, u_int handle_len,
+    u_int64_t floor)
+{
+	Buffer msg;
+	struct extentmap *map;
+	u_int64_t off, start, len;
+	u_int type, id, expected_id, count, i;
+	int complete;
+
+	if ((conn->exts & SFTP_EXT_EXTENTS) == 0)
+		return NULL;
+
+	map = xcalloc(1, sizeof(*map));
+	map->floor = floor;
+	buffer_init(&msg);
+	for (off = floor, complete = 0; !complete;) {
+		expected_id = conn->msg_id++;
+		buffer_clear(&msg);
+		buffer_put_char(&msg, SSH2_FXP_EXTENDED);
+		buffer_put_int(&msg, expected_id);
+		buffer_put_cstring(&msg, "extents@openssh.com");
+		buffer_put_string(&msg, handle, handle_len);
+		buffer_put_int64(&msg, off);
+		send_msg(conn, &msg);
+
+		buffer_clear(&msg);
+		get_msg(conn, &msg);
+		type = buffer_get_char(&msg);
+		id = buffer_get_int(&msg);
+		if (id != expected_id)
+			fatal("ID mismatch (%u != %u)", id, expected_id);
+		if (type == SSH2_FXP_STATUS) {
+			debug("Couldn't get extents: %s",
+			    fx2txt(buffer_get_int(&msg)));
+			buffer_free(&msg);
+			extentmap_free(map);
+			return NULL;
+		} else if (type != SSH2_FXP_EXTENDED_REPLY)
+			fatal("Expected SSH2_FXP_EXTENDED_REPLY(%u) packet, "
+			    "got %u", SSH2_FXP_EXTENDED_REPLY, type);
+
+		map->size = buffer_get_int64(&msg);
+		count = buffer_get_int(&msg);
+		for (i = 0; i < count; i++) {
+			start = buffer_get_int64(&msg);
+			len = buffer_get_int64(&msg);
+			if (start < off || len == 0 || start + len < start ||
+			    start + len > map->size)
+				fatal("Server sent bad extent %llu+%llu",
+				    (unsigned long long)start,
+				    (unsigned long long)len);
+			if (!complete && extentmap_add(map, start, len) < 0)
+				complete = 1;
+			off = start + len;
+		}
+		if (buffer_get_char(&msg) || count == 0)
+			complete = 1;
+	}
+	buffer_free(&msg);
+	return extentmap_finish(map);
+}
+
+/*
+ * Advance 'offset' over any hole and clamp '*lenp' so that the next
+ * transfer stops at the end of the data that follows.
+ */
+static u_int64_t
+extentmap_next(struct extentmap *map, u_int64_t offset, u_int *lenp)
+{
+	struct extent *ext;
+
+	if (map == NULL || offset < map->floor)
+		return offset;
+	while (map->cur < map->n &&
+	    map->ext[map->cur].off + map->ext[map->cur].len <= offset)
+		map->cur++;
+	if (map->cur == map->n)
+		return MAX(offset, map->size);
+	ext = &map->ext[map->cur];
+	if (offset < ext->off)
+		offset = ext->off;
+	if (offset + *lenp > ext->off + ext->len)
+		*lenp = ext->off + ext->len - offset;
+	return offset;
+}
+
+/*
+ * Check that the open remote file 'handle' and 'local_fd' have the same
+ * SHA-256 digest. The server hashes its copy while we hash ours.
+ * Returns 0 if they match or the server cannot hash files, -1 otherwise.
+ */
+static int
+verify_transfer(struct sftp_conn *conn, char *handle, u_int handle_len,
+    int local_fd, const char *path)
+{
+	Buffer msg;
+	u_char *rdigest, digest[SFTP_HASH_MAXLEN];
+	u_int type, id, expected_id, dlen, rlen;
+	int local_ok, ret = -1;
+
+	if ((conn->exts & SFTP_EXT_HASH) == 0) {
+		logit("Server does not support hash@openssh.com extension, "
+		    "cannot verify \"%s\"", path);
+		return 0;
+	}
+
+	buffer_init(&msg);
+	expected_id = id = conn->msg_id++;
+	buffer_put_char(&msg, SSH2_FXP_EXTENDED);
+	buffer_put_int(&msg, id);
+	buffer_put_cstring(&msg, "hash@openssh.com");
+	buffer_put_string(&msg, handle, handle_len);
+	buffer_put_cstring(&msg, "sha256");
+	buffer_put_int64(&msg, 0);
+	buffer_put_int64(&msg, 0);
+	send_msg(conn, &msg);
+	debug3("Sent message hash@openssh.com I:%u", id);
+	/* Let the server hash its copy while we hash ours */
+	flush_msgs(conn);
+
+	local_ok = hash_file(local_fd, "sha256", 0, 0, digest, &dlen) == 0;
+	if (!local_ok)
+		error("Couldn't hash local copy of \"%s\": %s", path,
+		    strerror(errno));
+
+	buffer_clear(&msg);
+	get_msg(conn, &msg);
+	type = buffer_get_char(&msg);
+	id = buffer_get_int(&msg);
+	debug3("Received hash reply T:%u I:%u", type, id);
+	if (id != expected_id)
+		fatal("ID mismatch (%u != %u)", id, expected_id);
+	if (type == SSH2_FXP_STATUS) {
+		error("Couldn't hash remote copy of \"%s\": %s", path,
+		    fx2txt(buffer_get_int(&msg)));
+	} else if (type != SSH2_FXP_EXTENDED_REPLY) {
+		fatal("Expected SSH2_FXP_EXTENDED_REPLY(%u) packet, got %u",
+		    SSH2_FXP_EXTENDED_REPLY, type);
+	} else {
+		xfree(buffer_get_string(&msg, NULL));
+		rdigest = buffer_get_string(&msg, &rlen);
+		if (!local_ok)
+			;
+		else if (rlen != dlen || memcmp(rdigest, digest, dlen) != 0)
+			error("Verification of \"%s\" failed: local and "
+			    "remote copies differ", path);
+		else {
+			debug("Verified \"%s\"", path);
+			ret = 0;
+		}
+		xfree(rdigest);
+	}
+	buffer_free(&msg);
+	return ret;
+}
+
 int
 do_download(struct sftp_conn *conn, char *remote_path, char *local_path,
-    Attrib *a, int pflag)
+    Attrib *a, int pflag, int resume, int verify)
 {
 	Attrib junk;
 	Buffer msg;
-	char *handle;
-	int local_fd, status = 0, write_error;
+	char *handle, *dbuf = NULL;
+	int local_fd, status = 0, write_error, verified, direct = 0;
 	int read_error, write_errno;
-	u_int64_t offset, size;
+	u_int64_t offset, next, skip, size, highwater = 0;
 	u_int handle_len, mode, type, id, buflen, num_req, max_req;
 	off_t progress_counter;
+	struct stat st;
+	struct blockmap *map = NULL;
+	struct extentmap *ext = NULL;
 	struct request {
 		u_int id;
 		u_int len;
@@ -1047,8 +2196,8 @@ do_download(struct sftp_conn *conn, char *remote_path, char *local_path,
 		return(-1);
 	}
 
-	local_fd = open(local_path, O_WRONLY | O_CREAT | O_TRUNC,
-	    mode | S_IWRITE);
+	local_fd = open(local_path, (resume || verify ? O_RDWR : O_WRONLY) |
+	    O_CREAT | (resume ? 0 : O_TRUNC), mode | S_IWRITE);
 	if (local_fd == -1) {
 		error("Couldn't open local file \"%s\" for writing: %s",
 		    local_path, strerror(errno));
@@ -1057,6 +2206,22 @@ do_download(struct sftp_conn *conn, char *remote_path, char *local_path,
 		xfree(handle);
 		return(-1);
 	}
+	if (resume && fstat(local_fd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    st.st_size > 0) {
+		map = get_blockmap(conn, handle, handle_len, local_fd,
+		    MIN((u_int64_t)st.st_size, size));
+		if (map != NULL)
+			highwater = map->covered;
+	}
+	/* Holes are only skipped past any data that we already have */
+	ext = get_remote_extents(conn, handle, handle_len,
+	    resume && fstat(local_fd, &st) == 0 ? st.st_size : 0);
+	if (conn->write_mode != WRITE_MODE_NORMAL && size > 0 && ext == NULL &&
+	    preallocate(local_fd, 0, size, 1) == -1)
+		debug("Couldn't preallocate \"%s\": %s", local_path,
+		    strerror(errno));
+	if (conn->write_mode == WRITE_MODE_DIRECT)
+		dbuf = direct_io_alloc(buflen);
 
 	/* Read from remote and write to local */
 	write_error = read_error = write_errno = num_req = offset = 0;
@@ -1082,15 +2247,23 @@ do_download(struct sftp_conn *conn, char *remote_path, char *local_path,
 
 		/* Send some more requests */
 		while (num_req < max_req) {
+			req = xmalloc(sizeof(*req));
+			req->len = buflen;
+			next = blockmap_next(map, offset, &req->len);
+			while ((skip = extentmap_next(ext, next,
+			    &req->len)) != next) {
+				req->len = buflen;
+				next = blockmap_next(map, skip, &req->len);
+			}
+			progress_counter += next - offset;
+			offset = next;
 			debug3("Request range %llu -> %llu (%d/%d)",
 			    (unsigned long long)offset,
-			    (unsigned long long)offset + buflen - 1,
+			    (unsigned long long)offset + req->len - 1,
 			    num_req, max_req);
-			req = xmalloc(sizeof(*req));
 			req->id = conn->msg_id++;
-			req->len = buflen;
 			req->offset = offset;
-			offset += buflen;
+			offset += req->len;
 			num_req++;
 			TAILQ_INSERT_TAIL(&requests, req, tq);
 			send_read_request(conn, req->id, req->offset,
@@ -1122,22 +2295,38 @@ do_download(struct sftp_conn *conn, char *remote_path, char *local_path,
 			num_req--;
 			break;
 		case SSH2_FXP_DATA:
-			data = buffer_get_string(&msg, &len);
+			/* Large replies exceed buffer_get_string's limit */
+			len = buffer_get_int(&msg);
+			if (len > buffer_len(&msg))
+				fatal("Bad data length %u", len);
+			data = buffer_ptr(&msg);
 			debug3("Received data %llu -> %llu",
 			    (unsigned long long)req->offset,
 			    (unsigned long long)req->offset + len - 1);
 			if (len > req->len)
 				fatal("Received more data than asked for "
 				    "%u > %u", len, req->len);
+			/*
+			 * Blocks that fit the O_DIRECT alignment rules go
+			 * through the aligned bounce buffer; anything else
+			 * (typically the tail) is written through the cache.
+			 */
+			if (dbuf != NULL && len <= buflen &&
+			    direct_io_aligned(req->offset, dbuf, len)) {
+				memcpy(dbuf, data, len);
+				set_direct_io(local_fd, &direct, 1);
+			} else
+				set_direct_io(local_fd, &direct, 0);
 			if ((lseek(local_fd, req->offset, SEEK_SET) == -1 ||
-			    atomicio(vwrite, local_fd, data, len) != len) &&
-			    !write_error) {
+			    atomicio(vwrite, local_fd, direct ? dbuf : data,
+			    len) != len) && !write_error) {
 				write_errno = errno;
 				write_error = 1;
 				max_req = 0;
 			}
 			progress_counter += len;
-			xfree(data);
+			if (req->offset + len > highwater)
+				highwater = req->offset + len;
 
 			if (len == req->len) {
 				TAILQ_REMOVE(&requests, req, tq);
@@ -1181,6 +2370,10 @@ do_download(struct sftp_conn *conn, char *remote_path, char *local_path,
 	if (showprogress && size)
 		stop_progress_meter();
 
+	set_direct_io(local_fd, &direct, 0);
+	if (dbuf != NULL)
+		xfree(dbuf);
+
 	/* Sanity check */
 	if (TAILQ_FIRST(&requests) != NULL)
 		fatal("Transfer complete, but requests still in queue");
@@ -1195,7 +2388,22 @@ do_download(struct sftp_conn *conn, char *remote_path, char *local_path,
 		status = -1;
 		do_close(conn, handle, handle_len);
 	} else {
+		/*
+		 * Extend a file that ends in a hole, and drop any stale data
+		 * beyond the end of a resumed file.
+		 */
+		if (ext != NULL && !interrupted && highwater < ext->size)
+			highwater = ext->size;
+		if ((resume || ext != NULL) &&
+		    ftruncate(local_fd, highwater) == -1)
+			error("Couldn't truncate \"%s\": %s", local_path,
+			    strerror(errno));
+
+		verified = !verify || verify_transfer(conn, handle,
+		    handle_len, local_fd, remote_path) == 0;
 		status = do_close(conn, handle, handle_len);
+		if (!verified)
+			status = -1;
 
 		/* Override umask and utimes if asked */
 #ifdef HAVE_FCHMOD
@@ -1218,13 +2426,16 @@ do_download(struct sftp_conn *conn, char *remote_path, char *local_path,
 	close(local_fd);
 	buffer_free(&msg);
 	xfree(handle);
+	blockmap_free(map);
+	extentmap_free(ext);
 
 	return(status);
 }
 
 static int
 download_dir_internal(struct sftp_conn *conn, char *src, char *dst,
-    Attrib *dirattrib, int pflag, int printflag, int depth)
+    Attrib *dirattrib, int pflag, int printflag, int resume, int verify,
+    int depth, struct sftp_tree *tree)
 {
 	int i, ret = 0;
 	SFTP_DIRENT **dir_entries;
@@ -1260,7 +2471,7 @@ download_dir_internal(struct sftp_conn *conn, char *src, char *dst,
 		return -1;
 	}
 
-	if (do_readdir(conn, src, &dir_entries) == -1) {
+	if (tree_readdir(conn, tree, src, &dir_entries) == -1) {
 		error("%s: Failed to get directory contents", src);
 		return -1;
 	}
@@ -1276,12 +2487,12 @@ download_dir_internal(struct sftp_conn *conn, char *src, char *dst,
 			    strcmp(filename, "..") == 0)
 				continue;
 			if (download_dir_internal(conn, new_src, new_dst,
-			    &(dir_entries[i]->a), pflag, printflag,
-			    depth + 1) == -1)
+			    &(dir_entries[i]->a), pflag, printflag, resume,
+			    verify, depth + 1, tree) == -1)
 				ret = -1;
 		} else if (S_ISREG(dir_entries[i]->a.perm) ) {
 			if (do_download(conn, new_src, new_dst,
-			    &(dir_entries[i]->a), pflag) == -1) {
+			    &(dir_entries[i]->a), pflag, resume, verify) == -1) {
 				error("Download of file %s to %s failed",
 				    new_src, new_dst);
 				ret = -1;
@@ -1314,8 +2525,9 @@ download_dir_internal(struct sftp_conn *conn, char *src, char *dst,
 
 int
 download_dir(struct sftp_conn *conn, char *src, char *dst,
-    Attrib *dirattrib, int pflag, int printflag)
+    Attrib *dirattrib, int pflag, int printflag, int resume, int verify)
 {
+	struct sftp_tree *tree;
 	char *src_canon;
 	int ret;
 
@@ -1324,24 +2536,30 @@ download_dir(struct sftp_conn *conn, char *src, char *dst,
 		return -1;
 	}
 
+	/* Fetch the whole tree at once if the server can list it */
+	tree = do_readdir_tree(conn, src_canon, MAX_DIR_DEPTH, NULL);
 	ret = download_dir_internal(conn, src_canon, dst,
-	    dirattrib, pflag, printflag, 0);
+	    dirattrib, pflag, printflag, resume, verify, 0, tree);
+	free_sftp_tree(tree);
 	xfree(src_canon);
 	return ret;
 }
 
 int
 do_upload(struct sftp_conn *conn, char *local_path, char *remote_path,
-    int pflag)
+    int pflag, int resume, int verify)
 {
 	int local_fd;
 	int status = SSH2_FX_OK;
 	u_int handle_len, id, type;
 	off_t offset;
+	u_int64_t next, skip, remote_size = 0, highwater = 0;
 	char *handle, *data;
 	Buffer msg;
 	struct stat sb;
-	Attrib a;
+	Attrib a, *ra;
+	struct blockmap *map = NULL;
+	struct extentmap *ext;
 	u_int32_t startid;
 	u_int32_t ackid;
 	struct outstanding_ack {
@@ -1355,6 +2573,9 @@ do_upload(struct sftp_conn *conn, char *local_path, char *remote_path,
 
 	TAILQ_INIT(&acks);
 
+	/* The upload changes the remote side; resume needs a fresh size */
+	cache_flush(conn);
+
 	if ((local_fd = open(local_path, O_RDONLY, 0)) == -1) {
 		error("Couldn't open local file \"%s\" for reading: %s",
 		    local_path, strerror(errno));
@@ -1386,7 +2607,8 @@ do_upload(struct sftp_conn *conn, char *local_path, char *remote_path,
 	buffer_put_char(&msg, SSH2_FXP_OPEN);
 	buffer_put_int(&msg, id);
 	buffer_put_cstring(&msg, remote_path);
-	buffer_put_int(&msg, SSH2_FXF_WRITE|SSH2_FXF_CREAT|SSH2_FXF_TRUNC);
+	buffer_put_int(&msg, (resume || verify ? SSH2_FXF_READ : 0) |
+	    SSH2_FXF_WRITE|SSH2_FXF_CREAT|(resume ? 0 : SSH2_FXF_TRUNC));
 	encode_attrib(&msg, &a);
 	send_msg(conn, &msg);
 	debug3("Sent message SSH2_FXP_OPEN I:%u P:%s", id, remote_path);
@@ -1401,6 +2623,21 @@ do_upload(struct sftp_conn *conn, char *local_path, char *remote_path,
 		return -1;
 	}
 
+	if (resume && (ra = do_fstat(conn, handle, handle_len, 0)) != NULL &&
+	    (ra->flags & SSH2_FILEXFER_ATTR_SIZE) && ra->size > 0) {
+		remote_size = ra->size;
+		map = get_blockmap(conn, handle, handle_len, local_fd,
+		    MIN(remote_size, (u_int64_t)sb.st_size));
+		if (lseek(local_fd, 0, SEEK_SET) == -1)
+			fatal("Couldn't seek in \"%s\": %s", local_path,
+			    strerror(errno));
+	}
+
+	/* Holes are only skipped past any data that the server has */
+	ext = get_local_extents(local_fd, sb.st_size, remote_size);
+
+	/* Number writes after any requests sent while resuming */
+	id = conn->msg_id - 1;
 	startid = ackid = id + 1;
 	data = xmalloc(conn->transfer_buflen);
 
@@ -1420,10 +2657,26 @@ do_upload(struct sftp_conn *conn, char *local_path, char *remote_path,
 		 */
 		if (interrupted || status != SSH2_FX_OK)
 			len = 0;
-		else do
-			len = read(local_fd, data, conn->transfer_buflen);
-		while ((len == -1) &&
-		    (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK));
+		else {
+			u_int want = conn->transfer_buflen;
+
+			next = blockmap_next(map, offset, &want);
+			while ((skip = extentmap_next(ext, next,
+			    &want)) != next) {
+				want = conn->transfer_buflen;
+				next = blockmap_next(map, skip, &want);
+			}
+			if (next != (u_int64_t)offset) {
+				if (lseek(local_fd, next, SEEK_SET) == -1)
+					fatal("Couldn't seek in \"%s\": %s",
+					    local_path, strerror(errno));
+				offset = next;
+			}
+			do
+				len = read(local_fd, data, want);
+			while ((len == -1) && (errno == EINTR ||
+			    errno == EAGAIN || errno == EWOULDBLOCK));
+		}
 
 		if (len == -1)
 			fatal("Couldn't read from \"%s\": %s", local_path,
@@ -1445,6 +2698,7 @@ do_upload(struct sftp_conn *conn, char *local_path, char *remote_path,
 			send_msg(conn, &msg);
 			debug3("Sent message SSH2_FXP_WRITE I:%u O:%llu S:%u",
 			    id, (unsigned long long)offset, len);
+			highwater = offset + len;
 		} else if (TAILQ_FIRST(&acks) == NULL)
 			break;
 
@@ -1496,6 +2750,26 @@ do_upload(struct sftp_conn *conn, char *local_path, char *remote_path,
 		status = -1;
 	}
 
+	/*
+	 * Extend a file that ends in a hole, and drop any stale data beyond
+	 * the end of a resumed file.
+	 */
+	if (status == SSH2_FX_OK && (remote_size > (u_int64_t)sb.st_size ||
+	    (!interrupted && MAX(remote_size, highwater) <
+	    (u_int64_t)sb.st_size))) {
+		Attrib t;
+
+		attrib_clear(&t);
+		t.flags = SSH2_FILEXFER_ATTR_SIZE;
+		t.size = sb.st_size;
+		if (do_fsetstat(conn, handle, handle_len, &t) != SSH2_FX_OK)
+			status = -1;
+	}
+
+	if (status == SSH2_FX_OK && verify && verify_transfer(conn, handle,
+	    handle_len, local_fd, remote_path) == -1)
+		status = -1;
+
 	if (close(local_fd) == -1) {
 		error("Couldn't close local file \"%s\": %s", local_path,
 		    strerror(errno));
@@ -1509,13 +2783,15 @@ do_upload(struct sftp_conn *conn, char *local_path, char *remote_path,
 	if (do_close(conn, handle, handle_len) != SSH2_FX_OK)
 		status = -1;
 	xfree(handle);
+	blockmap_free(map);
+	extentmap_free(ext);
 
 	return status;
 }
 
 static int
 upload_dir_internal(struct sftp_conn *conn, char *src, char *dst,
-    int pflag, int printflag, int depth)
+    int pflag, int printflag, int resume, int verify, int depth)
 {
 	int ret = 0, status;
 	DIR *dirp;
@@ -1584,10 +2860,11 @@ upload_dir_internal(struct sftp_conn *conn, char *src, char *dst,
 				continue;
 
 			if (upload_dir_internal(conn, new_src, new_dst,
-			    pflag, printflag, depth + 1) == -1)
+			    pflag, printflag, resume, verify, depth + 1) == -1)
 				ret = -1;
 		} else if (S_ISREG(sb.st_mode)) {
-			if (do_upload(conn, new_src, new_dst, pflag) == -1) {
+			if (do_upload(conn, new_src, new_dst, pflag,
+			    resume, verify) == -1) {
 				error("Uploading of file %s to %s failed!",
 				    new_src, new_dst);
 				ret = -1;
@@ -1606,7 +2883,7 @@ upload_dir_internal(struct sftp_conn *conn, char *src, char *dst,
 
 int
 upload_dir(struct sftp_conn *conn, char *src, char *dst, int printflag,
-    int pflag)
+    int pflag, int resume, int verify)
 {
 	char *dst_canon;
 	int ret;
@@ -1616,7 +2893,8 @@ upload_dir(struct sftp_conn *conn, char *src, char *dst, int printflag,
 		return -1;
 	}
 
-	ret = upload_dir_internal(conn, src, dst_canon, pflag, printflag, 0);
+	ret = upload_dir_internal(conn, src, dst_canon, pflag, printflag,
+	    resume, verify, 0);
 	xfree(dst_canon);
 	return ret;
 }
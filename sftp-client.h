@@ -49,12 +49,16 @@ struct sftp_statvfs {
 
 /*
  * Initialise a SSH filexfer connection. Returns NULL on error or
- * a pointer to a initialized sftp_conn struct on success.
+ * a pointer to a initialized sftp_conn struct on success. A transfer
+ * buffer length of 0 selects one from the server's advertised limits.
  */
 struct sftp_conn *do_init(int, int, u_int, u_int, u_int64_t);
 
 u_int sftp_proto_version(struct sftp_conn *);
 
+/* Select how downloaded data is written locally (WRITE_MODE_*) */
+void sftp_set_write_mode(struct sftp_conn *, int);
+
 /* Close file referred to by 'handle' */
 int do_close(struct sftp_conn *, char *, u_int);
 
@@ -64,6 +68,26 @@ int do_readdir(struct sftp_conn *, char *, SFTP_DIRENT ***);
 /* Frees a NULL-terminated array of SFTP_DIRENTs (eg. from do_readdir) */
 void free_sftp_dirents(SFTP_DIRENT **);
 
+struct sftp_tree;
+
+/*
+ * Fetch a listing of the tree below 'path' in one request, 'depth' levels
+ * deep (0 for all), optionally only listing files matching 'pattern'.
+ * Returns NULL if the server does not support this.
+ */
+struct sftp_tree *do_readdir_tree(struct sftp_conn *, char *, u_int,
+    const char *);
+
+/* Read 'path' like do_readdir, from the tree listing if it covers it */
+int tree_readdir(struct sftp_conn *, struct sftp_tree *, char *,
+    SFTP_DIRENT ***);
+
+/* Look up the attributes of 'path' in a tree listing */
+Attrib *tree_lstat(struct sftp_tree *, char *);
+
+/* Frees a tree listing */
+void free_sftp_tree(struct sftp_tree *);
+
 /* Delete file 'path' */
 int do_rm(struct sftp_conn *, char *);
 
@@ -79,6 +103,9 @@ Attrib *do_stat(struct sftp_conn *, char *, int);
 /* Get file attributes of 'path' (does not follow symlinks) */
 Attrib *do_lstat(struct sftp_conn *, char *, int);
 
+/* Get file attributes of open file 'handle' */
+Attrib *do_fstat(struct sftp_conn *, char *, u_int, int);
+
 /* Set file attributes of 'path' */
 int do_setstat(struct sftp_conn *, char *, Attrib *);
 
@@ -104,27 +131,33 @@ int do_symlink(struct sftp_conn *, char *, char *);
 
 /*
  * Download 'remote_path' to 'local_path'. Preserve permissions and times
- * if 'pflag' is set
+ * if 'pflag' is set. If 'resume' is set, only transfer the blocks that
+ * differ from an existing 'local_path'. If 'verify' is set, compare
+ * checksums of both copies afterwards.
  */
-int do_download(struct sftp_conn *, char *, char *, Attrib *, int);
+int do_download(struct sftp_conn *, char *, char *, Attrib *, int, int,
+    int);
 
 /*
  * Recursively download 'remote_directory' to 'local_directory'. Preserve 
  * times if 'pflag' is set
  */
-int download_dir(struct sftp_conn *, char *, char *, Attrib *, int, int);
+int download_dir(struct sftp_conn *, char *, char *, Attrib *, int, int,
+    int, int);
 
 /*
  * Upload 'local_path' to 'remote_path'. Preserve permissions and times
- * if 'pflag' is set
+ * if 'pflag' is set. If 'resume' is set, only transfer the blocks that
+ * differ from an existing 'remote_path'. If 'verify' is set, compare
+ * checksums of both copies afterwards.
  */
-int do_upload(struct sftp_conn *, char *, char *, int);
+int do_upload(struct sftp_conn *, char *, char *, int, int, int);
 
 /*
  * Recursively upload 'local_directory' to 'remote_directory'. Preserve 
  * times if 'pflag' is set
  */
-int upload_dir(struct sftp_conn *, char *, char *, int, int);
+int upload_dir(struct sftp_conn *, char *, char *, int, int, int, int);
 
 /* Concatenate paths, taking care of slashes. Caller must free result. */
 char *path_append(char *, char *);
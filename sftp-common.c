@@ -30,16 +30,20 @@
 #include <sys/stat.h>
 #include <sys/param.h>
 
+#include <errno.h>
 #include <grp.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
+#include <unistd.h>
 #ifdef HAVE_UTIL_H
 #include <util.h>
 #endif
 
+#include <openssl/evp.h>
+
 #include "xmalloc.h"
 #include "buffer.h"
 #include "log.h"
@@ -230,3 +234,107 @@ ls_file(const char *name, const struct stat *st, int remote, int si_units)
 	}
 	return xstrdup(buf);
 }
+
+/*
+ * Feed up to 'len' bytes of 'fd' starting at 'offset' to 'md'. Returns
+ * the number of bytes read, which is less than 'len' only at end of
+ * file, or -1 on error.
+ */
+static int64_t
+hash_fd(EVP_MD_CTX *md, int fd, u_int64_t offset, u_int64_t len)
+{
+	char buf[32*1024];
+	u_int64_t done = 0;
+	ssize_t r;
+
+	if (lseek(fd, offset, SEEK_SET) == -1)
+		return -1;
+	while (done < len) {
+		r = read(fd, buf, MIN(sizeof(buf), len - done));
+		if (r == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		if (r == 0)
+			break;
+		EVP_DigestUpdate(md, buf, r);
+		done += r;
+	}
+	return done;
+}
+
+/*
+ * Store the SHA-256 digest of up to 'len' bytes of 'fd' starting at
+ * 'offset' in 'digest', which must hold SFTP_HASH_LEN bytes. Returns the
+ * number of bytes hashed, which is less than 'len' only at end of file,
+ * or -1 on error.
+ */
+ssize_t
+hash_file_range(int fd, u_int64_t offset, size_t len, u_char *digest)
+{
+	EVP_MD_CTX *md;
+	int64_t r;
+
+	if ((md = EVP_MD_CTX_create()) == NULL)
+		return -1;
+	EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+	if ((r = hash_fd(md, fd, offset, len)) != -1)
+		EVP_DigestFinal_ex(md, digest, NULL);
+	EVP_MD_CTX_destroy(md);
+	return r;
+}
+
+/* Digests available to "hash@openssh.com" */
+static const struct {
+	const char *name;
+	const EVP_MD *(*md)(void);
+} hash_algs[] = {
+	{ "sha256",	EVP_sha256 },
+	{ "md5",	EVP_md5 },	/* Cheaper, for integrity checks only */
+	{ NULL,		NULL }
+};
+
+int
+hash_alg_valid(const char *alg)
+{
+	int i;
+
+	for (i = 0; hash_algs[i].name != NULL; i++)
+		if (strcmp(alg, hash_algs[i].name) == 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * Store the 'alg' digest of 'len' bytes of 'fd' starting at 'offset' in
+ * 'digest', which must hold SFTP_HASH_MAXLEN bytes, and its length in
+ * '*dlenp'. A length of zero hashes to end of file. Returns 0 on success
+ * or -1 on error with errno set.
+ */
+int
+hash_file(int fd, const char *alg, u_int64_t offset, u_int64_t len,
+    u_char *digest, u_int *dlenp)
+{
+	EVP_MD_CTX *md;
+	int i, ret = -1;
+
+	for (i = 0; hash_algs[i].name != NULL; i++)
+		if (strcmp(alg, hash_algs[i].name) == 0)
+			break;
+	if (hash_algs[i].name == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((md = EVP_MD_CTX_create()) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	EVP_DigestInit_ex(md, hash_algs[i].md(), NULL);
+	if (hash_fd(md, fd, offset, len == 0 ? ~(u_int64_t)0 : len) != -1) {
+		EVP_DigestFinal_ex(md, digest, dlenp);
+		ret = 0;
+	}
+	EVP_MD_CTX_destroy(md);
+	return ret;
+}
@@ -28,6 +28,24 @@
 /* Maximum packet that we are willing to send/accept */
 #define SFTP_MAX_MSG_LENGTH	(256 * 1024)
 
+/*
+ * Largest message exchanged once the client has learned the server's
+ * limits through "limits@openssh.com". Must fit in one Buffer chunk.
+ */
+#define SFTP_MAX_LARGE_MSG_LENGTH	(1024 * 1024)
+
+/* Length of the SHA-256 digests exchanged by "blockhash@openssh.com" */
+#define SFTP_HASH_LEN		32
+
+/* Limits on "blockhash@openssh.com" requests */
+#define SFTP_BLOCKHASH_MIN	4096
+#define SFTP_BLOCKHASH_MAX	(16 * 1024 * 1024)
+#define SFTP_BLOCKHASH_COUNT	1024	/* Max digests per reply */
+#define SFTP_BLOCKHASH_BYTES	(64 * 1024 * 1024) /* Max hashed per reply */
+
+/* Largest digest returned by "hash@openssh.com" */
+#define SFTP_HASH_MAXLEN	64
+
 typedef struct Attrib Attrib;
 
 /* File attributes */
@@ -49,3 +67,6 @@ void	 encode_attrib(Buffer *, const Attrib *);
 char	*ls_file(const char *, const struct stat *, int, int);
 
 const char *fx2txt(int);
+ssize_t	 hash_file_range(int, u_int64_t, size_t, u_char *);
+int	 hash_alg_valid(const char *);
+int	 hash_file(int, const char *, u_int64_t, u_int64_t, u_char *, u_int *);
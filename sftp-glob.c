@@ -41,6 +41,7 @@ struct SFTP_OPENDIR {
 
 static struct {
 	struct sftp_conn *conn;
+	struct sftp_tree *tree;
 } cur;
 
 static void *
@@ -50,7 +51,7 @@ fudge_opendir(const char *path)
 
 	r = xmalloc(sizeof(*r));
 
-	if (do_readdir(cur.conn, (char *)path, &r->dir)) {
+	if (tree_readdir(cur.conn, cur.tree, (char *)path, &r->dir)) {
 		xfree(r);
 		return(NULL);
 	}
@@ -111,7 +112,8 @@ fudge_lstat(const char *path, struct stat *st)
 {
 	Attrib *a;
 
-	if (!(a = do_lstat(cur.conn, (char *)path, 0)))
+	if (!(a = tree_lstat(cur.tree, (char *)path)) &&
+	    !(a = do_lstat(cur.conn, (char *)path, 0)))
 		return(-1);
 
 	attrib_to_stat(a, st);
@@ -124,7 +126,9 @@ fudge_stat(const char *path, struct stat *st)
 {
 	Attrib *a;
 
-	if (!(a = do_stat(cur.conn, (char *)path, 0)))
+	/* Listed attributes will do unless they describe a symlink */
+	if ((!(a = tree_lstat(cur.tree, (char *)path)) ||
+	    S_ISLNK(a->perm)) && !(a = do_stat(cur.conn, (char *)path, 0)))
 		return(-1);
 
 	attrib_to_stat(a, st);
@@ -132,10 +136,64 @@ fudge_stat(const char *path, struct stat *st)
 	return(0);
 }
 
+/*
+ * If the server can list a tree in one request, fetch everything that
+ * expanding 'pattern' will need to look at: the tree below the last
+ * directory named without wildcards, as deep as the pattern goes.
+ */
+static struct sftp_tree *
+prefetch_tree(struct sftp_conn *conn, const char *pattern)
+{
+	struct sftp_tree *tree;
+	const char *cp, *filter = NULL;
+	char *dir;
+	size_t len;
+	u_int depth;
+
+	/* Find the first path component with wildcards */
+	for (cp = pattern; *cp != '\0'; ) {
+		len = strcspn(cp, "/");
+		if (strcspn(cp, "*?[\\") < len)
+			break;
+		for (cp += len; *cp == '/'; cp++)
+			;
+	}
+	if (*cp == '\0')
+		return NULL;
+
+	for (len = cp - pattern; len > 1 && pattern[len - 1] == '/'; len--)
+		;
+	if (len == 0)
+		dir = xstrdup(".");
+	else {
+		dir = xmalloc(len + 1);
+		strlcpy(dir, pattern, len + 1);
+	}
+	for (depth = 0; *cp != '\0'; depth++) {
+		cp += strcspn(cp, "/");
+		while (*cp == '/')
+			cp++;
+	}
+	/* Let the server filter a last level it understands the pattern of */
+	if (depth == 1 && strcspn(pattern + len, "[\\") ==
+	    strlen(pattern + len)) {
+		filter = pattern + len;
+		while (*filter == '/')
+			filter++;
+		if (strchr(filter, '/') != NULL)
+			filter = NULL;
+	}
+	tree = do_readdir_tree(conn, dir, depth, filter);
+	xfree(dir);
+	return tree;
+}
+
 int
 remote_glob(struct sftp_conn *conn, const char *pattern, int flags,
     int (*errfunc)(const char *, int), glob_t *pglob)
 {
+	int r;
+
 	pglob->gl_opendir = fudge_opendir;
 	pglob->gl_readdir = (struct dirent *(*)(void *))fudge_readdir;
 	pglob->gl_closedir = (void (*)(void *))fudge_closedir;
@@ -144,6 +202,10 @@ remote_glob(struct sftp_conn *conn, const char *pattern, int flags,
 
 	memset(&cur, 0, sizeof(cur));
 	cur.conn = conn;
+	cur.tree = prefetch_tree(conn, pattern);
 
-	return(glob(pattern, flags | GLOB_ALTDIRFUNC, errfunc, pglob));
+	r = glob(pattern, flags | GLOB_ALTDIRFUNC, errfunc, pglob);
+	free_sftp_tree(cur.tree);
+	cur.tree = NULL;
+	return(r);
 }
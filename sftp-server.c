@@ -20,6 +20,7 @@
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #ifdef HAVE_SYS_TIME_H
 # include <sys/time.h>
 #endif
@@ -29,6 +30,7 @@
 #ifdef HAVE_SYS_STATVFS_H
 #include <sys/statvfs.h>
 #endif
+#include <sys/resource.h>
 
 #include <dirent.h>
 #include <errno.h>
@@ -46,6 +48,7 @@
 #include "buffer.h"
 #include "log.h"
 #include "misc.h"
+#include "match.h"
 #include "uidswap.h"
 
 #include "sftp.h"
@@ -56,6 +59,27 @@
 #define get_int()			buffer_get_int(&iqueue);
 #define get_string(lenp)		buffer_get_string(&iqueue, lenp);
 
+/* Maximum number of adjacent writes handled in one system call */
+#define WRITE_BATCH_MAX		32
+
+/* Most space preallocated ahead of the highest write to a file */
+#define PREALLOC_CHUNK		(64 * 1024 * 1024)
+
+/* Most data extents sent in one "extents@openssh.com" reply */
+#define EXTENTS_MAX		1024
+
+/* Sequential reads of a handle before readahead is requested */
+#define READAHEAD_SEQ		4
+
+/* Distance to keep hinted for readahead ahead of sequential reads */
+#define READAHEAD_LEN		(1024 * 1024)
+
+/* Size of reads from the client */
+#define IQUEUE_READ		(256 * 1024)
+
+/* Space in a message for everything but read or write data */
+#define MSG_OVERHEAD		1024
+
 /* Our verbosity */
 LogLevel log_level = SYSLOG_LEVEL_ERROR;
 
@@ -73,6 +97,12 @@ int version;
 /* Disable writes */
 int readonly;
 
+/* Client has asked for our limits and accepts large replies */
+int large_msgs = 0;
+
+/* How uploaded data is written, one of WRITE_MODE_* */
+int write_mode = WRITE_MODE_NORMAL;
+
 /* portable attributes, etc. */
 
 typedef struct Stat Stat;
@@ -174,13 +204,37 @@ get_attrib(void)
 
 /* handle handles */
 
+/* A directory being listed by "opendir-tree@openssh.com" */
+typedef struct DirLevel DirLevel;
+struct DirLevel {
+	char *path;		/* Relative to the top of the tree */
+	char **names;
+	u_int nnames, next;
+};
+
+typedef struct DirTree DirTree;
+struct DirTree {
+	u_int max_depth;	/* Levels to descend, 0 for unlimited */
+	char *pattern;		/* Filter for non-directories, or NULL */
+	DirLevel *levels;	/* Directories being read, outermost first */
+	u_int nlevels;
+};
+
 typedef struct Handle Handle;
 struct Handle {
 	int use;
 	DIR *dirp;
+	DirTree *tree;
 	int fd;
 	char *name;
 	u_int64_t bytes_read, bytes_write;
+	u_int64_t read_next;	/* Offset following the last read */
+	u_int64_t advised;	/* End of range hinted for readahead */
+	u_int64_t dropped;	/* End of range dropped from the cache */
+	u_int seq_reads;	/* Consecutive sequential reads */
+	int streaming;		/* Only read sequentially from the start */
+	int direct;		/* O_DIRECT currently set on fd */
+	u_int64_t allocated;	/* End of space preallocated for writes */
 	int next_unused;
 };
 
@@ -219,9 +273,15 @@ handle_new(int use, const char *name, int fd, DIR *dirp)
 
 	handles[i].use = use;
 	handles[i].dirp = dirp;
+	handles[i].tree = NULL;
 	handles[i].fd = fd;
 	handles[i].name = xstrdup(name);
 	handles[i].bytes_read = handles[i].bytes_write = 0;
+	handles[i].read_next = handles[i].advised = handles[i].dropped = 0;
+	handles[i].seq_reads = 0;
+	handles[i].streaming = 1;
+	handles[i].direct = 0;
+	handles[i].allocated = 0;
 
 	return i;
 }
@@ -292,8 +352,53 @@ handle_update_read(int handle, ssize_t bytes)
 static void
 handle_update_write(int handle, ssize_t bytes)
 {
-	if (handle_is_ok(handle, HANDLE_FILE) && bytes > 0)
+	if (handle_is_ok(handle, HANDLE_FILE) && bytes > 0) {
 		handles[handle].bytes_write += bytes;
+		handles[handle].streaming = 0;
+	}
+}
+
+/*
+ * Note a read of 'len' bytes at 'off'. Once a handle is being read
+ * sequentially, ask the kernel to read ahead of the client, and drop
+ * the part of a file streamed from the start that has already been
+ * sent, so that bulk downloads do not evict the rest of the page cache.
+ */
+static void
+handle_advise_read(int handle, u_int64_t off, u_int len)
+{
+#ifdef HAVE_POSIX_FADVISE
+	Handle *h;
+	u_int64_t start;
+
+	if (!handle_is_ok(handle, HANDLE_FILE))
+		return;
+	h = &handles[handle];
+	if (off == h->read_next)
+		h->seq_reads++;
+	else {
+		h->seq_reads = 0;
+		h->streaming = 0;
+	}
+	h->read_next = off + len;
+	if (h->seq_reads < READAHEAD_SEQ)
+		return;
+
+	if (h->advised < off + READAHEAD_LEN) {
+		start = MAX(h->advised, off);
+		debug3("handle %d: readahead %llu len %llu", handle,
+		    (unsigned long long)start,
+		    (unsigned long long)(off + 2 * READAHEAD_LEN - start));
+		posix_fadvise(h->fd, start, off + 2 * READAHEAD_LEN - start,
+		    POSIX_FADV_WILLNEED);
+		h->advised = off + 2 * READAHEAD_LEN;
+	}
+	if (h->streaming && off >= h->dropped + READAHEAD_LEN) {
+		posix_fadvise(h->fd, h->dropped, off - h->dropped,
+		    POSIX_FADV_DONTNEED);
+		h->dropped = off;
+	}
+#endif
 }
 
 static u_int64_t
@@ -312,17 +417,76 @@ handle_bytes_write(int handle)
 	return 0;
 }
 
+/*
+ * Read the names in 'dirp', the directory 'path' of a tree being listed,
+ * into a new innermost level. The whole directory is read at once so
+ * that deep trees do not hold a descriptor open per level.
+ */
+static void
+dirtree_push(DirTree *t, DIR *dirp, const char *path)
+{
+	struct dirent *dp;
+	DirLevel *l;
+
+	t->levels = xrealloc(t->levels, t->nlevels + 1, sizeof(*t->levels));
+	l = &t->levels[t->nlevels++];
+	l->path = xstrdup(path);
+	l->names = NULL;
+	l->nnames = l->next = 0;
+	while ((dp = readdir(dirp)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0 ||
+		    strcmp(dp->d_name, "..") == 0)
+			continue;
+		l->names = xrealloc(l->names, l->nnames + 1, sizeof(char *));
+		l->names[l->nnames++] = xstrdup(dp->d_name);
+	}
+}
+
+static void
+dirtree_pop(DirTree *t)
+{
+	DirLevel *l = &t->levels[--t->nlevels];
+
+	while (l->nnames > 0)
+		xfree(l->names[--l->nnames]);
+	if (l->names != NULL)
+		xfree(l->names);
+	xfree(l->path);
+}
+
+static void
+dirtree_free(DirTree *t)
+{
+	if (t == NULL)
+		return;
+	while (t->nlevels > 0)
+		dirtree_pop(t);
+	if (t->levels != NULL)
+		xfree(t->levels);
+	if (t->pattern != NULL)
+		xfree(t->pattern);
+	xfree(t);
+}
+
 static int
 handle_close(int handle)
 {
+	struct stat st;
 	int ret = -1;
 
 	if (handle_is_ok(handle, HANDLE_FILE)) {
+		/* Release space reserved beyond the end of the file */
+		if (handles[handle].allocated != 0 &&
+		    handles[handle].allocated != (u_int64_t)-1 &&
+		    fstat(handles[handle].fd, &st) == 0 &&
+		    (u_int64_t)st.st_size < handles[handle].allocated)
+			(void)ftruncate(handles[handle].fd, st.st_size);
 		ret = close(handles[handle].fd);
 		xfree(handles[handle].name);
 		handle_unused(handle);
 	} else if (handle_is_ok(handle, HANDLE_DIR)) {
 		ret = closedir(handles[handle].dirp);
+		dirtree_free(handles[handle].tree);
 		xfree(handles[handle].name);
 		handle_unused(handle);
 	} else {
@@ -434,13 +598,6 @@ send_data_or_handle(char type, u_int32_t id, const char *data, int dlen)
 	buffer_free(&msg);
 }
 
-static void
-send_data(u_int32_t id, const char *data, int dlen)
-{
-	debug("request %u: sent data len %d", id, dlen);
-	send_data_or_handle(SSH2_FXP_DATA, id, data, dlen);
-}
-
 static void
 send_handle(u_int32_t id, int handle)
 {
@@ -538,6 +695,21 @@ process_init(void)
 	/* hardlink extension */
 	buffer_put_cstring(&msg, "hardlink@openssh.com");
 	buffer_put_cstring(&msg, "1"); /* version */
+	/* block hash extension */
+	buffer_put_cstring(&msg, "blockhash@openssh.com");
+	buffer_put_cstring(&msg, "1"); /* version */
+	/* file hash extension */
+	buffer_put_cstring(&msg, "hash@openssh.com");
+	buffer_put_cstring(&msg, "1"); /* version */
+	/* recursive listing extension */
+	buffer_put_cstring(&msg, "opendir-tree@openssh.com");
+	buffer_put_cstring(&msg, "1"); /* version */
+	/* sparse file extent extension */
+	buffer_put_cstring(&msg, "extents@openssh.com");
+	buffer_put_cstring(&msg, "1"); /* version */
+	/* server limits extension */
+	buffer_put_cstring(&msg, "limits@openssh.com");
+	buffer_put_cstring(&msg, "1"); /* version */
 	send_msg(&msg);
 	buffer_free(&msg);
 }
@@ -596,11 +768,37 @@ process_close(void)
 	send_status(id, status);
 }
 
+/*
+ * Read up to 'len' bytes from 'fd' straight into a SSH2_FXP_DATA reply
+ * at the end of the output queue. Returns the number of bytes read, or
+ * -1 with errno set. Nothing is queued unless data was read.
+ */
+static int
+send_data_read(u_int32_t id, int fd, u_int len)
+{
+	const u_int hlen = 4 + 1 + 4 + 4;
+	u_char *cp;
+	ssize_t r;
+
+	cp = buffer_append_space(&oqueue, hlen + len);
+	r = read(fd, cp + hlen, len);
+	if (r <= 0) {
+		buffer_consume_end(&oqueue, hlen + len);
+		return r;
+	}
+	buffer_consume_end(&oqueue, len - r);
+	put_u32(cp, 1 + 4 + 4 + r);
+	cp[4] = SSH2_FXP_DATA;
+	put_u32(cp + 5, id);
+	put_u32(cp + 9, r);
+	debug("request %u: sent data len %d", id, (int)r);
+	return r;
+}
+
 static void
 process_read(void)
 {
-	char buf[64*1024];
-	u_int32_t id, len;
+	u_int32_t id, len, max;
 	int handle, fd, ret, status = SSH2_FX_FAILURE;
 	u_int64_t off;
 
@@ -611,23 +809,26 @@ process_read(void)
 
 	debug("request %u: read \"%s\" (handle %d) off %llu len %d",
 	    id, handle_to_name(handle), handle, (unsigned long long)off, len);
-	if (len > sizeof buf) {
-		len = sizeof buf;
+	/* Clients that have not seen our limits only take small replies */
+	max = (large_msgs ? SFTP_MAX_LARGE_MSG_LENGTH : SFTP_MAX_MSG_LENGTH) -
+	    MSG_OVERHEAD;
+	if (len > max) {
+		len = max;
 		debug2("read change len %d", len);
 	}
 	fd = handle_to_fd(handle);
 	if (fd >= 0) {
+		handle_advise_read(handle, off, len);
 		if (lseek(fd, off, SEEK_SET) < 0) {
 			error("process_read: seek failed");
 			status = errno_to_portable(errno);
 		} else {
-			ret = read(fd, buf, len);
+			ret = send_data_read(id, fd, len);
 			if (ret < 0) {
 				status = errno_to_portable(errno);
 			} else if (ret == 0) {
 				status = SSH2_FX_EOF;
 			} else {
-				send_data(id, buf, ret);
 				status = SSH2_FX_OK;
 				handle_update_read(handle, ret);
 			}
@@ -637,49 +838,199 @@ process_read(void)
 		send_status(id, status);
 }
 
-static void
-process_write(void)
+/*
+ * Write the 'niov' buffers in 'iov' to 'fd' at 'off', retrying short
+ * writes. 'iov' is modified. Returns the number of bytes written, which
+ * is short only on error.
+ */
+static size_t
+write_iov(int fd, u_int64_t off, struct iovec *iov, int niov)
 {
-	u_int32_t id;
-	u_int64_t off;
-	u_int len;
-	int handle, fd, ret, status;
-	char *data;
+	size_t done = 0;
+	ssize_t ret;
 
-	id = get_int();
+	while (niov > 0) {
+#ifdef HAVE_PWRITEV
+		ret = pwritev(fd, iov, niov, off + done);
+#else
+		if (lseek(fd, off + done, SEEK_SET) < 0) {
+			error("process_write: seek failed");
+			return done;
+		}
+		ret = writev(fd, iov, niov);
+#endif
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (ret <= 0)
+			return done;
+		done += ret;
+		for (; niov > 0 && (size_t)ret >= iov->iov_len; iov++, niov--)
+			ret -= iov->iov_len;
+		if (niov > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return done;
+}
+
+/*
+ * Write 'n' buffers at 'off' according to the write mode. Uploads do not
+ * say how large the file will be, so space is reserved in growing chunks
+ * ahead of the writes and any excess is released at close. Writes that
+ * meet the O_DIRECT alignment rules are gathered into an aligned bounce
+ * buffer and bypass the page cache.
+ */
+static size_t
+handle_write(int handle, u_int64_t off, struct iovec *iov, int n)
+{
+	static u_char *dbuf;
+	static size_t dbuf_len;
+	Handle *h = &handles[handle];
+	struct iovec one;
+	u_int64_t start, end;
+	size_t total = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		total += iov[i].iov_len;
+	if (write_mode == WRITE_MODE_NORMAL || total == 0)
+		return write_iov(h->fd, off, iov, n);
+
+	if (off + total > h->allocated) {
+		/*
+		 * Reserve as much again as has been written so far. Skipped
+		 * ranges are left unallocated, so sparse uploads stay sparse.
+		 */
+		end = off + total + MIN(off + total, PREALLOC_CHUNK);
+		start = MAX(h->allocated, off);
+		if (preallocate(h->fd, start, end - start, 1) == 0) {
+			h->allocated = end;
+			debug2("preallocated \"%s\" to %llu", h->name,
+			    (unsigned long long)h->allocated);
+		} else {
+			debug("preallocate \"%s\": %s", h->name,
+			    strerror(errno));
+			/* Don't try again for this file */
+			h->allocated = (u_int64_t)-1;
+		}
+	}
+
+	if (write_mode == WRITE_MODE_DIRECT) {
+		if (total > dbuf_len && total % DIRECT_IO_ALIGN == 0) {
+			if (dbuf != NULL)
+				xfree(dbuf);
+			dbuf = direct_io_alloc(total);
+			dbuf_len = total;
+		}
+		if (total <= dbuf_len &&
+		    direct_io_aligned(off, dbuf, total)) {
+			set_direct_io(h->fd, &h->direct, 1);
+			if (h->direct) {
+				for (i = 0, one.iov_len = 0; i < n; i++) {
+					memcpy(dbuf + one.iov_len,
+					    iov[i].iov_base, iov[i].iov_len);
+					one.iov_len += iov[i].iov_len;
+				}
+				one.iov_base = dbuf;
+				return write_iov(h->fd, off, &one, 1);
+			}
+		} else
+			set_direct_io(h->fd, &h->direct, 0);
+	}
+	return write_iov(h->fd, off, iov, n);
+}
+
+/*
+ * Process a write request. Complete write requests queued behind it that
+ * continue the same handle at the following offset are written along
+ * with it in one system call, straight from the input queue. 'trailing'
+ * is the number of bytes queued after the current request. Returns the
+ * number of those bytes that were consumed.
+ */
+static u_int
+process_write(u_int trailing)
+{
+	struct iovec iov[WRITE_BATCH_MAX];
+	u_int32_t ids[WRITE_BATCH_MAX], lens[WRITE_BATCH_MAX];
+	u_int64_t off, next;
+	u_int i, n, hlen, mlen, len, left, extra = 0;
+	int handle, fd, status, write_errno = 0;
+	size_t done, end;
+	u_char *cp;
+
+	ids[0] = get_int();
 	handle = get_handle();
 	off = get_int64();
-	data = get_string(&len);
+	len = get_int();
+	left = buffer_len(&iqueue) - trailing;
+	if (len > left)
+		fatal("process_write: bad data length %u", len);
 
 	debug("request %u: write \"%s\" (handle %d) off %llu len %d",
-	    id, handle_to_name(handle), handle, (unsigned long long)off, len);
+	    ids[0], handle_to_name(handle), handle, (unsigned long long)off,
+	    len);
 	fd = handle_to_fd(handle);
-	
-	if (fd < 0)
-		status = SSH2_FX_FAILURE;
-	else if (readonly)
-		status = SSH2_FX_PERMISSION_DENIED;
-	else {
-		if (lseek(fd, off, SEEK_SET) < 0) {
-			status = errno_to_portable(errno);
-			error("process_write: seek failed");
-		} else {
-/* XXX ATOMICIO ? */
-			ret = write(fd, data, len);
-			if (ret < 0) {
-				error("process_write: write failed");
-				status = errno_to_portable(errno);
-			} else if ((size_t)ret == len) {
-				status = SSH2_FX_OK;
-				handle_update_write(handle, ret);
-			} else {
-				debug2("nothing at all written");
-				status = SSH2_FX_FAILURE;
-			}
-		}
+	iov[0].iov_base = buffer_ptr(&iqueue);
+	iov[0].iov_len = lens[0] = len;
+	n = 1;
+
+	/* Gather following writes: type, id, handle, offset, data */
+	cp = (u_char *)buffer_ptr(&iqueue) + left;
+	for (next = off + len; fd >= 0 && n < WRITE_BATCH_MAX; n++) {
+		if (trailing - extra < 4)
+			break;
+		mlen = get_u32(cp);
+		if (mlen > SFTP_MAX_LARGE_MSG_LENGTH ||
+		    mlen > trailing - extra - 4 ||
+		    mlen < 21 || cp[4] != SSH2_FXP_WRITE)
+			break;
+		hlen = get_u32(cp + 9);
+		if (hlen >= 256 || mlen < 21 + hlen ||
+		    handle_from_string(cp + 13, hlen) != handle ||
+		    get_u64(cp + 13 + hlen) != next)
+			break;
+		len = get_u32(cp + 21 + hlen);
+		if (len > mlen - 21 - hlen)
+			break;
+		ids[n] = get_u32(cp + 5);
+		iov[n].iov_base = cp + 25 + hlen;
+		iov[n].iov_len = lens[n] = len;
+		debug("request %u: write \"%s\" (handle %d) off %llu len %d",
+		    ids[n], handle_to_name(handle), handle,
+		    (unsigned long long)next, len);
+		next += len;
+		extra += 4 + mlen;
+		cp += 4 + mlen;
 	}
-	send_status(id, status);
-	xfree(data);
+	if (n > 1)
+		debug2("write coalesced %u requests", n);
+
+	done = 0;
+	if (fd >= 0 && !readonly) {
+		errno = 0;
+		done = handle_write(handle, off, iov, n);
+		write_errno = errno;
+		if (done < next - off)
+			error("process_write: write failed");
+	}
+	for (i = 0, end = 0; i < n; i++) {
+		end += lens[i];
+		if (fd < 0)
+			status = SSH2_FX_FAILURE;
+		else if (readonly)
+			status = SSH2_FX_PERMISSION_DENIED;
+		else if (done >= end) {
+			status = SSH2_FX_OK;
+			handle_update_write(handle, lens[i]);
+		} else if (write_errno != 0)
+			status = errno_to_portable(write_errno);
+		else
+			status = SSH2_FX_FAILURE;
+		send_status(ids[i], status);
+	}
+	buffer_consume(&iqueue, left + extra);
+	return extra;
 }
 
 static void
@@ -907,6 +1258,74 @@ process_opendir(void)
 	xfree(path);
 }
 
+/*
+ * Send the next batch of entries of a tree listing, named relative to
+ * its top 'path'. Directories are sent before their contents.
+ */
+static void
+readdir_tree(u_int32_t id, DirTree *t, const char *path)
+{
+	struct stat st;
+	char pathname[MAXPATHLEN], rel[MAXPATHLEN], *name;
+	DirLevel *l;
+	DIR *dirp;
+	Stat *stats;
+	int nstats = 10, count = 0, enter, i;
+	size_t len = 0;
+
+	stats = xcalloc(nstats, sizeof(Stat));
+	/* Stop well short of the maximum packet size */
+	while (t->nlevels > 0 && count < 100 && len < SFTP_MAX_MSG_LENGTH / 4) {
+		l = &t->levels[t->nlevels - 1];
+		if (l->next >= l->nnames) {
+			dirtree_pop(t);
+			continue;
+		}
+		name = l->names[l->next++];
+		if (snprintf(rel, sizeof rel, "%s%s%s", l->path,
+		    *l->path == '\0' ? "" : "/", name) >= (int)sizeof(rel) ||
+		    snprintf(pathname, sizeof pathname, "%s%s%s", path,
+		    strcmp(path, "/") ? "/" : "", rel) >= (int)sizeof(pathname))
+			continue;
+		if (lstat(pathname, &st) < 0)
+			continue;
+		if (!S_ISDIR(st.st_mode) && t->pattern != NULL &&
+		    match_pattern(name, t->pattern) != 1)
+			continue;
+		if (count >= nstats) {
+			nstats *= 2;
+			stats = xrealloc(stats, nstats, sizeof(Stat));
+		}
+		enter = S_ISDIR(st.st_mode) &&
+		    (t->max_depth == 0 || t->nlevels < t->max_depth);
+		dirp = enter ? opendir(pathname) : NULL;
+		stat_to_attrib(&st, &(stats[count].attrib));
+		/* Unreadable directories are marked with a trailing '/' */
+		if (enter && dirp == NULL)
+			xasprintf(&stats[count].name, "%s/", rel);
+		else
+			stats[count].name = xstrdup(rel);
+		stats[count].long_name = ls_file(name, &st, 0, 0);
+		len += strlen(stats[count].name) +
+		    strlen(stats[count].long_name) + 64;
+		count++;
+		if (dirp != NULL) {
+			dirtree_push(t, dirp, rel);
+			closedir(dirp);
+		}
+	}
+	if (count > 0) {
+		send_names(id, count, stats);
+		for (i = 0; i < count; i++) {
+			xfree(stats[i].name);
+			xfree(stats[i].long_name);
+		}
+	} else {
+		send_status(id, SSH2_FX_EOF);
+	}
+	xfree(stats);
+}
+
 static void
 process_readdir(void)
 {
@@ -924,6 +1343,8 @@ process_readdir(void)
 	path = handle_to_name(handle);
 	if (dirp == NULL || path == NULL) {
 		send_status(id, SSH2_FX_FAILURE);
+	} else if (handles[handle].tree != NULL) {
+		readdir_tree(id, handles[handle].tree, path);
 	} else {
 		struct stat st;
 		char pathname[MAXPATHLEN];
@@ -1246,6 +1667,225 @@ process_extended_hardlink(u_int32_t id)
 	xfree(newpath);
 }
 
+static void
+process_extended_blockhash(u_int32_t id)
+{
+	Buffer msg, hashes;
+	u_char digest[SFTP_HASH_LEN];
+	u_int64_t off, len, want, hashed = 0;
+	u_int32_t blocksize, count;
+	int handle, fd, toeof;
+	ssize_t ret;
+
+	handle = get_handle();
+	off = get_int64();
+	len = get_int64();
+	blocksize = get_int();
+	/* A zero length means "to end of file" */
+	toeof = len == 0;
+	debug("request %u: blockhash \"%s\" (handle %d) off %llu len %llu "
+	    "blocksize %u", id, handle_to_name(handle), handle,
+	    (unsigned long long)off, (unsigned long long)len, blocksize);
+	if ((fd = handle_to_fd(handle)) < 0) {
+		send_status(id, SSH2_FX_FAILURE);
+		return;
+	}
+	if (blocksize < SFTP_BLOCKHASH_MIN || blocksize > SFTP_BLOCKHASH_MAX) {
+		send_status(id, SSH2_FX_BAD_MESSAGE);
+		return;
+	}
+	/*
+	 * Hashing holds up every other request on the session, so stop
+	 * short after SFTP_BLOCKHASH_BYTES and let the client ask again.
+	 */
+	buffer_init(&hashes);
+	for (count = 0; count < SFTP_BLOCKHASH_COUNT; count++) {
+		want = blocksize;
+		if (!toeof)
+			want = MIN(want, len);
+		if (want == 0 || hashed + want > SFTP_BLOCKHASH_BYTES)
+			break;
+		if ((ret = hash_file_range(fd, off, want, digest)) == -1) {
+			error("process_extended_blockhash: hash failed: %s",
+			    strerror(errno));
+			send_status(id, errno_to_portable(errno));
+			buffer_free(&hashes);
+			return;
+		}
+		if (ret == 0)
+			break;
+		buffer_put_string(&hashes, digest, sizeof(digest));
+		hashed += ret;
+		off += ret;
+		if (!toeof)
+			len -= ret;
+		if ((u_int64_t)ret < want) {
+			count++;
+			break;
+		}
+	}
+	buffer_init(&msg);
+	buffer_put_char(&msg, SSH2_FXP_EXTENDED_REPLY);
+	buffer_put_int(&msg, id);
+	buffer_put_int(&msg, count);
+	buffer_append(&msg, buffer_ptr(&hashes), buffer_len(&hashes));
+	debug("request %u: sent %u block hashes", id, count);
+	send_msg(&msg);
+	buffer_free(&msg);
+	buffer_free(&hashes);
+}
+
+static void
+process_extended_hash(u_int32_t id)
+{
+	Buffer msg;
+	u_char digest[SFTP_HASH_MAXLEN];
+	u_int64_t off, len;
+	u_int dlen;
+	int handle, fd;
+	char *alg;
+
+	handle = get_handle();
+	alg = get_string(NULL);
+	off = get_int64();
+	len = get_int64();
+	debug("request %u: hash %s \"%s\" (handle %d) off %llu len %llu",
+	    id, alg, handle_to_name(handle), handle,
+	    (unsigned long long)off, (unsigned long long)len);
+	if ((fd = handle_to_fd(handle)) < 0)
+		send_status(id, SSH2_FX_FAILURE);
+	else if (!hash_alg_valid(alg))
+		send_status(id, SSH2_FX_OP_UNSUPPORTED);
+	else if (hash_file(fd, alg, off, len, digest, &dlen) == -1) {
+		error("process_extended_hash: hash failed: %s",
+		    strerror(errno));
+		send_status(id, errno_to_portable(errno));
+	} else {
+		buffer_init(&msg);
+		buffer_put_char(&msg, SSH2_FXP_EXTENDED_REPLY);
+		buffer_put_int(&msg, id);
+		buffer_put_cstring(&msg, alg);
+		buffer_put_string(&msg, digest, dlen);
+		send_msg(&msg);
+		buffer_free(&msg);
+	}
+	xfree(alg);
+}
+
+static void
+process_extended_opendir_tree(u_int32_t id)
+{
+	DIR *dirp;
+	DirTree *t;
+	char *path, *pattern;
+	u_int32_t depth;
+	int handle, status = SSH2_FX_FAILURE;
+
+	path = get_string(NULL);
+	depth = get_int();
+	pattern = get_string(NULL);
+	debug3("request %u: opendir-tree depth %u pattern \"%s\"", id,
+	    depth, pattern);
+	logit("opendir-tree \"%s\"", path);
+	if ((dirp = opendir(path)) == NULL) {
+		status = errno_to_portable(errno);
+	} else if ((handle = handle_new(HANDLE_DIR, path, 0, dirp)) < 0) {
+		closedir(dirp);
+	} else {
+		t = xcalloc(1, sizeof(*t));
+		t->max_depth = depth;
+		if (*pattern != '\0')
+			t->pattern = xstrdup(pattern);
+		dirtree_push(t, dirp, "");
+		handles[handle].tree = t;
+		send_handle(id, handle);
+		status = SSH2_FX_OK;
+	}
+	if (status != SSH2_FX_OK)
+		send_status(id, status);
+	xfree(path);
+	xfree(pattern);
+}
+
+static void
+process_extended_extents(u_int32_t id)
+{
+	Buffer msg;
+	struct stat st;
+	u_int64_t off;
+	off_t start[EXTENTS_MAX], end[EXTENTS_MAX];
+	u_int i, n;
+	int handle, fd;
+
+	handle = get_handle();
+	off = get_int64();
+	debug("request %u: extents \"%s\" (handle %d) off %llu", id,
+	    handle_to_name(handle), handle, (unsigned long long)off);
+	if ((fd = handle_to_fd(handle)) < 0) {
+		send_status(id, SSH2_FX_FAILURE);
+		return;
+	}
+	if (fstat(fd, &st) < 0) {
+		send_status(id, errno_to_portable(errno));
+		return;
+	}
+	for (n = 0; n < EXTENTS_MAX && off < (u_int64_t)st.st_size; n++) {
+		file_data_extent(fd, off, st.st_size, &start[n], &end[n]);
+		if (start[n] >= end[n])
+			break;
+		off = end[n];
+	}
+	debug2("request %u: %u extents", id, n);
+
+	buffer_init(&msg);
+	buffer_put_char(&msg, SSH2_FXP_EXTENDED_REPLY);
+	buffer_put_int(&msg, id);
+	buffer_put_int64(&msg, st.st_size);
+	buffer_put_int(&msg, n);
+	for (i = 0; i < n; i++) {
+		buffer_put_int64(&msg, start[i]);
+		buffer_put_int64(&msg, end[i] - start[i]);
+	}
+	/* Whether the list runs to the end of the file */
+	buffer_put_char(&msg, n < EXTENTS_MAX ||
+	    off >= (u_int64_t)st.st_size);
+	send_msg(&msg);
+	buffer_free(&msg);
+}
+
+/* Number of handles we can have open, or 0 if unknown */
+static u_int64_t
+max_open_handles(void)
+{
+#if defined(HAVE_GETRLIMIT) && defined(RLIMIT_NOFILE)
+	struct rlimit rl;
+
+	/* Leave room for stdio and the log */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+	    rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur > 5)
+		return rl.rlim_cur - 5;
+#endif
+	return 0;
+}
+
+static void
+process_extended_limits(u_int32_t id)
+{
+	Buffer msg;
+
+	debug("request %u: limits", id);
+	buffer_init(&msg);
+	buffer_put_char(&msg, SSH2_FXP_EXTENDED_REPLY);
+	buffer_put_int(&msg, id);
+	buffer_put_int64(&msg, SFTP_MAX_LARGE_MSG_LENGTH);
+	buffer_put_int64(&msg, SFTP_MAX_LARGE_MSG_LENGTH - MSG_OVERHEAD);
+	buffer_put_int64(&msg, SFTP_MAX_LARGE_MSG_LENGTH - MSG_OVERHEAD);
+	buffer_put_int64(&msg, max_open_handles());
+	send_msg(&msg);
+	buffer_free(&msg);
+	large_msgs = 1;
+}
+
 static void
 process_extended(void)
 {
@@ -1262,14 +1902,28 @@ process_extended(void)
 		process_extended_fstatvfs(id);
 	else if (strcmp(request, "hardlink@openssh.com") == 0)
 		process_extended_hardlink(id);
+	else if (strcmp(request, "blockhash@openssh.com") == 0)
+		process_extended_blockhash(id);
+	else if (strcmp(request, "hash@openssh.com") == 0)
+		process_extended_hash(id);
+	else if (strcmp(request, "opendir-tree@openssh.com") == 0)
+		process_extended_opendir_tree(id);
+	else if (strcmp(request, "extents@openssh.com") == 0)
+		process_extended_extents(id);
+	else if (strcmp(request, "limits@openssh.com") == 0)
+		process_extended_limits(id);
 	else
 		send_status(id, SSH2_FX_OP_UNSUPPORTED);	/* MUST */
 	xfree(request);
 }
 
-/* stolen from ssh-agent */
+/*
+ * stolen from ssh-agent
+ * Returns 1 if a request was processed, 0 if the input queue holds no
+ * complete request.
+ */
 
-static void
+static int
 process(void)
 {
 	u_int msg_len;
@@ -1280,16 +1934,16 @@ process(void)
 
 	buf_len = buffer_len(&iqueue);
 	if (buf_len < 5)
-		return;		/* Incomplete message. */
+		return 0;	/* Incomplete message. */
 	cp = buffer_ptr(&iqueue);
 	msg_len = get_u32(cp);
-	if (msg_len > SFTP_MAX_MSG_LENGTH) {
+	if (msg_len > SFTP_MAX_LARGE_MSG_LENGTH) {
 		error("bad message from %s local user %s",
 		    client_addr, pw->pw_name);
 		sftp_server_cleanup_exit(11);
 	}
 	if (buf_len < msg_len + 4)
-		return;
+		return 0;
 	buffer_consume(&iqueue, 4);
 	buf_len -= 4;
 	type = buffer_get_char(&iqueue);
@@ -1307,7 +1961,8 @@ process(void)
 		process_read();
 		break;
 	case SSH2_FXP_WRITE:
-		process_write();
+		/* Writes following this one may be consumed with it */
+		buf_len -= process_write(buf_len - msg_len);
 		break;
 	case SSH2_FXP_LSTAT:
 		process_lstat();
@@ -1370,6 +2025,7 @@ process(void)
 	}
 	if (msg_len > consumed)
 		buffer_consume(&iqueue, msg_len - consumed);
+	return 1;
 }
 
 /* Cleanup handler that logs active handles upon normal exit */
@@ -1390,7 +2046,8 @@ sftp_server_usage(void)
 	extern char *__progname;
 
 	fprintf(stderr,
-	    "usage: %s [-ehR] [-f log_facility] [-l log_level] [-u umask]\n",
+	    "usage: %s [-ehR] [-f log_facility] [-l log_level] [-u umask]\n"
+	    "       [-w write_mode]\n",
 	    __progname);
 	exit(1);
 }
@@ -1402,7 +2059,8 @@ sftp_server_main(int argc, char **argv, struct passwd *user_pw)
 	int in, out, max, ch, skipargs = 0, log_stderr = 0;
 	ssize_t len, olen, set_size;
 	SyslogFacility log_facility = SYSLOG_FACILITY_AUTH;
-	char *cp, buf[4*4096];
+	char *cp;
+	u_char *p;
 	long mask;
 
 	extern char *optarg;
@@ -1411,7 +2069,7 @@ sftp_server_main(int argc, char **argv, struct passwd *user_pw)
 	__progname = ssh_get_progname(argv[0]);
 	log_init(__progname, log_level, log_facility, log_stderr);
 
-	while (!skipargs && (ch = getopt(argc, argv, "f:l:u:cehR")) != -1) {
+	while (!skipargs && (ch = getopt(argc, argv, "f:l:u:w:cehR")) != -1) {
 		switch (ch) {
 		case 'R':
 			readonly = 1;
@@ -1444,6 +2102,11 @@ sftp_server_main(int argc, char **argv, struct passwd *user_pw)
 				fatal("Invalid umask \"%s\"", optarg);
 			(void)umask((mode_t)mask);
 			break;
+		case 'w':
+			if ((write_mode = parse_write_mode(optarg)) == -1 ||
+			    write_mode == WRITE_MODE_SPARSE)
+				fatal("Invalid write mode \"%s\"", optarg);
+			break;
 		case 'h':
 		default:
 			sftp_server_usage();
@@ -1498,8 +2161,8 @@ sftp_server_main(int argc, char **argv, struct passwd *user_pw)
 		 * the worst-case length packet it can generate,
 		 * otherwise apply backpressure by stopping reads.
 		 */
-		if (buffer_check_alloc(&iqueue, sizeof(buf)) &&
-		    buffer_check_alloc(&oqueue, SFTP_MAX_MSG_LENGTH))
+		if (buffer_check_alloc(&iqueue, IQUEUE_READ) &&
+		    buffer_check_alloc(&oqueue, SFTP_MAX_LARGE_MSG_LENGTH))
 			FD_SET(in, rset);
 
 		olen = buffer_len(&oqueue);
@@ -1513,17 +2176,18 @@ sftp_server_main(int argc, char **argv, struct passwd *user_pw)
 			sftp_server_cleanup_exit(2);
 		}
 
-		/* copy stdin to iqueue */
+		/* read stdin straight into iqueue */
 		if (FD_ISSET(in, rset)) {
-			len = read(in, buf, sizeof buf);
+			p = buffer_append_space(&iqueue, IQUEUE_READ);
+			len = read(in, p, IQUEUE_READ);
+			buffer_consume_end(&iqueue,
+			    len > 0 ? IQUEUE_READ - len : IQUEUE_READ);
 			if (len == 0) {
 				debug("read eof");
 				sftp_server_cleanup_exit(0);
 			} else if (len < 0) {
 				error("read: %s", strerror(errno));
 				sftp_server_cleanup_exit(1);
-			} else {
-				buffer_append(&iqueue, buf, len);
 			}
 		}
 		/* send oqueue to stdout */
@@ -1538,11 +2202,13 @@ sftp_server_main(int argc, char **argv, struct passwd *user_pw)
 		}
 
 		/*
-		 * Process requests from client if we can fit the results
-		 * into the output buffer, otherwise stop processing input
+		 * Process all complete requests from client while we can
+		 * fit the results into the output buffer, so their replies
+		 * go out in a single write. Otherwise stop processing input
 		 * and let the output queue drain.
 		 */
-		if (buffer_check_alloc(&oqueue, SFTP_MAX_MSG_LENGTH))
-			process();
+		while (buffer_check_alloc(&oqueue, SFTP_MAX_LARGE_MSG_LENGTH) &&
+		    process())
+			;
 	}
 }
@@ -68,8 +68,6 @@ typedef void EditLine;
 #include "sftp-common.h"
 #include "sftp-client.h"
 
-#define DEFAULT_COPY_BUFLEN	32768	/* Size of buffer for up/download */
-#define DEFAULT_NUM_REQUESTS	64	/* # concurrent outstanding requests */
 
 /* File to read commands from */
 FILE* infile;
@@ -119,6 +117,7 @@ extern char *__progname;
 #define LS_REVERSE_SORT	0x0040	/* Reverse sort order */
 #define LS_SHOW_ALL	0x0080	/* Don't skip filenames starting with '.' */
 #define LS_SI_UNITS	0x0100	/* Display sizes as K, M, G, etc. */
+#define LS_RECURSIVE	0x0200	/* List subdirectories too ala ls -R */
 
 #define VIEW_FLAGS	(LS_LONG_VIEW|LS_SHORT_VIEW|LS_NUMERIC_VIEW|LS_SI_UNITS)
 #define SORT_FLAGS	(LS_NAME_SORT|LS_TIME_SORT|LS_SIZE_SORT)
@@ -236,18 +235,18 @@ help(void)
 	    "df [-hi] [path]                    Display statistics for current directory or\n"
 	    "                                   filesystem containing 'path'\n"
 	    "exit                               Quit sftp\n"
-	    "get [-Ppr] remote [local]          Download file\n"
+	    "get [-acPpr] remote [local]        Download file\n"
 	    "help                               Display this help text\n"
 	    "lcd path                           Change local directory to 'path'\n"
 	    "lls [ls-options [path]]            Display local directory listing\n"
 	    "lmkdir path                        Create local directory\n"
 	    "ln [-s] oldpath newpath            Link remote file (-s for symlink)\n"
 	    "lpwd                               Print local working directory\n"
-	    "ls [-1afhlnrSt] [path]             Display remote directory listing\n"
+	    "ls [-1afhlnRrSt] [path]            Display remote directory listing\n"
 	    "lumask umask                       Set local umask to 'umask'\n"
 	    "mkdir path                         Create remote directory\n"
 	    "progress                           Toggle display of progress meter\n"
-	    "put [-Ppr] local [remote]          Upload file\n"
+	    "put [-acPpr] local [remote]        Upload file\n"
 	    "pwd                                Display remote working directory\n"
 	    "quit                               Quit sftp\n"
 	    "rename oldpath newpath             Rename remote file\n"
@@ -348,8 +347,8 @@ make_absolute(char *p, char *pwd)
 }
 
 static int
-parse_getput_flags(const char *cmd, char **argv, int argc, int *pflag,
-    int *rflag)
+parse_getput_flags(const char *cmd, char **argv, int argc, int *aflag,
+    int *cflag, int *pflag, int *rflag)
 {
 	extern int opterr, optind, optopt, optreset;
 	int ch;
@@ -357,9 +356,15 @@ parse_getput_flags(const char *cmd, char **argv, int argc, int *pflag,
 	optind = optreset = 1;
 	opterr = 0;
 
-	*rflag = *pflag = 0;
-	while ((ch = getopt(argc, argv, "PpRr")) != -1) {
+	*aflag = *cflag = *rflag = *pflag = 0;
+	while ((ch = getopt(argc, argv, "acPpRr")) != -1) {
 		switch (ch) {
+		case 'a':
+			*aflag = 1;
+			break;
+		case 'c':
+			*cflag = 1;
+			break;
 		case 'p':
 		case 'P':
 			*pflag = 1;
@@ -411,12 +416,15 @@ parse_ls_flags(char **argv, int argc, int *lflag)
 	opterr = 0;
 
 	*lflag = LS_NAME_SORT;
-	while ((ch = getopt(argc, argv, "1Safhlnrt")) != -1) {
+	while ((ch = getopt(argc, argv, "1RSafhlnrt")) != -1) {
 		switch (ch) {
 		case '1':
 			*lflag &= ~VIEW_FLAGS;
 			*lflag |= LS_SHORT_VIEW;
 			break;
+		case 'R':
+			*lflag |= LS_RECURSIVE;
+			break;
 		case 'S':
 			*lflag &= ~SORT_FLAGS;
 			*lflag |= LS_SIZE_SORT;
@@ -517,7 +525,7 @@ pathname_is_dir(char *pathname)
 
 static int
 process_get(struct sftp_conn *conn, char *src, char *dst, char *pwd,
-    int pflag, int rflag)
+    int pflag, int rflag, int resume, int verify)
 {
 	char *abs_src = NULL;
 	char *abs_dst = NULL;
@@ -572,11 +580,11 @@ process_get(struct sftp_conn *conn, char *src, char *dst, char *pwd,
 		printf("Fetching %s to %s\n", g.gl_pathv[i], abs_dst);
 		if (pathname_is_dir(g.gl_pathv[i]) && (rflag || global_rflag)) {
 			if (download_dir(conn, g.gl_pathv[i], abs_dst, NULL, 
-			    pflag || global_pflag, 1) == -1)
+			    pflag || global_pflag, 1, resume, verify) == -1)
 				err = -1;
 		} else {
 			if (do_download(conn, g.gl_pathv[i], abs_dst, NULL,
-			    pflag || global_pflag) == -1)
+			    pflag || global_pflag, resume, verify) == -1)
 				err = -1;
 		}
 		xfree(abs_dst);
@@ -591,7 +599,7 @@ out:
 
 static int
 process_put(struct sftp_conn *conn, char *src, char *dst, char *pwd,
-    int pflag, int rflag)
+    int pflag, int rflag, int resume, int verify)
 {
 	char *tmp_dst = NULL;
 	char *abs_dst = NULL;
@@ -657,11 +665,11 @@ process_put(struct sftp_conn *conn, char *src, char *dst, char *pwd,
 		printf("Uploading %s to %s\n", g.gl_pathv[i], abs_dst);
 		if (pathname_is_dir(g.gl_pathv[i]) && (rflag || global_rflag)) {
 			if (upload_dir(conn, g.gl_pathv[i], abs_dst,
-			    pflag || global_pflag, 1) == -1)
+			    pflag || global_pflag, 1, resume, verify) == -1)
 				err = -1;
 		} else {
 			if (do_upload(conn, g.gl_pathv[i], abs_dst,
-			    pflag || global_pflag) == -1)
+			    pflag || global_pflag, resume, verify) == -1)
 				err = -1;
 		}
 	}
@@ -693,15 +701,16 @@ sdirent_comp(const void *aa, const void *bb)
 	fatal("Unknown ls sort type");
 }
 
-/* sftp ls.1 replacement for directories */
+/* List 'path', and its subdirectories if LS_RECURSIVE is set */
 static int
-do_ls_dir(struct sftp_conn *conn, char *path, char *strip_path, int lflag)
+ls_dir(struct sftp_conn *conn, char *path, char *strip_path, int lflag,
+    struct sftp_tree *tree)
 {
 	int n;
 	u_int c = 1, colspace = 0, columns = 1;
 	SFTP_DIRENT **d;
 
-	if ((n = do_readdir(conn, path, &d)) != 0)
+	if ((n = tree_readdir(conn, tree, path, &d)) != 0)
 		return (n);
 
 	if (!(lflag & LS_SHORT_VIEW)) {
@@ -774,10 +783,43 @@ do_ls_dir(struct sftp_conn *conn, char *path, char *strip_path, int lflag)
 	if (!(lflag & LS_LONG_VIEW) && (c != 1))
 		printf("\n");
 
+	/* Symlinks are not followed, so this cannot loop */
+	for (n = 0; (lflag & LS_RECURSIVE) && d[n] != NULL && !interrupted;
+	    n++) {
+		char *tmp, *fname;
+
+		if (!S_ISDIR(d[n]->a.perm) || strcmp(d[n]->filename, ".") == 0 ||
+		    strcmp(d[n]->filename, "..") == 0 ||
+		    (d[n]->filename[0] == '.' && !(lflag & LS_SHOW_ALL)))
+			continue;
+
+		tmp = path_append(path, d[n]->filename);
+		fname = path_strip(tmp, strip_path);
+		printf("\n%s:\n", fname);
+		ls_dir(conn, tmp, strip_path, lflag, tree);
+		xfree(fname);
+		xfree(tmp);
+	}
+
 	free_sftp_dirents(d);
 	return (0);
 }
 
+/* sftp ls.1 replacement for directories */
+static int
+do_ls_dir(struct sftp_conn *conn, char *path, char *strip_path, int lflag)
+{
+	struct sftp_tree *tree = NULL;
+	int err;
+
+	/* Fetch the whole tree at once if the server can list it */
+	if (lflag & LS_RECURSIVE)
+		tree = do_readdir_tree(conn, path, 0, NULL);
+	err = ls_dir(conn, path, strip_path, lflag, tree);
+	free_sftp_tree(tree);
+	return (err);
+}
+
 /* sftp ls.1 replacement which handles path globs */
 static int
 do_globbed_ls(struct sftp_conn *conn, char *path, char *strip_path,
@@ -1112,8 +1154,9 @@ makeargv(const char *arg, int *argcp, int sloppy, char *lastquote,
 }
 
 static int
-parse_args(const char **cpp, int *pflag, int *rflag, int *lflag, int *iflag,
-    int *hflag, int *sflag, unsigned long *n_arg, char **path1, char **path2)
+parse_args(const char **cpp, int *aflag, int *cflag, int *pflag, int *rflag,
+    int *lflag, int *iflag, int *hflag, int *sflag, unsigned long *n_arg,
+    char **path1, char **path2)
 {
 	const char *cmd, *cp = *cpp;
 	char *cp2, **argv;
@@ -1157,14 +1200,14 @@ parse_args(const char **cpp, int *pflag, int *rflag, int *lflag, int *iflag,
 	}
 
 	/* Get arguments and parse flags */
-	*lflag = *pflag = *rflag = *hflag = *n_arg = 0;
+	*aflag = *cflag = *lflag = *pflag = *rflag = *hflag = *n_arg = 0;
 	*path1 = *path2 = NULL;
 	optidx = 1;
 	switch (cmdnum) {
 	case I_GET:
 	case I_PUT:
 		if ((optidx = parse_getput_flags(cmd, argv, argc,
-		    pflag, rflag)) == -1)
+		    aflag, cflag, pflag, rflag)) == -1)
 			return -1;
 		/* Get first pathname (mandatory) */
 		if (argc - optidx < 1) {
@@ -1288,6 +1331,7 @@ parse_dispatch_command(struct sftp_conn *conn, const char *cmd, char **pwd,
 {
 	char *path1, *path2, *tmp;
 	int pflag = 0, rflag = 0, lflag = 0, iflag = 0, hflag = 0, sflag = 0;
+	int aflag = 0, cflag = 0;
 	int cmdnum, i;
 	unsigned long n_arg = 0;
 	Attrib a, *aa;
@@ -1296,8 +1340,8 @@ parse_dispatch_command(struct sftp_conn *conn, const char *cmd, char **pwd,
 	glob_t g;
 
 	path1 = path2 = NULL;
-	cmdnum = parse_args(&cmd, &pflag, &rflag, &lflag, &iflag, &hflag,
-	    &sflag, &n_arg, &path1, &path2);
+	cmdnum = parse_args(&cmd, &aflag, &cflag, &pflag, &rflag, &lflag,
+	    &iflag, &hflag, &sflag, &n_arg, &path1, &path2);
 
 	if (iflag != 0)
 		err_abort = 0;
@@ -1314,10 +1358,12 @@ parse_dispatch_command(struct sftp_conn *conn, const char *cmd, char **pwd,
 		err = -1;
 		break;
 	case I_GET:
-		err = process_get(conn, path1, path2, *pwd, pflag, rflag);
+		err = process_get(conn, path1, path2, *pwd, pflag, rflag,
+		    aflag, cflag);
 		break;
 	case I_PUT:
-		err = process_put(conn, path1, path2, *pwd, pflag, rflag);
+		err = process_put(conn, path1, path2, *pwd, pflag, rflag,
+		    aflag, cflag);
 		break;
 	case I_RENAME:
 		path1 = make_absolute(path1, *pwd);
@@ -2071,7 +2117,7 @@ usage(void)
 	    "[-i identity_file] [-l limit]\n"
 	    "          [-o ssh_option] [-P port] [-R num_requests] "
 	    "[-S program]\n"
-	    "          [-s subsystem | sftp_server] host\n"
+	    "          [-s subsystem | sftp_server] [-w write_mode] host\n"
 	    "       %s [user@]host[:file ...]\n"
 	    "       %s [user@]host[:dir[/]]\n"
 	    "       %s -b batchfile [user@]host\n",
@@ -2093,9 +2139,10 @@ main(int argc, char **argv)
 	extern int optind;
 	extern char *optarg;
 	struct sftp_conn *conn;
-	size_t copy_buffer_len = DEFAULT_COPY_BUFLEN;
-	size_t num_requests = DEFAULT_NUM_REQUESTS;
+	size_t copy_buffer_len = 0;	/* chosen from server limits */
+	size_t num_requests = 0;	/* chosen from transfer size */
 	long long limit_kbps = 0;
+	int write_mode = WRITE_MODE_NORMAL;
 
 	/* Ensure that fds 0, 1 and 2 are open or directed to /dev/null */
 	sanitise_stdfd();
@@ -2113,7 +2160,7 @@ main(int argc, char **argv)
 	infile = stdin;
 
 	while ((ch = getopt(argc, argv,
-	    "1246hpqrvCc:D:i:l:o:s:S:b:B:F:P:R:")) != -1) {
+	    "1246hpqrvCc:D:i:l:o:s:S:b:B:F:P:R:w:")) != -1) {
 		switch (ch) {
 		/* Passed through to ssh(1) */
 		case '4':
@@ -2197,6 +2244,11 @@ main(int argc, char **argv)
 			ssh_program = optarg;
 			replacearg(&args, 0, "%s", ssh_program);
 			break;
+		case 'w':
+			if ((write_mode = parse_write_mode(optarg)) == -1 ||
+			    write_mode == WRITE_MODE_SPARSE)
+				fatal("Invalid write mode \"%s\"", optarg);
+			break;
 		case 'h':
 		default:
 			usage();
@@ -2261,6 +2313,7 @@ main(int argc, char **argv)
 	conn = do_init(in, out, copy_buffer_len, num_requests, limit_kbps);
 	if (conn == NULL)
 		fatal("Couldn't initialise connection to server");
+	sftp_set_write_mode(conn, write_mode);
 
 	if (!batchmode) {
 		if (sftp_direct == NULL)
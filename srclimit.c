@@ -0,0 +1,346 @@
+/* $OpenBSD$ */
+
+/*
+ * Copyright (c) 2026 The OpenBSD project
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Per-source accounting of unauthenticated connections for the sshd
+ * listener. Each connection is charged to its address and to the
+ * netblock containing it, and each of those tracks the connections
+ * still waiting to authenticate and a score of recent ones that went
+ * away without doing so. The score decays by one every
+ * SRCLIMIT_DECAY_TIME seconds. A new connection is refused when either
+ * of its entries is over its limit, before sshd forks for it.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "openbsd-compat/sys-queue.h"
+#include "xmalloc.h"
+#include "log.h"
+#include "srclimit.h"
+
+#define SRCLIMIT_BUCKETS	1024	/* hash buckets, power of two */
+#define SRCLIMIT_MAX_ENTRIES	65536	/* beyond this, sources are let in */
+#define SRCLIMIT_DECAY_TIME	60	/* seconds to forget one failure */
+
+struct srckey {
+	int	af;
+	int	masklen;
+	u_char	addr[16];
+};
+
+struct srcent {
+	struct srckey	key;
+	u_int		startups;	/* connections not yet authenticated */
+	u_int		failures;	/* decaying count of failed ones */
+	time_t		decayed;	/* last time failures was decayed */
+	LIST_ENTRY(srcent) next;
+};
+
+struct srcchild {
+	int		id;		/* -1 if unused */
+	struct srcent	*addr, *net;
+};
+
+LIST_HEAD(srcbucket, srcent);
+
+static struct srcbucket *buckets = NULL;
+static struct srcchild *children = NULL;
+static int max_children;
+static int addr_max_startups, net_max_startups;
+static int addr_max_failures, net_max_failures;
+static int ipv4_masklen, ipv6_masklen;
+
+/* Counters reported by srclimit_log_stats() */
+static u_int nentries;
+static u_long n_allowed, n_untracked, n_failures;
+static u_long n_refused_addr_startups, n_refused_net_startups;
+static u_long n_refused_addr_failures, n_refused_net_failures;
+
+void
+srclimit_init(int max_startups, int addr_startups, int net_startups,
+    int addr_failures, int net_failures, int ipv4_len, int ipv6_len)
+{
+	int i;
+
+	if (addr_startups <= 0 && net_startups <= 0 &&
+	    addr_failures <= 0 && net_failures <= 0)
+		return;
+	addr_max_startups = addr_startups;
+	net_max_startups = net_startups;
+	addr_max_failures = addr_failures;
+	net_max_failures = net_failures;
+	ipv4_masklen = ipv4_len;
+	ipv6_masklen = ipv6_len;
+	max_children = max_startups;
+	debug("%s: startups %d/%d failures %d/%d netblock /%d, /%d", __func__,
+	    addr_startups, net_startups, addr_failures, net_failures,
+	    ipv4_len, ipv6_len);
+
+	buckets = xcalloc(SRCLIMIT_BUCKETS, sizeof(*buckets));
+	for (i = 0; i < SRCLIMIT_BUCKETS; i++)
+		LIST_INIT(&buckets[i]);
+	children = xcalloc(max_children, sizeof(*children));
+	for (i = 0; i < max_children; i++)
+		children[i].id = -1;
+}
+
+/* Fill in the key for a peer address, keeping masklen bits of it */
+static int
+srckey_make(struct srckey *k, struct sockaddr_storage *ss, int masklen)
+{
+	u_char *p;
+	int len, i;
+
+	memset(k, 0, sizeof(*k));
+	switch (ss->ss_family) {
+	case AF_INET:
+		p = (u_char *)&((struct sockaddr_in *)ss)->sin_addr;
+		len = 4;
+		break;
+	case AF_INET6:
+		p = (u_char *)&((struct sockaddr_in6 *)ss)->sin6_addr;
+		len = 16;
+		break;
+	default:
+		return -1;
+	}
+	k->af = ss->ss_family;
+	k->masklen = masklen = MIN(masklen, len * 8);
+	memcpy(k->addr, p, len);
+	for (i = masklen / 8; i < len; i++) {
+		if (i == masklen / 8 && masklen % 8 != 0)
+			k->addr[i] &= 0xff << (8 - masklen % 8);
+		else
+			k->addr[i] = 0;
+	}
+	return 0;
+}
+
+static u_int
+srckey_hash(const struct srckey *k)
+{
+	const u_char *p = (const u_char *)k;
+	u_int i, h = 2166136261U;	/* FNV-1a */
+
+	for (i = 0; i < sizeof(*k); i++)
+		h = (h ^ p[i]) * 16777619U;
+	return h & (SRCLIMIT_BUCKETS - 1);
+}
+
+/* Bring the failure score of an entry up to date */
+static void
+srcent_decay(struct srcent *e, time_t now)
+{
+	time_t n;
+
+	if (e->failures == 0) {
+		e->decayed = now;
+		return;
+	}
+	n = (now - e->decayed) / SRCLIMIT_DECAY_TIME;
+	if (n <= 0)
+		return;
+	e->failures = (time_t)e->failures > n ? e->failures - n : 0;
+	e->decayed += n * SRCLIMIT_DECAY_TIME;
+}
+
+static void
+srcent_release(struct srcent *e)
+{
+	if (e == NULL || e->startups > 0 || e->failures > 0)
+		return;
+	LIST_REMOVE(e, next);
+	xfree(e);
+	nentries--;
+}
+
+/*
+ * Find the entry for a key, creating it if needed. Idle entries met
+ * on the way are expired, except for keep. Returns NULL if the table
+ * is full.
+ */
+static struct srcent *
+srcent_lookup(struct srckey *k, time_t now, struct srcent *keep)
+{
+	struct srcbucket *b = &buckets[srckey_hash(k)];
+	struct srcent *e, *tmp;
+
+	for (e = LIST_FIRST(b); e != NULL; e = tmp) {
+		tmp = LIST_NEXT(e, next);
+		srcent_decay(e, now);
+		if (memcmp(&e->key, k, sizeof(*k)) == 0)
+			return e;
+		if (e != keep)
+			srcent_release(e);
+	}
+	if (nentries >= SRCLIMIT_MAX_ENTRIES)
+		return NULL;
+	e = xcalloc(1, sizeof(*e));
+	e->key = *k;
+	e->decayed = now;
+	LIST_INSERT_HEAD(b, e, next);
+	nentries++;
+	return e;
+}
+
+/*
+ * Account for a new connection on sock, which will be reported done
+ * under id. Returns 1 if it may proceed or 0 if it should be dropped.
+ */
+int
+srclimit_check_allow(int sock, int id)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	struct srckey ka, kn;
+	struct srcchild *child = NULL;
+	time_t now;
+	int i;
+
+	if (buckets == NULL)
+		return 1;
+	for (i = 0; i < max_children; i++)
+		if (children[i].id == -1) {
+			child = &children[i];
+			break;
+		}
+	if (child == NULL || getpeername(sock, (struct sockaddr *)&ss,
+	    &len) == -1 || srckey_make(&ka, &ss, 128) == -1 ||
+	    srckey_make(&kn, &ss, ss.ss_family == AF_INET ?
+	    ipv4_masklen : ipv6_masklen) == -1) {
+		n_untracked++;
+		return 1;
+	}
+	now = time(NULL);
+	if ((child->addr = srcent_lookup(&ka, now, NULL)) == NULL ||
+	    (child->net = srcent_lookup(&kn, now, child->addr)) == NULL) {
+		srcent_release(child->addr);
+		child->addr = NULL;
+		n_untracked++;
+		return 1;
+	}
+	/* With the netblock size at its maximum both are the same entry */
+	if (child->net == child->addr)
+		child->net = NULL;
+
+	if (addr_max_failures > 0 &&
+	    child->addr->failures >= (u_int)addr_max_failures) {
+		n_refused_addr_failures++;
+		goto refuse;
+	}
+	if (net_max_failures > 0 && child->net != NULL &&
+	    child->net->failures >= (u_int)net_max_failures) {
+		n_refused_net_failures++;
+		goto refuse;
+	}
+	if (addr_max_startups > 0 &&
+	    child->addr->startups >= (u_int)addr_max_startups) {
+		n_refused_addr_startups++;
+		goto refuse;
+	}
+	if (net_max_startups > 0 && child->net != NULL &&
+	    child->net->startups >= (u_int)net_max_startups) {
+		n_refused_net_startups++;
+		goto refuse;
+	}
+	child->id = id;
+	child->addr->startups++;
+	if (child->net != NULL)
+		child->net->startups++;
+	n_allowed++;
+	return 1;
+
+ refuse:
+	srcent_release(child->addr);
+	srcent_release(child->net);
+	child->addr = child->net = NULL;
+	return 0;
+}
+
+/* Report the connection accounted under id under newid from now on */
+void
+srclimit_move(int id, int newid)
+{
+	int i;
+
+	if (buckets == NULL)
+		return;
+	for (i = 0; i < max_children; i++)
+		if (children[i].id == id) {
+			children[i].id = newid;
+			return;
+		}
+}
+
+/* A connection has authenticated, or has gone away without doing so */
+void
+srclimit_done(int id, int authenticated)
+{
+	struct srcchild *child = NULL;
+	time_t now = time(NULL);
+	struct srcent *e;
+	int i;
+
+	if (buckets == NULL)
+		return;
+	for (i = 0; i < max_children; i++)
+		if (children[i].id == id) {
+			child = &children[i];
+			break;
+		}
+	if (child == NULL)
+		return;
+	if (!authenticated)
+		n_failures++;
+	for (i = 0; i < 2; i++) {
+		if ((e = i == 0 ? child->addr : child->net) == NULL)
+			continue;
+		e->startups--;
+		if (!authenticated) {
+			srcent_decay(e, now);
+			e->failures++;
+		}
+		srcent_release(e);
+	}
+	child->id = -1;
+	child->addr = child->net = NULL;
+}
+
+void
+srclimit_log_stats(void)
+{
+	if (buckets == NULL) {
+		logit("srclimit: per-source limits not enabled");
+		return;
+	}
+	logit("srclimit: %u sources tracked, %lu connections allowed, "
+	    "%lu untracked, %lu failed", nentries, n_allowed, n_untracked,
+	    n_failures);
+	logit("srclimit: refused for startups %lu address %lu netblock, "
+	    "for failures %lu address %lu netblock",
+	    n_refused_addr_startups, n_refused_net_startups,
+	    n_refused_addr_failures, n_refused_net_failures);
+}
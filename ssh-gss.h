@@ -110,6 +110,7 @@ typedef struct {
 	gss_cred_id_t	creds; /* server */
 	gss_name_t	client; /* server */
 	gss_cred_id_t	client_creds; /* both */
+	int		creds_cached; /* server: creds belong to the cache */
 } Gssctxt;
 
 extern ssh_gssapi_mech *supported_mechs[];
@@ -140,7 +141,9 @@ int ssh_gssapi_credentials_updated(Gssctxt *);
 /* In the server */
 typedef int ssh_gssapi_check_fn(Gssctxt **, gss_OID, const char *, 
     const char *);
-char *ssh_gssapi_client_mechanisms(const char *, const char *);
+char *ssh_gssapi_client_mechanisms(const char *, const char *,
+    const char *);
+void ssh_gssapi_kex_cache_drop(void);
 char *ssh_gssapi_kex_mechs(gss_OID_set, ssh_gssapi_check_fn *, const char *,
     const char *);
 gss_OID ssh_gssapi_id_kex(Gssctxt *, char *, int);
@@ -154,6 +157,9 @@ void ssh_gssapi_cleanup_creds(void);
 void ssh_gssapi_storecreds(void);
 
 char *ssh_gssapi_server_mechanisms(void);
+void ssh_gssapi_server_prepare(void);
+void ssh_gssapi_server_put_kex_oids(Buffer *);
+void ssh_gssapi_server_get_kex_oids(Buffer *);
 int ssh_gssapi_oid_table_ok();
 
 int ssh_gssapi_update_creds(ssh_gssapi_ccache *store);
@@ -81,6 +81,7 @@
 extern char *client_version_string;
 extern char *server_version_string;
 extern Options options;
+extern uid_t original_real_uid;
 
 /*
  * SSH2 key exchange
@@ -161,7 +162,7 @@ ssh_kex2(char *host, struct sockaddr *hostaddr, u_short port)
 
 #ifdef GSSAPI
 	char *orig = NULL, *gss = NULL;
-	char *gss_host = NULL;
+	char *gss_host = NULL, *gss_cache;
 #endif
 
 	xxx_host = host;
@@ -178,7 +179,11 @@ ssh_kex2(char *host, struct sockaddr *hostaddr, u_short port)
 		else
 			gss_host = host;
 
-		gss = ssh_gssapi_client_mechanisms(gss_host, options.gss_client_identity);
+		gss_cache = tilde_expand_filename(_PATH_SSH_USER_GSS_KEX_CACHE,
+		    original_real_uid);
+		gss = ssh_gssapi_client_mechanisms(gss_host,
+		    options.gss_client_identity, gss_cache);
+		xfree(gss_cache);
 		if (gss) {
 			debug("Offering GSSAPI proposal: %s", gss);
 			xasprintf(&myproposal[PROPOSAL_KEX_ALGS],
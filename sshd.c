@@ -47,6 +47,9 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
 #ifdef HAVE_SYS_STAT_H
 # include <sys/stat.h>
 #endif
@@ -113,6 +116,8 @@
 #include "session.h"
 #include "monitor_mm.h"
 #include "monitor.h"
+#include "monitor_fdpass.h"
+#include "srclimit.h"
 #ifdef GSSAPI
 #include "ssh-gss.h"
 #endif
@@ -179,6 +184,17 @@ int rexec_flag = 1;
 int rexec_argc = 0;
 char **rexec_argv;
 
+/* Pre-forked worker waiting for the listener to pass it a connection */
+int pool_worker_flag = 0;
+char **pool_argv;
+
+/*
+ * Start of the client's identification, if the listener has already
+ * sent ours and read it before handing over the connection.
+ */
+static char *preauth_ident = NULL;
+static u_int preauth_ident_len = 0;
+
 /*
  * The sockets that the server is listening; this is used in the SIGHUP
  * signal handler.
@@ -224,6 +240,7 @@ static volatile sig_atomic_t key_do_regen = 0;
 /* This is set to true when a signal is received. */
 static volatile sig_atomic_t received_sighup = 0;
 static volatile sig_atomic_t received_sigterm = 0;
+static volatile sig_atomic_t received_siginfo = 0;
 
 /* session identifier, used by RSA-auth */
 u_char session_id[16];
@@ -261,6 +278,9 @@ void demote_sensitive_data(void);
 
 static void do_ssh1_kex(void);
 static void do_ssh2_kex(void);
+static void pool_flush(void);
+static void preauth_close_socks(void);
+static void pool_worker_wait(int *, int *);
 
 /*
  * Close all listening sockets
@@ -313,6 +333,8 @@ sighup_restart(void)
 	logit("Received SIGHUP; restarting.");
 	close_listen_socks();
 	close_startup_pipes();
+	pool_flush();
+	preauth_close_socks();
 	alarm(0);  /* alarm timer persists across exec */
 	signal(SIGHUP, SIG_IGN); /* will be restored after exec */
 	execv(saved_argv[0], saved_argv);
@@ -331,6 +353,17 @@ sigterm_handler(int sig)
 	received_sigterm = sig;
 }
 
+/*
+ * Signal handler for SIGUSR1, which asks the listener to log its
+ * connection accounting counters.
+ */
+/*ARGSUSED*/
+static void
+siginfo_handler(int sig)
+{
+	received_siginfo = 1;
+}
+
 /*
  * SIGCHLD handler.  This is called whenever a child dies.  This will then
  * reap any zombies left by exited children.
@@ -398,16 +431,13 @@ key_regeneration_alarm(int sig)
 	key_do_regen = 1;
 }
 
-static void
-sshd_exchange_identification(int sock_in, int sock_out)
+/* Our protocol version identification, including the line terminator */
+static char *
+make_server_version_string(void)
 {
-	u_int i;
-	int mismatch;
-	int remote_major, remote_minor;
 	int major, minor;
-	char *s, *newline = "\n";
-	char buf[256];			/* Must not be larger than remote_version. */
-	char remote_version[256];	/* Must be at least as big as buf. */
+	char *newline = "\n";
+	char buf[256];
 
 	if ((options.protocol & SSH_PROTO_1) &&
 	    (options.protocol & SSH_PROTO_2)) {
@@ -423,10 +453,24 @@ sshd_exchange_identification(int sock_in, int sock_out)
 	}
 	snprintf(buf, sizeof buf, "SSH-%d.%d-%.100s%s", major, minor,
 	    SSH_VERSION, newline);
-	server_version_string = xstrdup(buf);
+	return xstrdup(buf);
+}
+
+static void
+sshd_exchange_identification(int sock_in, int sock_out)
+{
+	u_int i;
+	int mismatch;
+	int remote_major, remote_minor;
+	char *s;
+	char buf[256];			/* Must not be larger than remote_version. */
+	char remote_version[256];	/* Must be at least as big as buf. */
+
+	server_version_string = make_server_version_string();
 
-	/* Send our protocol version identification. */
-	if (roaming_atomicio(vwrite, sock_out, server_version_string,
+	/* Send our protocol version identification, unless already sent. */
+	if (preauth_ident == NULL &&
+	    roaming_atomicio(vwrite, sock_out, server_version_string,
 	    strlen(server_version_string))
 	    != strlen(server_version_string)) {
 		logit("Could not write ident string to %s", get_remote_ipaddr());
@@ -436,7 +480,9 @@ sshd_exchange_identification(int sock_in, int sock_out)
 	/* Read other sides version identification. */
 	memset(buf, 0, sizeof(buf));
 	for (i = 0; i < sizeof(buf) - 1; i++) {
-		if (roaming_atomicio(read, sock_in, &buf[i], 1) != 1) {
+		if (i < preauth_ident_len)
+			buf[i] = preauth_ident[i];
+		else if (roaming_atomicio(read, sock_in, &buf[i], 1) != 1) {
 			logit("Did not receive identification string from %s",
 			    get_remote_ipaddr());
 			cleanup_exit(255);
@@ -890,6 +936,8 @@ send_rexec_state(int fd, Buffer *conf)
 	 *	bignum	iqmp			"
 	 *	bignum	p			"
 	 *	bignum	q			"
+	 *	string	preauth_ident	(empty if not read by the listener)
+	 *	string	gss_kex_oids	(GSSAPI only; empty if not probed)
 	 *	string rngseed		(only if OpenSSL is not self-seeded)
 	 */
 	buffer_init(&m);
@@ -907,6 +955,14 @@ send_rexec_state(int fd, Buffer *conf)
 	} else
 		buffer_put_int(&m, 0);
 
+	buffer_put_string(&m, preauth_ident, preauth_ident_len);
+
+#ifdef GSSAPI
+	if (options.gss_keyex)
+		ssh_gssapi_server_prepare();
+	ssh_gssapi_server_put_kex_oids(&m);
+#endif
+
 #ifndef OPENSSL_PRNG_ONLY
 	rexec_send_rng_seed(&m);
 #endif
@@ -954,6 +1010,17 @@ recv_rexec_state(int fd, Buffer *conf)
 		    sensitive_data.server_key->rsa);
 	}
 
+	cp = buffer_get_string(&m, &len);
+	if (len > 0) {
+		preauth_ident = cp;
+		preauth_ident_len = len;
+	} else
+		xfree(cp);
+
+#ifdef GSSAPI
+	ssh_gssapi_server_get_kex_oids(&m);
+#endif
+
 #ifndef OPENSSL_PRNG_ONLY
 	rexec_recv_rng_seed(&m);
 #endif
@@ -970,7 +1037,11 @@ server_accept_inetd(int *sock_in, int *sock_out)
 	int fd;
 
 	startup_pipe = -1;
-	if (rexeced_flag) {
+	if (pool_worker_flag) {
+		close(REEXEC_CONFIG_PASS_FD);
+		pool_worker_wait(sock_in, &startup_pipe);
+		*sock_out = *sock_in;
+	} else if (rexeced_flag) {
 		close(REEXEC_CONFIG_PASS_FD);
 		*sock_in = *sock_out = dup(STDIN_FILENO);
 		if (!debug_flag) {
@@ -1037,6 +1108,13 @@ server_listen(void)
 		if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR,
 		    &on, sizeof(on)) == -1)
 			error("setsockopt SO_REUSEADDR: %s", strerror(errno));
+#ifdef SO_REUSEPORT
+		/* Let the other listener processes bind the same address */
+		if (options.listener_procs > 1 &&
+		    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT,
+		    &on, sizeof(on)) == -1)
+			error("setsockopt SO_REUSEPORT: %s", strerror(errno));
+#endif
 
 		/* Only communicate in IPv6 over AF_INET6 sockets. */
 		if (ai->ai_family == AF_INET6)
@@ -1060,12 +1138,763 @@ server_listen(void)
 			    ntop, strport, strerror(errno));
 		logit("Server listening on %s port %s.", ntop, strport);
 	}
-	freeaddrinfo(options.listen_addrs);
+	/* Further listener processes bind the same addresses again */
+	if (options.listener_procs <= 1) {
+		freeaddrinfo(options.listen_addrs);
+		options.listen_addrs = NULL;
+	}
 
 	if (!num_listen_socks)
 		fatal("Cannot bind any address.");
 }
 
+/*
+ * Mark that the ephemeral server key has been given to a child, and
+ * schedule its regeneration.
+ */
+static void
+server_key_given(int *key_used)
+{
+	if ((options.protocol & SSH_PROTO_1) && *key_used == 0) {
+		/* Schedule server key regeneration alarm. */
+		signal(SIGALRM, key_regeneration_alarm);
+		alarm(options.key_regeneration_time);
+		*key_used = 1;
+	}
+}
+
+/*
+ * Pool of pre-forked workers. Each worker is a re-executed sshd that has
+ * already read its configuration and loaded the host keys, and waits on
+ * a socket for the listener to pass it one accepted connection. It then
+ * carries on exactly as a freshly re-executed child would, privilege
+ * separation included, and is never reused.
+ *
+ * The pool starts with options.prefork_min idle workers. Each connection
+ * that finds no ready worker doubles the target, up to prefork_max, and
+ * the target shrinks by one again for every quiet POOL_SHRINK_INTERVAL.
+ */
+#define POOL_SHRINK_INTERVAL	30	/* seconds without a miss */
+#define POOL_RETRY_INTERVAL	10	/* seconds after a worker failed */
+#define POOL_WAKEUP_INTERVAL	10	/* select timeout to resize the pool */
+
+struct pool_worker {
+	pid_t	pid;
+	int	sock;		/* -1 if the slot is free */
+	int	ready;		/* worker has finished starting up */
+};
+
+static struct pool_worker *pool = NULL;
+static int pool_target = 0;
+static time_t pool_last_change = 0;
+static time_t pool_retry_at = 0;
+
+static void
+pool_init(void)
+{
+	int i;
+
+	if (options.prefork_max == 0)
+		return;
+	if (!rexec_flag || debug_flag) {
+		logit("PreforkWorkers disabled: requires re-execution "
+		    "and no debugging");
+		return;
+	}
+	pool = xcalloc(options.prefork_max, sizeof(*pool));
+	for (i = 0; i < options.prefork_max; i++)
+		pool[i].sock = -1;
+	pool_target = options.prefork_min;
+	pool_last_change = time(NULL);
+}
+
+static void
+pool_remove(struct pool_worker *w, int terminate)
+{
+	if (terminate && w->pid > 0)
+		kill(w->pid, SIGTERM);
+	close(w->sock);
+	w->sock = -1;
+	w->pid = -1;
+	w->ready = 0;
+}
+
+/* Retire all idle workers, e.g. because they hold a stale server key */
+static void
+pool_flush(void)
+{
+	int i;
+
+	for (i = 0; pool != NULL && i < options.prefork_max; i++)
+		if (pool[i].sock != -1)
+			pool_remove(&pool[i], 1);
+}
+
+/* Close the listener's ends of the worker sockets in a forked child */
+static void
+pool_close_socks(void)
+{
+	int i;
+
+	for (i = 0; pool != NULL && i < options.prefork_max; i++)
+		if (pool[i].sock != -1)
+			close(pool[i].sock);
+}
+
+static int
+pool_count(void)
+{
+	int i, n = 0;
+
+	for (i = 0; pool != NULL && i < options.prefork_max; i++)
+		if (pool[i].sock != -1)
+			n++;
+	return n;
+}
+
+/* Fork and re-execute a new worker. Returns 0 on success */
+static int
+pool_spawn(struct pool_worker *w)
+{
+	int sp[2], config_s[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == -1) {
+		error("pool socketpair: %s", strerror(errno));
+		return -1;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, config_s) == -1) {
+		error("pool reexec socketpair: %s", strerror(errno));
+		close(sp[0]);
+		close(sp[1]);
+		return -1;
+	}
+	platform_pre_fork();
+	if ((pid = fork()) == 0) {
+		platform_post_fork_child();
+		if (setsid() < 0)
+			error("setsid: %.100s", strerror(errno));
+		close(sp[0]);
+		close(config_s[0]);
+		dup2(sp[1], STDIN_FILENO);
+		dup2(config_s[1], REEXEC_CONFIG_PASS_FD);
+		close(REEXEC_STARTUP_PIPE_FD);
+		/* Drops listen sockets, startup pipes and other workers */
+		closefrom(REEXEC_MIN_FREE_FD);
+		execv(pool_argv[0], pool_argv);
+		error("rexec of %s failed: %s", pool_argv[0], strerror(errno));
+		_exit(1);
+	}
+	platform_post_fork_parent(pid);
+	close(sp[1]);
+	close(config_s[1]);
+	if (pid < 0) {
+		error("fork: %.100s", strerror(errno));
+		close(sp[0]);
+		close(config_s[0]);
+		return -1;
+	}
+	send_rexec_state(config_s[0], &cfg);
+	close(config_s[0]);
+	fcntl(sp[0], F_SETFD, FD_CLOEXEC);
+	w->pid = pid;
+	w->sock = sp[0];
+	w->ready = 0;
+	debug("Forked pool worker %ld.", (long)pid);
+	return 0;
+}
+
+/*
+ * Resize the pool towards its target. Returns 1 if workers were started,
+ * which hands them the current ephemeral server key.
+ */
+static int
+pool_maintain(void)
+{
+	time_t now = time(NULL);
+	int i, n, spawned = 0;
+
+	if (pool == NULL)
+		return 0;
+	if (pool_target > options.prefork_min &&
+	    now - pool_last_change >= POOL_SHRINK_INTERVAL) {
+		pool_target--;
+		pool_last_change = now;
+		debug2("Pool target shrunk to %d", pool_target);
+	}
+	n = pool_count();
+	for (i = options.prefork_max - 1; i >= 0 && n > pool_target; i--) {
+		if (pool[i].sock != -1 && pool[i].ready) {
+			pool_remove(&pool[i], 1);
+			n--;
+		}
+	}
+	if (now < pool_retry_at)
+		return 0;
+	for (i = 0; i < options.prefork_max && n < pool_target; i++) {
+		if (pool[i].sock != -1)
+			continue;
+		if (pool_spawn(&pool[i]) != 0) {
+			pool_retry_at = now + POOL_RETRY_INTERVAL;
+			break;
+		}
+		spawned = 1;
+		n++;
+	}
+	return spawned;
+}
+
+/* Add the worker sockets to the listener's select set */
+static void
+pool_fdset(fd_set *fdset)
+{
+	int i;
+
+	for (i = 0; pool != NULL && i < options.prefork_max; i++)
+		if (pool[i].sock != -1)
+			FD_SET(pool[i].sock, fdset);
+}
+
+static int
+pool_maxfd(int maxfd)
+{
+	int i;
+
+	for (i = 0; pool != NULL && i < options.prefork_max; i++)
+		if (pool[i].sock > maxfd)
+			maxfd = pool[i].sock;
+	return maxfd;
+}
+
+/* Note workers that have become ready and those that have died */
+static void
+pool_check(fd_set *fdset)
+{
+	struct pool_worker *w;
+	u_char c;
+	int i;
+
+	for (i = 0; pool != NULL && i < options.prefork_max; i++) {
+		w = &pool[i];
+		if (w->sock == -1 || !FD_ISSET(w->sock, fdset))
+			continue;
+		if (!w->ready && read(w->sock, &c, 1) == 1) {
+			w->ready = 1;
+			debug3("Pool worker %ld ready", (long)w->pid);
+			continue;
+		}
+		/* Anything else means the worker has gone */
+		error("Pool worker %ld exited%s", (long)w->pid,
+		    w->ready ? "" : " during startup");
+		if (!w->ready)
+			pool_retry_at = time(NULL) + POOL_RETRY_INTERVAL;
+		pool_remove(w, 0);
+	}
+}
+
+/*
+ * Pass an accepted connection and its startup pipe to a ready worker.
+ * Returns 0 on success, or -1 if the caller must fork a child itself.
+ */
+static int
+pool_dispatch(int sock, int pipe)
+{
+	struct pool_worker *w = NULL;
+	Buffer m;
+	int i, r;
+
+	if (pool == NULL)
+		return -1;
+	for (i = 0; i < options.prefork_max; i++)
+		if (pool[i].sock != -1 && pool[i].ready) {
+			w = &pool[i];
+			break;
+		}
+	if (w == NULL) {
+		if (pool_target < options.prefork_max) {
+			pool_target = MIN(options.prefork_max,
+			    MAX(1, pool_target * 2));
+			debug2("Pool target grown to %d", pool_target);
+		}
+		pool_last_change = time(NULL);
+		return -1;
+	}
+	buffer_init(&m);
+	buffer_put_string(&m, preauth_ident, preauth_ident_len);
+	r = atomicio(vwrite, w->sock, "C", 1) != 1 ||
+	    mm_send_fd(w->sock, sock) == -1 ||
+	    mm_send_fd(w->sock, pipe) == -1 ||
+	    ssh_msg_send(w->sock, 0, &m) == -1;
+	buffer_free(&m);
+	if (r) {
+		error("Could not pass connection to pool worker %ld",
+		    (long)w->pid);
+		pool_remove(w, 1);
+		return -1;
+	}
+	debug("Passed connection to pool worker %ld.", (long)w->pid);
+	pool_remove(w, 0);
+	return 0;
+}
+
+/*
+ * In a worker: tell the listener we are ready, then wait for it to pass
+ * us a connection and its startup pipe. Exits if the listener goes away.
+ */
+static void
+pool_worker_wait(int *sock, int *pipe)
+{
+	Buffer m;
+	u_char c = 'R';
+
+	setproctitle("%s", "[pool]");
+	if (atomicio(vwrite, STDIN_FILENO, &c, 1) != 1 ||
+	    atomicio(read, STDIN_FILENO, &c, 1) != 1)
+		exit(0);
+	if (c != 'C')
+		fatal("%s: unexpected command %u", __func__, c);
+	if ((*sock = mm_receive_fd(STDIN_FILENO)) == -1 ||
+	    (*pipe = mm_receive_fd(STDIN_FILENO)) == -1)
+		fatal("%s: could not receive connection", __func__);
+	buffer_init(&m);
+	if (ssh_msg_recv(STDIN_FILENO, &m) == -1 ||
+	    buffer_get_char(&m) != 0)
+		fatal("%s: could not receive identification", __func__);
+	preauth_ident = buffer_get_string(&m, &preauth_ident_len);
+	if (preauth_ident_len == 0) {
+		xfree(preauth_ident);
+		preauth_ident = NULL;
+	}
+	buffer_free(&m);
+	close(STDIN_FILENO);
+}
+
+/*
+ * Connections held by the listener before forking. With
+ * PreauthConnections set, the listener sends its identification string
+ * on accept and collects the client's in its own select loop, and only
+ * connections that send one count against MaxStartups and get a process.
+ * Those that stay silent time out here, and when all slots are taken the
+ * oldest connection is dropped to make room. The bytes read so far are
+ * handed to the child, which parses them as if it had read them itself.
+ */
+#define PREAUTH_TIMEOUT		30	/* seconds to wait for the client */
+
+struct preauth_conn {
+	int	sock;		/* -1 if the slot is free */
+	int	done;		/* identification line is complete */
+	time_t	expires;
+	u_int	len;
+	char	buf[256];	/* as sshd_exchange_identification() */
+};
+
+static struct preauth_conn *preauth = NULL;
+static char *preauth_banner = NULL;
+
+static void
+preauth_init(void)
+{
+	int i;
+
+	if (options.preauth_connections <= 0 || debug_flag)
+		return;
+	preauth = xcalloc(options.preauth_connections, sizeof(*preauth));
+	for (i = 0; i < options.preauth_connections; i++)
+		preauth[i].sock = -1;
+	preauth_banner = make_server_version_string();
+}
+
+/* Drop a held connection; failed if it is the client's fault */
+static void
+preauth_drop(struct preauth_conn *pc, const char *why, int failed)
+{
+	char *ipaddr = get_peer_ipaddr(pc->sock);
+
+	logit("%s from %s", why, ipaddr);
+	xfree(ipaddr);
+	srclimit_done(pc->sock, !failed);
+	close(pc->sock);
+	pc->sock = -1;
+}
+
+/* Forget the identification handed to the last connection */
+static void
+preauth_clear(void)
+{
+	if (preauth_ident != NULL)
+		xfree(preauth_ident);
+	preauth_ident = NULL;
+	preauth_ident_len = 0;
+}
+
+/* Close all held connections in a forked child */
+static void
+preauth_close_socks(void)
+{
+	int i;
+
+	for (i = 0; preauth != NULL && i < options.preauth_connections; i++)
+		if (preauth[i].sock != -1)
+			close(preauth[i].sock);
+}
+
+/*
+ * Take over a newly accepted connection. Returns 0 if it is now held
+ * (or was dropped), or -1 if the caller should handle it directly.
+ * A held connection is charged to its source under its socket until
+ * it is dropped or handed on.
+ */
+static int
+preauth_add(int sock)
+{
+	struct preauth_conn *pc = NULL;
+	size_t len;
+	int i;
+
+	if (preauth == NULL)
+		return -1;
+	for (i = 0; i < options.preauth_connections; i++) {
+		if (preauth[i].sock == -1) {
+			pc = &preauth[i];
+			break;
+		}
+		if (!preauth[i].done &&
+		    (pc == NULL || preauth[i].expires < pc->expires))
+			pc = &preauth[i];
+	}
+	if (pc == NULL) {
+		/* Every slot is waiting to be forked */
+		close(sock);
+		return 0;
+	}
+	if (!srclimit_check_allow(sock, sock)) {
+		debug("drop connection from over-limit source");
+		close(sock);
+		return 0;
+	}
+	len = strlen(preauth_banner);
+	if (set_nonblock(sock) == -1 || write(sock, preauth_banner, len) !=
+	    (ssize_t)len) {
+		srclimit_done(sock, 0);
+		close(sock);
+		return 0;
+	}
+	if (pc->sock != -1)
+		preauth_drop(pc, "Too many pending connections, dropped one",
+		    0);
+	pc->sock = sock;
+	pc->done = 0;
+	pc->len = 0;
+	pc->expires = time(NULL) + (options.login_grace_time > 0 ?
+	    MIN(options.login_grace_time, PREAUTH_TIMEOUT) : PREAUTH_TIMEOUT);
+	return 0;
+}
+
+static void
+preauth_fdset(fd_set *fdset)
+{
+	int i;
+
+	for (i = 0; preauth != NULL && i < options.preauth_connections; i++)
+		if (preauth[i].sock != -1 && !preauth[i].done)
+			FD_SET(preauth[i].sock, fdset);
+}
+
+static int
+preauth_maxfd(int maxfd)
+{
+	int i;
+
+	for (i = 0; preauth != NULL && i < options.preauth_connections; i++)
+		if (preauth[i].sock > maxfd)
+			maxfd = preauth[i].sock;
+	return maxfd;
+}
+
+/*
+ * Read what has arrived of the clients' identification lines, without
+ * consuming anything beyond them, and expire connections that have
+ * taken too long.
+ */
+static void
+preauth_check(fd_set *fdset)
+{
+	struct preauth_conn *pc;
+	char buf[sizeof(pc->buf)];
+	time_t now = time(NULL);
+	ssize_t r, n;
+	int i;
+
+	for (i = 0; preauth != NULL && i < options.preauth_connections; i++) {
+		pc = &preauth[i];
+		if (pc->sock == -1 || pc->done)
+			continue;
+		if (!FD_ISSET(pc->sock, fdset)) {
+			if (now >= pc->expires)
+				preauth_drop(pc, "Did not receive "
+				    "identification string", 1);
+			continue;
+		}
+		r = recv(pc->sock, buf, sizeof(pc->buf) - 1 - pc->len,
+		    MSG_PEEK);
+		if (r == -1 && (errno == EINTR || errno == EAGAIN ||
+		    errno == EWOULDBLOCK))
+			continue;
+		if (r <= 0) {
+			preauth_drop(pc, "Did not receive identification "
+			    "string", 1);
+			continue;
+		}
+		/* Same end of line rules as sshd_exchange_identification */
+		for (n = 0; n < r && !pc->done; n++) {
+			pc->buf[pc->len++] = buf[n];
+			if (buf[n] == '\n' || pc->len == sizeof(pc->buf) - 1 ||
+			    (buf[n] == '\r' && pc->len == 13 &&
+			    strncmp(pc->buf, "SSH-1.5-W1.0", 12) == 0))
+				pc->done = 1;
+		}
+		if (read(pc->sock, buf, n) != n)
+			preauth_drop(pc, "Read error before identification",
+			    1);
+	}
+}
+
+/*
+ * Return the next connection whose client has identified itself, with
+ * its identification in preauth_ident, or -1 if there is none. It is
+ * still charged to its source under the returned socket.
+ */
+static int
+preauth_next(void)
+{
+	struct preauth_conn *pc;
+	int i, sock;
+
+	for (i = 0; preauth != NULL && i < options.preauth_connections; i++) {
+		pc = &preauth[i];
+		if (pc->sock == -1 || !pc->done)
+			continue;
+		sock = pc->sock;
+		pc->sock = -1;
+		if (unset_nonblock(sock) == -1) {
+			srclimit_done(sock, 1);
+			close(sock);
+			continue;
+		}
+		preauth_ident = xmalloc(pc->len);
+		memcpy(preauth_ident, pc->buf, pc->len);
+		preauth_ident_len = pc->len;
+		return sock;
+	}
+	return -1;
+}
+
+/*
+ * Multiple listener processes. With ListenerProcesses > 1 the master
+ * process only supervises: it forks that many listeners, each of which
+ * runs its own accept loop. The first inherits the master's sockets and
+ * the others bind their own with SO_REUSEPORT, so that the kernel spreads
+ * new connections across them. Every listener publishes its number of
+ * unauthenticated connections in a shared array, and MaxStartups is
+ * applied to their sum. The master restarts listeners that die and
+ * takes them down with it; a listener exits when the master goes away.
+ */
+#define LISTENER_RETRY_INTERVAL	10	/* seconds after a listener failed */
+
+struct listener {
+	pid_t	pid;
+	int	sock;		/* -1 if not running */
+	time_t	started;
+};
+
+static struct listener *listeners = NULL;	/* in the master */
+static int listener_index = 0;
+static int listener_sock = -1;		/* in a listener, to the master */
+static volatile int *listener_startups = NULL;
+
+/* Publish our number of unauthenticated connections */
+static void
+listener_set_startups(int startups)
+{
+	if (listener_startups != NULL)
+		listener_startups[listener_index] = startups;
+}
+
+/* Unauthenticated connections over all listeners */
+static int
+listener_total_startups(int startups)
+{
+	int i, total = 0;
+
+	if (listener_startups == NULL)
+		return startups;
+	for (i = 0; i < options.listener_procs; i++)
+		total += listener_startups[i];
+	return total;
+}
+
+static void
+listeners_kill(void)
+{
+	int i;
+
+	for (i = 0; listeners != NULL && i < options.listener_procs; i++) {
+		if (listeners[i].sock == -1)
+			continue;
+		kill(listeners[i].pid, SIGTERM);
+		close(listeners[i].sock);
+		listeners[i].sock = -1;
+	}
+}
+
+/*
+ * Start listener number idx. Returns 1 in the new listener, 0 in the
+ * master, or -1 on failure.
+ */
+static int
+listener_spawn(int idx)
+{
+	struct listener *l = &listeners[idx];
+	int i, sp[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == -1) {
+		error("listener socketpair: %s", strerror(errno));
+		return -1;
+	}
+	listener_startups[idx] = 0;
+	if ((pid = fork()) == 0) {
+		close(sp[0]);
+		for (i = 0; i < options.listener_procs; i++)
+			if (listeners[i].sock != -1)
+				close(listeners[i].sock);
+		xfree(listeners);
+		listeners = NULL;
+		listener_index = idx;
+		listener_sock = sp[1];
+		fcntl(listener_sock, F_SETFD, FD_CLOEXEC);
+		/* The master restarts us all on SIGHUP */
+		signal(SIGHUP, SIG_IGN);
+		if (idx != 0) {
+			close_listen_socks();
+			num_listen_socks = 0;
+			server_listen();
+		}
+		return 1;
+	}
+	close(sp[1]);
+	if (pid < 0) {
+		error("fork: %.100s", strerror(errno));
+		close(sp[0]);
+		return -1;
+	}
+	fcntl(sp[0], F_SETFD, FD_CLOEXEC);
+	l->pid = pid;
+	l->sock = sp[0];
+	l->started = time(NULL);
+	debug("Forked listener %d, pid %ld.", idx, (long)pid);
+	return 0;
+}
+
+/*
+ * Run the master of multiple listeners. Returns only in a listener, or
+ * if listeners are not available.
+ */
+static void
+listener_supervise(void)
+{
+	fd_set *fdset = NULL;
+	struct timeval tv;
+	struct listener *l;
+	time_t now, retry_at = 0;
+	int i, maxfd, ret;
+	char c;
+
+#ifdef SO_REUSEPORT
+	listener_startups = xmmap(options.listener_procs *
+	    sizeof(*listener_startups));
+	if (listener_startups == (void *)MAP_FAILED) {
+		error("ListenerProcesses disabled: mmap: %s",
+		    strerror(errno));
+		listener_startups = NULL;
+		return;
+	}
+#else
+	logit("ListenerProcesses disabled: no SO_REUSEPORT on this system");
+	return;
+#endif
+	listeners = xcalloc(options.listener_procs, sizeof(*listeners));
+	for (i = 0; i < options.listener_procs; i++)
+		listeners[i].sock = -1;
+
+	for (;;) {
+		if (received_sighup) {
+			listeners_kill();
+			sighup_restart();
+		}
+		if (received_siginfo) {
+			received_siginfo = 0;
+			for (i = 0; i < options.listener_procs; i++)
+				if (listeners[i].sock != -1)
+					kill(listeners[i].pid, SIGUSR1);
+		}
+		if (received_sigterm) {
+			logit("Received signal %d; terminating.",
+			    (int) received_sigterm);
+			listeners_kill();
+			close_listen_socks();
+			unlink(options.pid_file);
+			exit(255);
+		}
+		now = time(NULL);
+		for (i = 0; i < options.listener_procs; i++) {
+			if (listeners[i].sock != -1 || now < retry_at)
+				continue;
+			switch (listener_spawn(i)) {
+			case 1:
+				if (fdset != NULL)
+					xfree(fdset);
+				return;
+			case -1:
+				retry_at = now + LISTENER_RETRY_INTERVAL;
+				break;
+			}
+		}
+
+		maxfd = 0;
+		for (i = 0; i < options.listener_procs; i++)
+			maxfd = MAX(maxfd, listeners[i].sock);
+		if (fdset != NULL)
+			xfree(fdset);
+		fdset = (fd_set *)xcalloc(howmany(maxfd + 1, NFDBITS),
+		    sizeof(fd_mask));
+		for (i = 0; i < options.listener_procs; i++)
+			if (listeners[i].sock != -1)
+				FD_SET(listeners[i].sock, fdset);
+		tv.tv_sec = LISTENER_RETRY_INTERVAL;
+		tv.tv_usec = 0;
+		ret = select(maxfd + 1, fdset, NULL, NULL, &tv);
+		if (ret < 0 && errno != EINTR)
+			error("select: %.100s", strerror(errno));
+		if (ret <= 0)
+			continue;
+		for (i = 0; i < options.listener_procs; i++) {
+			l = &listeners[i];
+			if (l->sock == -1 || !FD_ISSET(l->sock, fdset) ||
+			    read(l->sock, &c, 1) != 0)
+				continue;
+			error("Listener %d (pid %ld) exited", i, (long)l->pid);
+			/* Don't spin if it dies straight away */
+			if (time(NULL) - l->started < LISTENER_RETRY_INTERVAL)
+				retry_at = time(NULL) + LISTENER_RETRY_INTERVAL;
+			close(l->sock);
+			l->sock = -1;
+			/* Its connections are no longer counted */
+			listener_startups[i] = 0;
+		}
+	}
+}
+
 /*
  * The main TCP accept loop. Note that, for the non-debug case, returns
  * from this function are in a forked subprocess.
@@ -1074,10 +1903,12 @@ static void
 server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 {
 	fd_set *fdset;
-	int i, j, ret, maxfd;
+	int i, j, ret, maxfd, pooled, held;
 	int key_used = 0, startups = 0;
 	int startup_p[2] = { -1 , -1 };
 	struct sockaddr_storage from;
+	struct timeval tv;
+	char c;
 	socklen_t fromlen;
 	pid_t pid;
 
@@ -1091,6 +1922,14 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 	startup_pipes = xcalloc(options.max_startups, sizeof(int));
 	for (i = 0; i < options.max_startups; i++)
 		startup_pipes[i] = -1;
+	pool_init();
+	preauth_init();
+	/* Held connections are charged to their sources too */
+	srclimit_init(options.max_startups +
+	    (preauth != NULL ? options.preauth_connections : 0),
+	    options.per_source_max_startups, options.per_net_max_startups,
+	    options.per_source_max_failures, options.per_net_max_failures,
+	    options.per_source_masklen_ipv4, options.per_source_masklen_ipv6);
 
 	/*
 	 * Stay listening for connections until the system crashes or
@@ -1099,8 +1938,15 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 	for (;;) {
 		if (received_sighup)
 			sighup_restart();
+		preauth_clear();
+		/* New workers are given the ephemeral server key */
+		if (pool_maintain())
+			server_key_given(&key_used);
 		if (fdset != NULL)
 			xfree(fdset);
+		maxfd = pool_maxfd(maxfd);
+		maxfd = preauth_maxfd(maxfd);
+		maxfd = MAX(maxfd, listener_sock);
 		fdset = (fd_set *)xcalloc(howmany(maxfd + 1, NFDBITS),
 		    sizeof(fd_mask));
 
@@ -1109,25 +1955,46 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 		for (i = 0; i < options.max_startups; i++)
 			if (startup_pipes[i] != -1)
 				FD_SET(startup_pipes[i], fdset);
+		pool_fdset(fdset);
+		preauth_fdset(fdset);
+		if (listener_sock != -1)
+			FD_SET(listener_sock, fdset);
 
 		/* Wait in select until there is a connection. */
-		ret = select(maxfd+1, fdset, NULL, NULL, NULL);
+		tv.tv_sec = POOL_WAKEUP_INTERVAL;
+		tv.tv_usec = 0;
+		ret = select(maxfd+1, fdset, NULL, NULL,
+		    (pool != NULL || preauth != NULL) ? &tv : NULL);
 		if (ret < 0 && errno != EINTR)
 			error("select: %.100s", strerror(errno));
 		if (received_sigterm) {
 			logit("Received signal %d; terminating.",
 			    (int) received_sigterm);
 			close_listen_socks();
-			unlink(options.pid_file);
+			if (listener_sock == -1)
+				unlink(options.pid_file);
 			exit(255);
 		}
 		if (key_used && key_do_regen) {
 			generate_ephemeral_server_key();
+			/* Idle workers hold the old key */
+			pool_flush();
 			key_used = 0;
 			key_do_regen = 0;
 		}
+		if (received_siginfo) {
+			received_siginfo = 0;
+			srclimit_log_stats();
+		}
 		if (ret < 0)
 			continue;
+		pool_check(fdset);
+		preauth_check(fdset);
+		if (listener_sock != -1 && FD_ISSET(listener_sock, fdset)) {
+			logit("Listener master has gone; exiting.");
+			close_listen_socks();
+			exit(255);
+		}
 
 		for (i = 0; i < options.max_startups; i++)
 			if (startup_pipes[i] != -1 &&
@@ -1136,42 +2003,78 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 				 * the read end of the pipe is ready
 				 * if the child has closed the pipe
 				 * after successful authentication
-				 * or if the child has died
+				 * or if the child has died. A child that
+				 * has authenticated writes a byte first.
 				 */
+				srclimit_done(startup_pipes[i],
+				    read(startup_pipes[i], &c, 1) == 1);
 				close(startup_pipes[i]);
 				startup_pipes[i] = -1;
 				startups--;
+				listener_set_startups(startups);
 			}
-		for (i = 0; i < num_listen_socks; i++) {
-			if (!FD_ISSET(listen_socks[i], fdset))
-				continue;
-			fromlen = sizeof(from);
-			*newsock = accept(listen_socks[i],
-			    (struct sockaddr *)&from, &fromlen);
-			if (*newsock < 0) {
-				if (errno != EINTR && errno != EAGAIN &&
-				    errno != EWOULDBLOCK)
-					error("accept: %.100s", strerror(errno));
+		/*
+		 * New connections from the listen sockets, followed by
+		 * held ones whose clients have now identified themselves.
+		 */
+		for (i = 0; ; i++) {
+			preauth_clear();
+			held = i >= num_listen_socks;
+			if (held) {
+				if ((*newsock = preauth_next()) == -1)
+					break;
+			} else if (!FD_ISSET(listen_socks[i], fdset))
 				continue;
+			else {
+				fromlen = sizeof(from);
+				*newsock = accept(listen_socks[i],
+				    (struct sockaddr *)&from, &fromlen);
+				if (*newsock < 0) {
+					if (errno != EINTR && errno != EAGAIN &&
+					    errno != EWOULDBLOCK)
+						error("accept: %.100s",
+						    strerror(errno));
+					continue;
+				}
+				if (preauth_add(*newsock) == 0)
+					continue;
+				if (unset_nonblock(*newsock) == -1) {
+					close(*newsock);
+					continue;
+				}
 			}
-			if (unset_nonblock(*newsock) == -1) {
+			if (drop_connection(listener_total_startups(startups))
+			    == 1) {
+				debug("drop connection #%d", startups);
+				if (held)
+					srclimit_done(*newsock, 1);
 				close(*newsock);
 				continue;
 			}
-			if (drop_connection(startups) == 1) {
-				debug("drop connection #%d", startups);
+			if (pipe(startup_p) == -1) {
+				if (held)
+					srclimit_done(*newsock, 1);
 				close(*newsock);
 				continue;
 			}
-			if (pipe(startup_p) == -1) {
+			/* Held connections were charged when they arrived */
+			if (held)
+				srclimit_move(*newsock, startup_p[0]);
+			else if (!srclimit_check_allow(*newsock, startup_p[0])) {
+				debug("drop connection from over-limit source");
 				close(*newsock);
+				close(startup_p[0]);
+				close(startup_p[1]);
 				continue;
 			}
 
-			if (rexec_flag && socketpair(AF_UNIX,
+			pooled = !debug_flag &&
+			    pool_dispatch(*newsock, startup_p[1]) == 0;
+			if (!pooled && rexec_flag && socketpair(AF_UNIX,
 			    SOCK_STREAM, 0, config_s) == -1) {
 				error("reexec socketpair: %s",
 				    strerror(errno));
+				srclimit_done(startup_p[0], 1);
 				close(*newsock);
 				close(startup_p[0]);
 				close(startup_p[1]);
@@ -1184,9 +2087,17 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 					if (maxfd < startup_p[0])
 						maxfd = startup_p[0];
 					startups++;
+					listener_set_startups(startups);
 					break;
 				}
 
+			/* A pool worker has taken over the connection */
+			if (pooled) {
+				close(startup_p[1]);
+				close(*newsock);
+				continue;
+			}
+
 			/*
 			 * Got connection.  Fork a child to handle it, unless
 			 * we are in debugging mode.
@@ -1218,6 +2129,11 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 			 * the child process the connection. The
 			 * parent continues listening.
 			 */
+#ifdef GSSAPI
+			/* Re-executed children get this with their state */
+			if (!rexec_flag && options.gss_keyex)
+				ssh_gssapi_server_prepare();
+#endif
 			platform_pre_fork();
 			if ((pid = fork()) == 0) {
 				/*
@@ -1232,6 +2148,10 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 				startup_pipe = startup_p[1];
 				close_startup_pipes();
 				close_listen_socks();
+				pool_close_socks();
+				preauth_close_socks();
+				if (listener_sock != -1)
+					close(listener_sock);
 				*sock_in = *newsock;
 				*sock_out = *newsock;
 				log_init(__progname,
@@ -1262,13 +2182,7 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 			 * Mark that the key has been used (it
 			 * was "given" to the child).
 			 */
-			if ((options.protocol & SSH_PROTO_1) &&
-			    key_used == 0) {
-				/* Schedule server key regeneration alarm. */
-				signal(SIGALRM, key_regeneration_alarm);
-				alarm(options.key_regeneration_time);
-				key_used = 1;
-			}
+			server_key_given(&key_used);
 
 			close(*newsock);
 
@@ -1336,7 +2250,7 @@ main(int ac, char **av)
 	initialize_server_options(&options);
 
 	/* Parse command-line arguments. */
-	while ((opt = getopt(ac, av, "f:p:b:k:h:g:u:o:C:dDeiqrtQRT46")) != -1) {
+	while ((opt = getopt(ac, av, "f:p:b:k:h:g:u:o:C:dDeiqrtQRT46W")) != -1) {
 		switch (opt) {
 		case '4':
 			options.address_family = AF_INET;
@@ -1378,6 +2292,11 @@ main(int ac, char **av)
 			rexeced_flag = 1;
 			inetd_flag = 1;
 			break;
+		case 'W':
+			pool_worker_flag = 1;
+			rexeced_flag = 1;
+			inetd_flag = 1;
+			break;
 		case 'Q':
 			/* ignored */
 			break;
@@ -1719,6 +2638,13 @@ main(int ac, char **av)
 		}
 		rexec_argv[rexec_argc] = "-R";
 		rexec_argv[rexec_argc + 1] = NULL;
+
+		/* Pool workers are started the same way, but wait */
+		pool_argv = xcalloc(rexec_argc + 2, sizeof(char *));
+		for (i = 0; i < rexec_argc; i++)
+			pool_argv[i] = saved_argv[i];
+		pool_argv[rexec_argc] = "-W";
+		pool_argv[rexec_argc + 1] = NULL;
 	}
 
 	/* Ensure that umask disallows at least group and world write */
@@ -1778,6 +2704,7 @@ main(int ac, char **av)
 		signal(SIGCHLD, main_sigchld_handler);
 		signal(SIGTERM, sigterm_handler);
 		signal(SIGQUIT, sigterm_handler);
+		signal(SIGUSR1, siginfo_handler);
 
 		/*
 		 * Write out the pid file after the sigterm handler
@@ -1795,6 +2722,15 @@ main(int ac, char **av)
 			}
 		}
 
+		/* Supervise listeners that each accept on their own */
+		if (options.listener_procs > 1 && !debug_flag)
+			listener_supervise();
+		/* Only the supervising master needs the addresses kept */
+		if (options.listen_addrs != NULL) {
+			freeaddrinfo(options.listen_addrs);
+			options.listen_addrs = NULL;
+		}
+
 		/* Accept a connection and return in a forked child */
 		server_accept_loop(&sock_in, &sock_out,
 		    &newsock, config_s);
@@ -1874,6 +2810,7 @@ main(int ac, char **av)
 	signal(SIGQUIT, SIG_DFL);
 	signal(SIGCHLD, SIG_DFL);
 	signal(SIGINT, SIG_DFL);
+	signal(SIGUSR1, SIG_DFL);
 
 	/*
 	 * Register our connection.  This turns encryption off because we do
@@ -2046,6 +2983,8 @@ main(int ac, char **av)
 	signal(SIGALRM, SIG_DFL);
 	authctxt->authenticated = 1;
 	if (startup_pipe != -1) {
+		/* Tell the listener this was not a failed connection */
+		(void)atomicio(vwrite, startup_pipe, "A", 1);
 		close(startup_pipe);
 		startup_pipe = -1;
 	}
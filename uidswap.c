@@ -26,6 +26,7 @@
 #include "log.h"
 #include "uidswap.h"
 #include "xmalloc.h"
+#include "nsscache.h"
 
 /*
  * Note: all these functions must work in all of the following cases:
@@ -96,7 +97,7 @@ temporarily_use_uid(struct passwd *pw)
 
 	/* set and save the user's groups */
 	if (user_groupslen == -1) {
-		if (initgroups(pw->pw_name, pw->pw_gid) < 0)
+		if (nsscache_initgroups(pw->pw_name, pw->pw_gid) < 0)
 			fatal("initgroups: %s: %.100s", pw->pw_name,
 			    strerror(errno));
 